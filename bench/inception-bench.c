@@ -0,0 +1,872 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * inception-bench: microbenchmarks for the libinception entry points we pay
+ * for on every launch
+ *
+ * Config and environment cases run as any user. The mount cases need root or
+ * unprivileged user namespaces and are reported as skipped otherwise, the
+ * concurrent launch case needs root.
+ * Results go to stdout (or -o file) as json, times in nanoseconds.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <jansson.h>
+
+#include "inception.h"
+
+#define DEFAULT_ITERATIONS 200
+
+struct bench_opts
+{
+	int iterations;
+	const char* filter;
+	char* workdir;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return((x > y) - (x < y));
+}
+
+static uint64_t percentile(const uint64_t* sorted, int n, double p)
+{
+	int idx = (int) (p * (n - 1) + 0.5);
+	return(sorted[idx]);
+}
+
+/**
+ * Summarize samples into a result object and append it to results
+ */
+static void report(json_t* results, const char* name, json_t* params,
+			uint64_t* samples, int n)
+{
+	json_t* res = json_object();
+	uint64_t total = 0;
+	int i;
+	json_object_set_new(res, "name", json_string(name));
+	json_object_set_new(res, "params", params ? params : json_object());
+	if(n <= 0)
+	{
+		json_object_set_new(res, "skipped", json_true());
+		json_array_append_new(results, res);
+		return;
+	}
+	qsort(samples, n, sizeof(uint64_t), cmp_u64);
+	for(i=0;i<n;i++)
+		total += samples[i];
+	json_object_set_new(res, "iterations", json_integer(n));
+	json_object_set_new(res, "min_ns", json_integer(samples[0]));
+	json_object_set_new(res, "mean_ns", json_integer(total / n));
+	json_object_set_new(res, "p50_ns", json_integer(percentile(samples, n, 0.50)));
+	json_object_set_new(res, "p90_ns", json_integer(percentile(samples, n, 0.90)));
+	json_object_set_new(res, "p99_ns", json_integer(percentile(samples, n, 0.99)));
+	json_object_set_new(res, "max_ns", json_integer(samples[n-1]));
+	json_array_append_new(results, res);
+}
+
+static int wanted(const struct bench_opts* opts, const char* name)
+{
+	return(!opts->filter || strstr(name, opts->filter));
+}
+
+static int mkdir_p(const char* path)
+{
+	char* tmp = strdup(path);
+	char* c;
+	if(!tmp)
+		return(-1);
+	for(c=tmp+1;*c;c++)
+	{
+		if(*c == '/')
+		{
+			*c = '\0';
+			if(mkdir(tmp, 0700) && errno != EEXIST)
+			{
+				free(tmp);
+				return(-1);
+			}
+			*c = '/';
+		}
+	}
+	free(tmp);
+	if(mkdir(path, 0700) && errno != EEXIST)
+		return(-1);
+	return(0);
+}
+
+/**
+ * Make sure a workdir given with -d exists and is ours alone: we run as root
+ * and write configs and image roots under it, so nobody else may be able to
+ * plant files (or symlinks) there
+ * @return 0 if it is safe to use
+ */
+static int check_workdir(const char* path)
+{
+	struct stat st;
+	if(mkdir(path, 0700) && errno != EEXIST)
+		return(-1);
+	if(lstat(path, &st))
+		return(-1);
+	if(!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP|S_IWOTH)))
+	{
+		errno = EPERM;
+		return(-1);
+	}
+	return(0);
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+	(void) st;
+	(void) ftw;
+	if(flag == FTW_DP)
+		return(rmdir(path));
+	return(unlink(path));
+}
+
+/**
+ * Done with a config from make_config(): drop the catalog and check cache
+ * entries loading it left in the run dir (usually tmpfs)
+ */
+static void drop_config(char* path)
+{
+	if(!path)
+		return;
+	inception_forget_config(path);
+	free(path);
+}
+
+/**
+ * Write a config with nimages images of nmounts mounts each. Every image
+ * shares one root under workdir so validation stats real directories.
+ * @return ownership of the config path or NULL
+ */
+static char* make_config(const struct bench_opts* opts, int nimages, int nmounts)
+{
+	char* root;
+	char* path;
+	char* dir;
+	FILE* cfg;
+	int fd;
+	int i, m;
+
+	if(asprintf(&root, "%s/root-%d", opts->workdir, nmounts) == -1)
+		return(NULL);
+	for(m=0;m<nmounts;m++)
+	{
+		if(asprintf(&dir, "%s/m/%d", root, m) == -1)
+			break;
+		mkdir_p(dir);
+		free(dir);
+		if(asprintf(&dir, "%s/src/%d", opts->workdir, m) == -1)
+			break;
+		mkdir_p(dir);
+		free(dir);
+	}
+	if(asprintf(&path, "%s/config-%d-%d.json", opts->workdir, nimages, nmounts) == -1)
+	{
+		free(root);
+		return(NULL);
+	}
+	//left over from an earlier run with the same -d
+	unlink(path);
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0600);
+	cfg = fd < 0 ? NULL : fdopen(fd, "w");
+	if(!cfg)
+	{
+		if(fd >= 0)
+			close(fd);
+		free(root);
+		free(path);
+		return(NULL);
+	}
+	fprintf(cfg, "{\"images\": [\n");
+	for(i=0;i<nimages;i++)
+	{
+		fprintf(cfg, "%s{\"name\": \"image%d\", \"imgroot\": \"%s\", \"mounts\": [",
+			i ? ",\n" : "", i, root);
+		for(m=0;m<nmounts;m++)
+		{
+			fprintf(cfg, "%s{\"from\": \"%s/src/%d\", \"to\": \"/m/%d\"}",
+				m ? ", " : "", opts->workdir, m, m);
+		}
+		fprintf(cfg, "]}");
+	}
+	fprintf(cfg, "\n]}\n");
+	fclose(cfg);
+	free(root);
+	return(path);
+}
+
+static void bench_config(const struct bench_opts* opts, json_t* results)
+{
+	static const int image_counts[] = {10, 100, 1000, 10000};
+	static const int mount_counts[] = {1, 10, 100, 1000};
+	uint64_t* samples = malloc(sizeof(uint64_t)*opts->iterations);
+	int c, i;
+
+	for(c=0;c<8;c++)
+	{
+		//sweep images with a handful of mounts, then mounts with one image
+		int nimages = c < 4 ? image_counts[c] : 1;
+		int nmounts = c < 4 ? 4 : mount_counts[c-4];
+		char key[32];
+		char* path;
+		json_t* params;
+		json_t* config_root;
+		json_t* last;
+		json_error_t err;
+
+		if(!wanted(opts, "parse_config") && !wanted(opts, "load_image"))
+			break;
+		path = make_config(opts, nimages, nmounts);
+		if(!path)
+			continue;
+		//the last image is the worst case for a linear scan
+		snprintf(key, sizeof(key), "image%d", nimages - 1);
+
+		if(wanted(opts, "parse_config"))
+		{
+			for(i=0;i<opts->iterations;i++)
+			{
+				image_config_t image;
+				uint64_t start;
+				memset(&image, 0, sizeof(image));
+				start = now_ns();
+				parse_config(path, key, &image);
+				samples[i] = now_ns() - start;
+				free_image_fields(&image);
+			}
+			params = json_object();
+			json_object_set_new(params, "images", json_integer(nimages));
+			json_object_set_new(params, "mounts", json_integer(nmounts));
+			report(results, "parse_config", params, samples, opts->iterations);
+		}
+
+		if(wanted(opts, "load_image"))
+		{
+			config_root = json_load_file(path, 0, &err);
+			last = config_root ?
+				json_array_get(json_object_get(config_root, "images"), nimages - 1) : NULL;
+			for(i=0;last && i<opts->iterations;i++)
+			{
+				image_config_t image;
+				uint64_t start;
+				memset(&image, 0, sizeof(image));
+				start = now_ns();
+				load_image(last, &image);
+				samples[i] = now_ns() - start;
+				free_image_fields(&image);
+			}
+			params = json_object();
+			json_object_set_new(params, "images", json_integer(nimages));
+			json_object_set_new(params, "mounts", json_integer(nmounts));
+			report(results, "load_image", params, samples, last ? opts->iterations : 0);
+			if(config_root)
+				json_decref(config_root);
+		}
+		drop_config(path);
+	}
+	free(samples);
+}
+
+/**
+ * Start an idle copy of ourselves carrying env_bytes worth of environment
+ * @return pid or -1
+ */
+static pid_t spawn_env_holder(size_t env_bytes)
+{
+	size_t var_len = 1024;
+	size_t nvars = env_bytes / var_len;
+	char** env;
+	size_t i;
+	pid_t pid;
+
+	if(nvars == 0)
+		nvars = 1;
+	env = calloc(nvars + 1, sizeof(char*));
+	if(!env)
+		return(-1);
+	for(i=0;i<nvars;i++)
+	{
+		env[i] = malloc(var_len);
+		if(!env[i])
+			return(-1);
+		snprintf(env[i], var_len, "BENCH_VAR_%zu=", i);
+		memset(env[i] + strlen(env[i]), 'x', var_len - strlen(env[i]) - 1);
+		env[i][var_len - 1] = '\0';
+	}
+	pid = fork();
+	if(pid == 0)
+	{
+		//execve caps args+env at a quarter of the stack limit
+		struct rlimit rl;
+		char* args[] = {"inception-bench", "--idle", NULL};
+		if(getrlimit(RLIMIT_STACK, &rl) == 0)
+		{
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_STACK, &rl);
+		}
+		execve("/proc/self/exe", args, env);
+		_exit(127);
+	}
+	for(i=0;i<nvars;i++)
+		free(env[i]);
+	free(env);
+	return(pid);
+}
+
+static const size_t env_sizes[] = {1024, 16*1024, 256*1024, 1024*1024, 2*1024*1024};
+
+/**
+ * Per image rules applied to an in memory environment of each size
+ */
+static void bench_filter_environ(const struct bench_opts* opts, json_t* results)
+{
+	static char* rules[] = {"+BENCH_*", "+PATH", "+HOME", "-BENCH_VAR_1*", "BENCH_SET=1"};
+	uint64_t* samples = malloc(sizeof(uint64_t)*opts->iterations);
+	image_config_t image;
+	size_t s, v;
+	int i;
+
+	memset(&image, 0, sizeof(image));
+	image.env_rules = rules;
+	image.num_env_rules = sizeof(rules)/sizeof(rules[0]);
+	for(s=0;s<sizeof(env_sizes)/sizeof(env_sizes[0]);s++)
+	{
+		size_t nvars = env_sizes[s] / 1024 ? env_sizes[s] / 1024 : 1;
+		char** env = calloc(nvars + 1, sizeof(char*));
+		json_t* params = json_object();
+		for(v=0;env && v<nvars;v++)
+		{
+			env[v] = malloc(1024);
+			snprintf(env[v], 1024, "BENCH_VAR_%zu=", v);
+			memset(env[v] + strlen(env[v]), 'x', 1024 - strlen(env[v]) - 1);
+			env[v][1023] = '\0';
+		}
+		for(i=0;env && i<opts->iterations;i++)
+		{
+			uint64_t start = now_ns();
+			char** filtered = filter_environ(&image, env);
+			samples[i] = now_ns() - start;
+			free(filtered);
+		}
+		json_object_set_new(params, "bytes", json_integer(env_sizes[s]));
+		report(results, "filter_environ", params, samples, env ? opts->iterations : 0);
+		for(v=0;env && v<nvars;v++)
+			free(env[v]);
+		free(env);
+	}
+	free(samples);
+}
+
+static void bench_environ(const struct bench_opts* opts, json_t* results)
+{
+	uint64_t* samples = malloc(sizeof(uint64_t)*opts->iterations);
+	size_t s;
+	int i, n;
+
+	if(wanted(opts, "filter_environ"))
+		bench_filter_environ(opts, results);
+	if(!wanted(opts, "load_insecure_environ"))
+	{
+		free(samples);
+		return;
+	}
+	for(s=0;s<sizeof(env_sizes)/sizeof(env_sizes[0]);s++)
+	{
+		json_t* params = json_object();
+		char* probe;
+		pid_t pid = spawn_env_holder(env_sizes[s]);
+		n = 0;
+		json_object_set_new(params, "bytes", json_integer(env_sizes[s]));
+		//wait for the exec so we read the holder's environment, not ours
+		for(i=0;pid > 0 && i<1000;i++)
+		{
+			char buf[32];
+			int fd;
+			ssize_t len;
+			if(asprintf(&probe, "/proc/%d/cmdline", pid) == -1)
+				break;
+			fd = open(probe, O_RDONLY);
+			free(probe);
+			len = fd >= 0 ? read(fd, buf, sizeof(buf)) : -1;
+			if(fd >= 0)
+				close(fd);
+			if(len > 0 && memmem(buf, len, "--idle", 6))
+			{
+				n = opts->iterations;
+				break;
+			}
+			usleep(1000);
+		}
+		for(i=0;i<n;i++)
+		{
+			char** env;
+			uint64_t start = now_ns();
+			env = load_insecure_environ(pid);
+			samples[i] = now_ns() - start;
+			free_insecure_environ(env);
+		}
+		report(results, "load_insecure_environ", params, samples, n);
+		if(pid > 0)
+		{
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+	}
+	free(samples);
+}
+
+static void bench_identity(const struct bench_opts* opts, json_t* results)
+{
+	uint64_t* samples = malloc(sizeof(uint64_t)*opts->iterations);
+	int i;
+
+	if(wanted(opts, "build_default_environ"))
+	{
+		for(i=0;i<opts->iterations;i++)
+		{
+			image_config_t image;
+			char** e;
+			uint64_t start;
+			memset(&image, 0, sizeof(image));
+			start = now_ns();
+			if(build_default_environ(&image))
+			{
+				if(image.user)
+					free_identity(image.user);
+				free(image.user);
+				break;
+			}
+			samples[i] = now_ns() - start;
+			for(e=image.environ;*e;e++)
+				free(*e);
+			free(image.environ);
+			free_identity(image.user);
+			free(image.user);
+		}
+		//only as many as ran, none (skipped) for a user without a name
+		report(results, "build_default_environ", NULL, samples, i);
+	}
+	if(wanted(opts, "find_shell"))
+	{
+		for(i=0;i<opts->iterations;i++)
+		{
+			image_config_t image;
+			uint64_t start;
+			memset(&image, 0, sizeof(image));
+			start = now_ns();
+			find_shell(&image);
+			samples[i] = now_ns() - start;
+			free(image.shell);
+			free(image.shell_full_path);
+			free_identity(image.user);
+			free(image.user);
+		}
+		report(results, "find_shell", NULL, samples, opts->iterations);
+	}
+	if(wanted(opts, "resolve_identity"))
+	{
+		for(i=0;i<opts->iterations;i++)
+		{
+			inception_identity_t id;
+			uint64_t start = now_ns();
+			resolve_identity(getuid(), getgid(), &id);
+			samples[i] = now_ns() - start;
+			free_identity(&id);
+		}
+		report(results, "resolve_identity", NULL, samples, opts->iterations);
+	}
+	free(samples);
+}
+
+/**
+ * Get a private mount namespace we are allowed to mount in, using a user
+ * namespace when we aren't root
+ * @return 0 on success
+ */
+static int enter_scratch_namespace()
+{
+	char map[64];
+	uid_t uid = geteuid();
+	gid_t gid = getegid();
+	int fd;
+
+	if(uid == 0)
+		return(unshare(CLONE_NEWNS) ||
+			mount("/", "/", NULL, MS_SLAVE|MS_REC, NULL));
+	if(unshare(CLONE_NEWUSER|CLONE_NEWNS))
+		return(-1);
+	fd = open("/proc/self/setgroups", O_WRONLY);
+	if(fd >= 0)
+	{
+		write(fd, "deny", 4);
+		close(fd);
+	}
+	snprintf(map, sizeof(map), "0 %d 1", uid);
+	fd = open("/proc/self/uid_map", O_WRONLY);
+	if(fd < 0 || write(fd, map, strlen(map)) < 0)
+		return(-1);
+	close(fd);
+	snprintf(map, sizeof(map), "0 %d 1", gid);
+	fd = open("/proc/self/gid_map", O_WRONLY);
+	if(fd < 0 || write(fd, map, strlen(map)) < 0)
+		return(-1);
+	close(fd);
+	return(mount("/", "/", NULL, MS_SLAVE|MS_REC, NULL));
+}
+
+static void bench_mounts(const struct bench_opts* opts, json_t* results)
+{
+	static const int mount_counts[] = {1, 10, 100, 1000};
+	static const char* engines[] = {"do_bind_mounts", "do_bind_mounts_fd"};
+	uint64_t* samples = malloc(sizeof(uint64_t)*opts->iterations);
+	int c, e, i, n;
+
+	for(e=0;e<2;e++)
+	{
+		if(!wanted(opts, engines[e]))
+			continue;
+		for(c=0;c<4;c++)
+		{
+			image_config_t image;
+			json_t* params = json_object();
+			char* path = make_config(opts, 1, mount_counts[c]);
+			json_object_set_new(params, "mounts", json_integer(mount_counts[c]));
+			memset(&image, 0, sizeof(image));
+			n = 0;
+			if(path && parse_config(path, "image0", &image) == 0)
+			{
+				//every sample needs a fresh namespace, so each is a child
+				for(i=0;i<opts->iterations;i++)
+				{
+					int fds[2];
+					uint64_t sample;
+					pid_t pid;
+					if(pipe(fds))
+						break;
+					pid = fork();
+					if(pid == 0)
+					{
+						uint64_t start;
+						int ok;
+						close(fds[0]);
+						if(enter_scratch_namespace())
+							_exit(1);
+						start = now_ns();
+						if(e == 0)
+						{
+							do_bind_mounts(&image);
+							ok = 1;
+						}
+						else
+						{
+							ok = do_bind_mounts_fd(&image) == 0;
+						}
+						sample = now_ns() - start;
+						if(ok)
+							write(fds[1], &sample, sizeof(sample));
+						_exit(0);
+					}
+					close(fds[1]);
+					if(pid > 0 && read(fds[0], &sample, sizeof(sample)) == sizeof(sample))
+						samples[n++] = sample;
+					close(fds[0]);
+					if(pid > 0)
+						waitpid(pid, NULL, 0);
+					if(n == 0)
+						break;
+				}
+			}
+			report(results, engines[e], params, samples, n);
+			free_image_fields(&image);
+			drop_config(path);
+		}
+	}
+	free(samples);
+}
+
+struct spawn_worker
+{
+	pthread_t thread;
+	const char* config;
+	int launches;
+	uint64_t* samples;
+	int n;
+};
+
+static void quiet_log(void* arg, const char* format, va_list ap)
+{
+	(void) arg;
+	(void) format;
+	(void) ap;
+}
+
+/**
+ * One workflow engine thread: its own context, launching one command after
+ * another
+ */
+static void* spawn_worker_run(void* arg)
+{
+	struct spawn_worker* w = (struct spawn_worker*) arg;
+	//the synthetic image has no binaries, the launch ends in a 127 exit
+	//right after the namespace is built
+	char* argv[] = {"/bin/true", NULL};
+	char* envp[] = {"PATH=/bin", NULL};
+	inception_ctx_t* ctx = inception_create(w->config);
+	int i;
+
+	if(!ctx)
+		return(NULL);
+	inception_set_log(ctx, quiet_log, NULL);
+	if(inception_load(ctx, "image0") == 0)
+	{
+		for(i=0;i<w->launches;i++)
+		{
+			uint64_t start = now_ns();
+			pid_t pid;
+			if(inception_spawn(ctx, argv, envp, &pid))
+				break;
+			waitpid(pid, NULL, 0);
+			w->samples[w->n++] = now_ns() - start;
+		}
+	}
+	inception_free(ctx);
+	return(NULL);
+}
+
+/**
+ * Launch throughput with 1, 2, 4... threads each spawning into the image.
+ * It should scale until the kernel's mount lock serializes the unshares.
+ */
+static void bench_spawn(const struct bench_opts* opts, json_t* results)
+{
+	static const int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	char* path;
+	int c, t;
+
+	if(!wanted(opts, "inception_spawn"))
+		return;
+	path = geteuid() == 0 ? make_config(opts, 1, 10) : NULL;
+	for(c=0;c<7;c++)
+	{
+		int threads = thread_counts[c];
+		struct spawn_worker* workers;
+		json_t* params;
+		uint64_t* samples;
+		uint64_t start, elapsed;
+		int n = 0;
+
+		if(c > 0 && threads > 2*ncpu)
+			break;
+		params = json_object();
+		json_object_set_new(params, "threads", json_integer(threads));
+		workers = calloc(threads, sizeof(struct spawn_worker));
+		samples = malloc(sizeof(uint64_t)*opts->iterations*threads);
+		start = now_ns();
+		for(t=0;path && workers && samples && t<threads;t++)
+		{
+			workers[t].config = path;
+			workers[t].launches = opts->iterations;
+			workers[t].samples = samples + (size_t) t*opts->iterations;
+			if(pthread_create(&workers[t].thread, NULL, spawn_worker_run, &workers[t]))
+				break;
+		}
+		threads = t;
+		for(t=0;t<threads;t++)
+			pthread_join(workers[t].thread, NULL);
+		elapsed = now_ns() - start;
+		for(t=0;t<threads;t++)
+		{
+			memmove(samples + n, workers[t].samples, sizeof(uint64_t)*workers[t].n);
+			n += workers[t].n;
+		}
+		if(n > 0)
+			json_object_set_new(params, "launches_per_sec",
+				json_real(n * 1e9 / elapsed));
+		report(results, "inception_spawn", params, samples, n);
+		free(samples);
+		free(workers);
+		if(!path)
+			break;
+	}
+	drop_config(path);
+}
+
+static void usage()
+{
+	printf("-i {iterations} #per case, default %d\n", DEFAULT_ITERATIONS);
+	printf("-f {substring} #only run cases whose name matches\n");
+	printf("-d {dir} #scratch directory for synthetic images, must be owned by\n");
+	printf("          us and not group/world writable (default: a new one under\n");
+	printf("          /tmp, removed afterwards); reusing one reuses the catalogs\n");
+	printf("          built for its configs\n");
+	printf("-o {file} #write json results here instead of stdout\n");
+}
+
+int main(int argc, char** argv)
+{
+	struct bench_opts opts;
+	struct utsname uts;
+	json_t* doc;
+	json_t* results;
+	char* output = NULL;
+	FILE* out = stdout;
+	int remove_workdir = 0;
+	int ch;
+	static struct option longopts[] = {
+		{ "iterations", required_argument, NULL, 'i' },
+		{ "filter", required_argument, NULL, 'f' },
+		{ "dir", required_argument, NULL, 'd' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "idle", no_argument, NULL, 'I' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	memset(&opts, 0, sizeof(opts));
+	opts.iterations = DEFAULT_ITERATIONS;
+	while((ch = getopt_long(argc, argv, "i:f:d:o:h", longopts, NULL)) != -1)
+	{
+		switch(ch) {
+			case 'i':
+				opts.iterations = atoi(optarg);
+				break;
+			case 'f':
+				opts.filter = optarg;
+				break;
+			case 'd':
+				opts.workdir = strdup(optarg);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'I':
+				//environment holder for bench_environ()
+				pause();
+				return(0);
+			case 'h':
+				usage();
+				return(0);
+			default:
+				fprintf(stderr, "Getopt Error\n");
+				return(1);
+		}
+	}
+	if(opts.iterations <= 0)
+	{
+		fprintf(stderr, "iterations must be positive\n");
+		return(1);
+	}
+	if(!opts.workdir)
+	{
+		opts.workdir = strdup("/tmp/inception-bench.XXXXXX");
+		if(!opts.workdir || !mkdtemp(opts.workdir))
+		{
+			perror("mkdtemp");
+			return(1);
+		}
+		remove_workdir = 1;
+	}
+	else if(check_workdir(opts.workdir))
+	{
+		fprintf(stderr, "Unable to use %s: %s\n", opts.workdir, strerror(errno));
+		return(1);
+	}
+	if(output)
+	{
+		out = fopen(output, "w");
+		if(!out)
+		{
+			fprintf(stderr, "Unable to open %s: %s\n", output, strerror(errno));
+			return(1);
+		}
+	}
+
+	//keep synthetic launches out of the node's real statistics
+	inception_stats_disable();
+
+	doc = json_object();
+	results = json_array();
+	if(uname(&uts) == 0)
+		json_object_set_new(doc, "kernel", json_string(uts.release));
+	json_object_set_new(doc, "euid", json_integer(geteuid()));
+	json_object_set_new(doc, "iterations", json_integer(opts.iterations));
+
+	bench_config(&opts, results);
+	bench_environ(&opts, results);
+	bench_identity(&opts, results);
+	bench_mounts(&opts, results);
+	bench_spawn(&opts, results);
+
+	json_object_set_new(doc, "results", results);
+	json_dumpf(doc, out, JSON_INDENT(2));
+	fprintf(out, "\n");
+	json_decref(doc);
+	if(out != stdout)
+		fclose(out);
+	if(remove_workdir)
+		nftw(opts.workdir, remove_entry, 16, FTW_DEPTH|FTW_PHYS|FTW_MOUNT);
+	free(opts.workdir);
+	return(0);
+}
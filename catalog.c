@@ -0,0 +1,659 @@
+/*
+ * Copyright (c) 2017, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compiled image catalog
+ *
+ * The json config is compiled into a flat file under INCEPTION_RUN_DIR the
+ * first time it is needed (and again whenever the json's dev/inode/size/mtime
+ * change). Lookups mmap the catalog and walk a hash chain, so launching an
+ * image never has to parse the whole config.
+ *
+ * Layout (all offsets are from the start of the file):
+ *	catalog_header
+ *	uint32_t buckets[num_buckets]
+ *	catalog_image images[num_images]
+ *	catalog_mount mounts[num_mounts]
+ *	char strings[]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <jansson.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define CATALOG_MAGIC 0x54414349 /* "ICAT" */
+#define CATALOG_VERSION 9
+#define CATALOG_NONE 0xffffffff
+
+#define CATALOG_IMAGE_INVALID 0x1
+#define CATALOG_IMAGE_MINIMAL_MOUNTS 0x2
+
+struct catalog_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t src_dev;
+	uint64_t src_ino;
+	uint64_t src_size;
+	int64_t src_mtime_sec;
+	int64_t src_mtime_nsec;
+	uint32_t num_buckets;
+	uint32_t num_images;
+	uint32_t num_mounts;
+	uint32_t default_image;
+	uint32_t buckets_off;
+	uint32_t images_off;
+	uint32_t mounts_off;
+	uint32_t strings_off;
+	uint32_t strings_size;
+	uint32_t pad;
+};
+
+struct catalog_image
+{
+	uint32_t hash;
+	uint32_t next;
+	uint32_t flags;
+	uint32_t name;
+	uint32_t imgroot;
+	uint32_t first_mount;
+	uint32_t num_mounts;
+	int32_t ns_cache_ttl;
+	uint32_t layers; //':' separated, layers can't contain ':'
+	uint32_t tmpfs_upper;
+	uint32_t ld_cache_dir;
+	uint32_t ld_cache_path; //':' separated like layers
+	uint32_t env_rules; //'\n' separated
+	uint32_t image_sha256;
+	uint32_t mempolicy;
+	uint32_t mem_nodes;
+	uint32_t cpu_map; //':' separated like layers
+	uint32_t thp;
+};
+
+struct catalog_mount
+{
+	uint32_t from;
+	uint32_t to;
+	uint32_t type;
+	uint32_t options;
+};
+
+struct strpool
+{
+	char* data;
+	size_t len;
+	size_t cap;
+};
+
+/**
+ * FNV-1a over the lower cased name, lookups are case insensitive
+ */
+static uint32_t catalog_hash(const char* name)
+{
+	uint32_t hash = 2166136261u;
+	for(; *name; name++)
+	{
+		hash ^= (unsigned char) tolower((unsigned char) *name);
+		hash *= 16777619u;
+	}
+	return(hash);
+}
+
+/**
+ * One catalog per config file, named after a hash of the config path
+ * @return ownership of cstring of the catalog path or NULL
+ */
+static char* catalog_path(const char* config_path)
+{
+	char* path;
+	uint32_t hash = 2166136261u;
+	const char* c;
+	for(c=config_path;*c;c++)
+	{
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+	if(asprintf(&path, "%s/catalog-%08x", INCEPTION_RUN_DIR, hash) == -1)
+		return(NULL);
+	return(path);
+}
+
+static uint32_t strpool_add(struct strpool* pool, const char* str)
+{
+	size_t len;
+	uint32_t off;
+	if(!str)
+		return(CATALOG_NONE);
+	len = strlen(str) + 1;
+	if(pool->len + len > pool->cap)
+	{
+		size_t cap = pool->cap ? pool->cap : 4096;
+		char* data;
+		while(cap < pool->len + len)
+			cap *= 2;
+		data = realloc(pool->data, cap);
+		if(!data)
+			return(CATALOG_NONE);
+		pool->data = data;
+		pool->cap = cap;
+	}
+	off = pool->len;
+	memcpy(pool->data + off, str, len);
+	pool->len += len;
+	return(off);
+}
+
+/**
+ * Store a list as one string, entries can't contain sep
+ */
+static uint32_t strpool_add_list(struct strpool* pool, char** list, size_t n, char sep)
+{
+	char* joined = NULL;
+	size_t joined_len, i;
+	uint32_t off;
+	FILE* joined_mem;
+	if(!n)
+		return(CATALOG_NONE);
+	joined_mem = open_memstream(&joined, &joined_len);
+	if(!joined_mem)
+		return(CATALOG_NONE);
+	for(i=0;i<n;i++)
+	{
+		if(i)
+			fputc(sep, joined_mem);
+		fputs(list[i], joined_mem);
+	}
+	fclose(joined_mem);
+	off = strpool_add(pool, joined);
+	free(joined);
+	return(off);
+}
+
+static int catalog_stale(const struct catalog_header* hdr, const struct stat* src)
+{
+	return(hdr->magic != CATALOG_MAGIC ||
+		hdr->version != CATALOG_VERSION ||
+		hdr->src_dev != (uint64_t) src->st_dev ||
+		hdr->src_ino != (uint64_t) src->st_ino ||
+		hdr->src_size != (uint64_t) src->st_size ||
+		hdr->src_mtime_sec != (int64_t) src->st_mtim.tv_sec ||
+		hdr->src_mtime_nsec != (int64_t) src->st_mtim.tv_nsec);
+}
+
+/**
+ * Compile config_path into a new catalog and atomically replace the old one
+ * @return 0 on success
+ */
+static int catalog_build(const char* config_path, const char* cat_path)
+{
+	struct catalog_header hdr;
+	struct catalog_image* images = NULL;
+	struct catalog_mount* mounts = NULL;
+	uint32_t* buckets = NULL;
+	struct strpool pool = {NULL, 0, 0};
+	json_error_t json_err;
+	json_t* config_root = NULL;
+	json_t* image_list;
+	json_t* image_obj;
+	struct stat src;
+	char* tmp_path = NULL;
+	size_t nimages, nmounts = 0, index, i;
+	int fd = -1, ret = -1;
+	FILE* config_fd = fopen(config_path, "r");
+
+	if(!config_fd)
+		return(-1);
+	if(fstat(fileno(config_fd), &src))
+		goto cleanup;
+	config_root = json_loadf(config_fd, 0, &json_err);
+	if(!config_root)
+		goto cleanup;
+	image_list = json_object_get(config_root, "images");
+	if(!json_is_array(image_list))
+		goto cleanup;
+	nimages = json_array_size(image_list);
+	json_array_foreach(image_list, index, image_obj)
+	{
+		json_t* mount_list = json_object_get(image_obj, "mounts");
+		if(json_is_array(mount_list))
+			nmounts += json_array_size(mount_list);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CATALOG_MAGIC;
+	hdr.version = CATALOG_VERSION;
+	hdr.src_dev = src.st_dev;
+	hdr.src_ino = src.st_ino;
+	hdr.src_size = src.st_size;
+	hdr.src_mtime_sec = src.st_mtim.tv_sec;
+	hdr.src_mtime_nsec = src.st_mtim.tv_nsec;
+	hdr.num_images = nimages;
+	hdr.default_image = nimages ? 0 : CATALOG_NONE;
+	for(hdr.num_buckets=1;hdr.num_buckets<2*nimages;hdr.num_buckets<<=1);
+
+	buckets = (uint32_t*) malloc(sizeof(uint32_t)*hdr.num_buckets);
+	images = (struct catalog_image*) calloc(nimages ? nimages : 1, sizeof(*images));
+	mounts = (struct catalog_mount*) calloc(nmounts ? nmounts : 1, sizeof(*mounts));
+	if(!buckets || !images || !mounts)
+		goto cleanup;
+	for(i=0;i<hdr.num_buckets;i++)
+		buckets[i] = CATALOG_NONE;
+
+	json_array_foreach(image_list, index, image_obj)
+	{
+		image_config_t image;
+		struct catalog_image* cimg = &images[index];
+		const char* name = json_string_value(json_object_get(image_obj, "name"));
+		if(!name)
+		{
+			//parse_config() fails the whole config for this, let it
+			goto cleanup;
+		}
+		cimg->hash = catalog_hash(name);
+		cimg->name = strpool_add(&pool, name);
+		cimg->first_mount = hdr.num_mounts;
+		cimg->imgroot = CATALOG_NONE;
+		cimg->layers = CATALOG_NONE;
+		cimg->tmpfs_upper = CATALOG_NONE;
+		cimg->ld_cache_dir = CATALOG_NONE;
+		cimg->ld_cache_path = CATALOG_NONE;
+		cimg->env_rules = CATALOG_NONE;
+		cimg->image_sha256 = CATALOG_NONE;
+		cimg->mempolicy = CATALOG_NONE;
+		cimg->mem_nodes = CATALOG_NONE;
+		cimg->cpu_map = CATALOG_NONE;
+		cimg->thp = CATALOG_NONE;
+
+		memset(&image, 0, sizeof(image));
+		if(image_from_json(image_obj, &image))
+		{
+			//looking this one up falls back to the json so the user
+			//gets the real error
+			cimg->flags |= CATALOG_IMAGE_INVALID;
+			free_image_fields(&image);
+			continue;
+		}
+		cimg->imgroot = strpool_add(&pool, image.imgroot);
+		for(i=0;i<image.num_mounts;i++)
+		{
+			struct catalog_mount* cmnt = &mounts[hdr.num_mounts++];
+			cmnt->from = strpool_add(&pool, image.mount_from[i]);
+			cmnt->to = strpool_add(&pool, image.mount_to[i]);
+			cmnt->type = strpool_add(&pool, image.mount_type[i]);
+			cmnt->options = strpool_add(&pool, image.mount_options[i]);
+		}
+		cimg->num_mounts = image.num_mounts;
+		cimg->ns_cache_ttl = image.ns_cache_ttl;
+		if(image.minimal_mounts)
+			cimg->flags |= CATALOG_IMAGE_MINIMAL_MOUNTS;
+		cimg->tmpfs_upper = strpool_add(&pool, image.tmpfs_upper);
+		cimg->image_sha256 = strpool_add(&pool, image.image_sha256);
+		cimg->layers = strpool_add_list(&pool, image.layers, image.num_layers, ':');
+		cimg->ld_cache_dir = strpool_add(&pool, image.ld_cache_dir);
+		cimg->ld_cache_path = strpool_add_list(&pool, image.ld_cache_path,
+						image.num_ld_cache_path, ':');
+		cimg->env_rules = strpool_add_list(&pool, image.env_rules,
+						image.num_env_rules, '\n');
+		cimg->mempolicy = strpool_add(&pool, image.mempolicy);
+		cimg->mem_nodes = strpool_add(&pool, image.mem_nodes);
+		cimg->cpu_map = strpool_add_list(&pool, image.cpu_map, image.num_cpu_map, ':');
+		cimg->thp = strpool_add(&pool, image.thp);
+		free_image_fields(&image);
+	}
+	if(!pool.data)
+		strpool_add(&pool, "");
+	if(!pool.data)
+		goto cleanup;
+
+	//chain back to front so the first image with a given name wins, same as
+	//the linear scan in parse_config()
+	for(i=nimages;i>0;i--)
+	{
+		uint32_t bucket = images[i-1].hash & (hdr.num_buckets - 1);
+		images[i-1].next = buckets[bucket];
+		buckets[bucket] = i-1;
+	}
+
+	hdr.buckets_off = sizeof(hdr);
+	hdr.images_off = hdr.buckets_off + sizeof(uint32_t)*hdr.num_buckets;
+	hdr.images_off = (hdr.images_off + 7) & ~7u;
+	hdr.mounts_off = hdr.images_off + sizeof(*images)*nimages;
+	hdr.strings_off = hdr.mounts_off + sizeof(*mounts)*hdr.num_mounts;
+	hdr.strings_size = pool.len;
+
+	if(asprintf(&tmp_path, "%s.%d", cat_path, getpid()) == -1)
+	{
+		tmp_path = NULL;
+		goto cleanup;
+	}
+	fd = open(tmp_path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if(fd < 0)
+		goto cleanup;
+	if(pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		pwrite(fd, buckets, sizeof(uint32_t)*hdr.num_buckets, hdr.buckets_off) !=
+			(ssize_t) (sizeof(uint32_t)*hdr.num_buckets) ||
+		pwrite(fd, images, sizeof(*images)*nimages, hdr.images_off) !=
+			(ssize_t) (sizeof(*images)*nimages) ||
+		pwrite(fd, mounts, sizeof(*mounts)*hdr.num_mounts, hdr.mounts_off) !=
+			(ssize_t) (sizeof(*mounts)*hdr.num_mounts) ||
+		pwrite(fd, pool.data, pool.len, hdr.strings_off) != (ssize_t) pool.len ||
+		fchmod(fd, 0644) ||
+		fsync(fd))
+	{
+		unlink(tmp_path);
+		goto cleanup;
+	}
+	if(rename(tmp_path, cat_path))
+	{
+		unlink(tmp_path);
+		goto cleanup;
+	}
+	ret = 0;
+cleanup:
+	if(fd >= 0)
+		close(fd);
+	if(config_root)
+		json_decref(config_root);
+	fclose(config_fd);
+	free(tmp_path);
+	free(pool.data);
+	free(buckets);
+	free(images);
+	free(mounts);
+	return(ret);
+}
+
+/**
+ * Rebuild the catalog unless somebody else beat us to it
+ * @return 0 if a fresh catalog should now exist
+ */
+static int catalog_rebuild(const char* config_path, const char* cat_path,
+				const struct stat* src)
+{
+	char* lock_path;
+	struct catalog_header hdr;
+	int lock_fd, fd, ret = -1;
+
+	if(make_run_dir(NULL))
+		return(-1);
+	if(asprintf(&lock_path, "%s.lock", cat_path) == -1)
+		return(-1);
+	lock_fd = open(lock_path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	free(lock_path);
+	if(lock_fd < 0)
+		return(-1);
+	if(flock(lock_fd, LOCK_EX))
+	{
+		close(lock_fd);
+		return(-1);
+	}
+	//a whole node worth of ranks can get here at once, only one builds
+	fd = open(cat_path, O_RDONLY|O_CLOEXEC);
+	if(fd >= 0 && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+		!catalog_stale(&hdr, src))
+		ret = 0;
+	else
+		ret = catalog_build(config_path, cat_path);
+	if(fd >= 0)
+		close(fd);
+	flock(lock_fd, LOCK_UN);
+	close(lock_fd);
+	return(ret);
+}
+
+/**
+ * Map the catalog for config_path if it is present, trusted and up to date
+ * @return mapping or NULL
+ */
+static void* catalog_map(const char* cat_path, const struct stat* src, size_t* len)
+{
+	struct stat st;
+	struct catalog_header* hdr;
+	void* map;
+	int fd = open(cat_path, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+		return(NULL);
+	if(fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+		(st.st_uid != 0 && st.st_uid != geteuid()) ||
+		(st.st_mode & (S_IWGRP|S_IWOTH)) ||
+		(size_t) st.st_size < sizeof(struct catalog_header))
+	{
+		close(fd);
+		return(NULL);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return(NULL);
+	hdr = (struct catalog_header*) map;
+	if(catalog_stale(hdr, src) ||
+		hdr->num_buckets == 0 ||
+		(hdr->num_buckets & (hdr->num_buckets - 1)) ||
+		hdr->buckets_off + (uint64_t) sizeof(uint32_t)*hdr->num_buckets > (uint64_t) st.st_size ||
+		hdr->images_off + (uint64_t) sizeof(struct catalog_image)*hdr->num_images > (uint64_t) st.st_size ||
+		hdr->mounts_off + (uint64_t) sizeof(struct catalog_mount)*hdr->num_mounts > (uint64_t) st.st_size ||
+		hdr->strings_size == 0 ||
+		hdr->strings_off + (uint64_t) hdr->strings_size != (uint64_t) st.st_size ||
+		((char*) map)[st.st_size - 1] != '\0')
+	{
+		munmap(map, st.st_size);
+		return(NULL);
+	}
+	*len = st.st_size;
+	return(map);
+}
+
+static const char* catalog_str(const void* map, uint32_t off)
+{
+	const struct catalog_header* hdr = (const struct catalog_header*) map;
+	if(off == CATALOG_NONE || off >= hdr->strings_size)
+		return(NULL);
+	return((const char*) map + hdr->strings_off + off);
+}
+
+/**
+ * Undo strpool_add_list(..., sep)
+ * @return ownership of the list (and its length in n), NULL if str is NULL
+ */
+static char** catalog_split(const char* str, char sep, size_t* n)
+{
+	const char* c;
+	char** list;
+	size_t len = 1;
+	*n = 0;
+	if(!str)
+		return(NULL);
+	for(c=str;*c;c++)
+		len += *c == sep;
+	list = (char**) malloc(sizeof(char*)*len);
+	if(!list)
+		return(NULL);
+	for(c=str;*n<len;c=strchrnul(c, sep)+1)
+	{
+		asprintf(&list[*n], "%.*s", (int) (strchrnul(c, sep)-c), c);
+		(*n)++;
+	}
+	return(list);
+}
+
+/**
+ * Copy one catalog entry into image, the mapping is gone when we return
+ * @return 0 on success
+ */
+static int catalog_copy_image(const void* map, const struct catalog_image* cimg,
+				image_config_t* image)
+{
+	const struct catalog_header* hdr = (const struct catalog_header*) map;
+	const struct catalog_mount* mounts =
+		(const struct catalog_mount*) ((const char*) map + hdr->mounts_off);
+	const char* imgroot = catalog_str(map, cimg->imgroot);
+	const char* name = catalog_str(map, cimg->name);
+	size_t i;
+
+	if(!imgroot || !name ||
+		(uint64_t) cimg->first_mount + cimg->num_mounts > hdr->num_mounts)
+		return(CATALOG_UNAVAILABLE);
+	asprintf(&(image->imgroot), "%s", imgroot);
+	asprintf(&(image->name), "%s", name);
+	image->ns_cache_ttl = cimg->ns_cache_ttl;
+	image->minimal_mounts = (cimg->flags & CATALOG_IMAGE_MINIMAL_MOUNTS) != 0;
+	if(catalog_str(map, cimg->tmpfs_upper))
+		asprintf(&(image->tmpfs_upper), "%s", catalog_str(map, cimg->tmpfs_upper));
+	if(catalog_str(map, cimg->image_sha256))
+		asprintf(&(image->image_sha256), "%s", catalog_str(map, cimg->image_sha256));
+	image->layers = catalog_split(catalog_str(map, cimg->layers), ':', &image->num_layers);
+	if(catalog_str(map, cimg->ld_cache_dir))
+		asprintf(&(image->ld_cache_dir), "%s", catalog_str(map, cimg->ld_cache_dir));
+	image->ld_cache_path = catalog_split(catalog_str(map, cimg->ld_cache_path), ':',
+					&image->num_ld_cache_path);
+	image->env_rules = catalog_split(catalog_str(map, cimg->env_rules), '\n',
+					&image->num_env_rules);
+	if(catalog_str(map, cimg->mempolicy))
+		asprintf(&(image->mempolicy), "%s", catalog_str(map, cimg->mempolicy));
+	if(catalog_str(map, cimg->mem_nodes))
+		asprintf(&(image->mem_nodes), "%s", catalog_str(map, cimg->mem_nodes));
+	image->cpu_map = catalog_split(catalog_str(map, cimg->cpu_map), ':', &image->num_cpu_map);
+	if(catalog_str(map, cimg->thp))
+		asprintf(&(image->thp), "%s", catalog_str(map, cimg->thp));
+	image->num_mounts = 0;
+	image->mount_from = (char**) malloc(sizeof(char*)*cimg->num_mounts);
+	image->mount_to = (char**) malloc(sizeof(char*)*cimg->num_mounts);
+	image->mount_type = (char**) malloc(sizeof(char*)*cimg->num_mounts);
+	image->mount_options = (char**) malloc(sizeof(char*)*cimg->num_mounts);
+	for(i=0;i<cimg->num_mounts;i++)
+	{
+		const struct catalog_mount* cmnt = &mounts[cimg->first_mount + i];
+		const char* from = catalog_str(map, cmnt->from);
+		const char* to = catalog_str(map, cmnt->to);
+		const char* type = catalog_str(map, cmnt->type);
+		if(!from || !to || !type)
+		{
+			free_image_fields(image);
+			return(CATALOG_UNAVAILABLE);
+		}
+		asprintf(&((image->mount_from)[i]), "%s", from);
+		asprintf(&((image->mount_to)[i]), "%s", to);
+		asprintf(&((image->mount_type)[i]), "%s", type);
+		(image->mount_options)[i] = NULL;
+		if(catalog_str(map, cmnt->options))
+			asprintf(&((image->mount_options)[i]), "%s", catalog_str(map, cmnt->options));
+		image->num_mounts = i+1;
+	}
+	return(0);
+}
+
+int catalog_find_image(const char* config_path, const char* key, image_config_t* image)
+{
+	const struct catalog_header* hdr;
+	const struct catalog_image* images;
+	const uint32_t* buckets;
+	const struct catalog_image* found = NULL;
+	struct stat src;
+	char* cat_path;
+	void* map;
+	size_t len = 0;
+	uint32_t idx;
+	int ret = CATALOG_UNAVAILABLE;
+
+	if(stat(config_path, &src))
+		return(CATALOG_UNAVAILABLE);
+	cat_path = catalog_path(config_path);
+	if(!cat_path)
+		return(CATALOG_UNAVAILABLE);
+	map = catalog_map(cat_path, &src, &len);
+	if(!map && catalog_rebuild(config_path, cat_path, &src) == 0)
+		map = catalog_map(cat_path, &src, &len);
+	free(cat_path);
+	if(!map)
+		return(CATALOG_UNAVAILABLE);
+
+	hdr = (const struct catalog_header*) map;
+	buckets = (const uint32_t*) ((const char*) map + hdr->buckets_off);
+	images = (const struct catalog_image*) ((const char*) map + hdr->images_off);
+	if(!key)
+	{
+		idx = hdr->default_image;
+		if(idx < hdr->num_images)
+			found = &images[idx];
+	}
+	else
+	{
+		uint32_t hash = catalog_hash(key);
+		uint32_t hops = 0;
+		for(idx=buckets[hash & (hdr->num_buckets - 1)];
+			idx < hdr->num_images && hops <= hdr->num_images;
+			idx=images[idx].next, hops++)
+		{
+			const char* name = catalog_str(map, images[idx].name);
+			if(images[idx].hash == hash && name && strcasecmp(name, key) == 0)
+			{
+				found = &images[idx];
+				break;
+			}
+		}
+	}
+	if(!found)
+		ret = CATALOG_NOT_FOUND;
+	else if(!(found->flags & CATALOG_IMAGE_INVALID))
+		ret = catalog_copy_image(map, found, image);
+	munmap(map, len);
+	return(ret);
+}
+
+void catalog_remove(const char* config_path)
+{
+	char* cat_path = catalog_path(config_path);
+	char* lock_path;
+	if(!cat_path)
+		return;
+	if(asprintf(&lock_path, "%s.lock", cat_path) != -1)
+	{
+		unlink(lock_path);
+		free(lock_path);
+	}
+	unlink(cat_path);
+	free(cat_path);
+}
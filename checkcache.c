@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Mount validation cache
+ *
+ * check_image() stats every mount source and its destination in the image
+ * on every launch, and the destinations usually live on a parallel
+ * filesystem where each stat is a metadata round trip. Once an image's
+ * mounts have been planned (plan.c) and have passed the checks we leave an
+ * INCEPTION_RUN_DIR/checked entry named <image>-<key> holding the planned
+ * mount list, and later launches with the same key take that list and skip
+ * both the planning and the destination checks.
+ *
+ * The key covers the image's config (image_hash(), with the mounts as
+ * configured), the dev/ino/mtime/ctime of the image root or of every layer,
+ * and the dev/ino/mode of every configured mount source, so the sources are
+ * still stat()ed (and their type checked through the key) but nothing inside
+ * the image is. A host mount appearing below an "rbind" source within the
+ * ttl is brought along until the plan expires. An image file root changes
+ * identity whenever the file does; a directory root's mtime does not notice
+ * changes deeper in the tree, so entries also expire after
+ * INCEPTION_CHECK_CACHE_TTL seconds. A destination that disappeared in that
+ * window makes the mount itself fail instead of the check.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#ifndef INCEPTION_CHECK_CACHE_TTL
+#define INCEPTION_CHECK_CACHE_TTL 300
+#endif
+
+#define CHECKCACHE_SUBDIR "checked"
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t len)
+{
+	const unsigned char* c = (const unsigned char*) data;
+	size_t i;
+	for(i=0;i<len;i++)
+	{
+		hash ^= c[i];
+		hash *= 1099511628211ull;
+	}
+	return(hash);
+}
+
+static uint64_t hash_root(uint64_t hash, const char* path)
+{
+	struct stat st;
+	uint64_t id[5] = {0, 0, 0, 0, 0};
+	if(stat(path, &st) == 0)
+	{
+		id[0] = st.st_dev;
+		id[1] = st.st_ino;
+		id[2] = st.st_mtim.tv_sec;
+		id[3] = st.st_mtim.tv_nsec;
+		id[4] = st.st_ctim.tv_sec ^ ((uint64_t) st.st_ctim.tv_nsec << 32);
+	}
+	return(hash_bytes(hash, id, sizeof(id)));
+}
+
+/**
+ * Replace image's mounts with the plan stored in the entry open in fd
+ * @return 0 on success, -1 if the entry is not a plan we wrote
+ */
+static int checkcache_load(image_config_t* image, int fd, off_t size)
+{
+	inception_plan_t plan;
+	char** lists[4] = {NULL, NULL, NULL, NULL};
+	char* buf;
+	char* c;
+	char* end;
+	size_t i, n = 0;
+	int l, ret = -1;
+
+	memset(&plan, 0, sizeof(plan));
+	buf = (char*) malloc(size + 1);
+	if(!buf)
+		return(-1);
+	if(pread(fd, buf, size, 0) != size)
+		goto out;
+	buf[size] = '\0';
+	end = buf + size;
+	if(sscanf(buf, "plan %zu %zu %zu %zu %zu %zu %zu %zu %zu", &plan.mounts_in,
+		&plan.normalized, &plan.shadowed, &plan.covered, &plan.merged,
+		&plan.stats_in, &plan.stats_out, &plan.plan_stats,
+		&plan.mountinfo_entries) != 9 || !(c = memchr(buf, '\n', size)))
+		goto out;
+	//then type, from, to and options (empty for none) of every mount
+	for(c++, i=0;c<end;c+=strlen(c)+1, i++);
+	if(c != end || i % 4 || i/4 > plan.mounts_in)
+		goto out;
+	n = i/4;
+	for(l=0;l<4;l++)
+	{
+		lists[l] = (char**) calloc(n ? n : 1, sizeof(char*));
+		if(!lists[l])
+			goto out;
+	}
+	for(c=memchr(buf, '\n', size)+1, i=0;i<n*4;c+=strlen(c)+1, i++)
+	{
+		l = i % 4;
+		if(l == 3 && !*c)
+			continue;
+		lists[l][i/4] = strdup(c);
+		if(!lists[l][i/4])
+			goto out;
+	}
+	for(i=0;i<n;i++)
+	{
+		if(!mount_type_known(lists[0][i]) || !lists[1][i] || !lists[2][i])
+			goto out;
+	}
+	for(i=0;i<image->num_mounts;i++)
+	{
+		free(image->mount_type[i]);
+		free(image->mount_from[i]);
+		free(image->mount_to[i]);
+		free(image->mount_options[i]);
+	}
+	free(image->mount_type);
+	free(image->mount_from);
+	free(image->mount_to);
+	free(image->mount_options);
+	image->mount_type = lists[0];
+	image->mount_from = lists[1];
+	image->mount_to = lists[2];
+	image->mount_options = lists[3];
+	image->num_mounts = n;
+	plan.cached = 1;
+	image->plan = plan;
+	ret = 0;
+	n = 0;
+out:
+	for(l=0;l<4 && ret;l++)
+	{
+		for(i=0;lists[l] && i<n;i++)
+			free(lists[l][i]);
+		free(lists[l]);
+	}
+	free(buf);
+	return(ret);
+}
+
+/**
+ * Write image's planned mounts to path (atomically, launches may be reading
+ * it)
+ * @return 0 on success
+ */
+static int checkcache_write(const image_config_t* image, const char* path)
+{
+	const inception_plan_t* plan = &image->plan;
+	char* tmp;
+	FILE* entry;
+	size_t i;
+	int fd, ret = -1;
+
+	if(asprintf(&tmp, "%s.%d", path, (int) getpid()) == -1)
+		return(-1);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+	entry = fd < 0 ? NULL : fdopen(fd, "w");
+	if(!entry)
+	{
+		if(fd >= 0)
+			close(fd);
+		free(tmp);
+		return(-1);
+	}
+	fprintf(entry, "plan %zu %zu %zu %zu %zu %zu %zu %zu %zu\n", plan->mounts_in,
+		plan->normalized, plan->shadowed, plan->covered, plan->merged,
+		plan->stats_in, plan->stats_out, plan->plan_stats, plan->mountinfo_entries);
+	for(i=0;i<image->num_mounts;i++)
+	{
+		fprintf(entry, "%s%c%s%c%s%c%s%c", image->mount_type[i], 0,
+			image->mount_from[i], 0, image->mount_to[i], 0,
+			image->mount_options[i] ? image->mount_options[i] : "", 0);
+	}
+	if(fclose(entry) == 0 && rename(tmp, path) == 0)
+		ret = 0;
+	else
+		unlink(tmp);
+	free(tmp);
+	return(ret);
+}
+
+static char* checkcache_path(const image_config_t* image, uint64_t key)
+{
+	char* path;
+	if(asprintf(&path, "%s/%s/%s-%016llx", INCEPTION_RUN_DIR, CHECKCACHE_SUBDIR,
+		image->name ? image->name : "", (unsigned long long) key) == -1)
+		return(NULL);
+	return(path);
+}
+
+int checkcache_lookup(image_config_t* image, uint64_t* key)
+{
+	struct stat st;
+	char* path;
+	size_t i;
+	uint64_t hash = image_hash(image);
+	int fd, ret = 1;
+
+	if(INCEPTION_CHECK_CACHE_TTL <= 0 || !image->name || strchr(image->name, '/'))
+		return(-1);
+	if(image->num_layers)
+		for(i=0;i<image->num_layers;i++)
+			hash = hash_root(hash, image->layers[i]);
+	else
+		hash = hash_root(hash, image->imgroot);
+	for(i=0;i<image->num_mounts;i++)
+	{
+		uint64_t id[3] = {0, 0, 0};
+		if(stat(image->mount_from[i], &st) == 0)
+		{
+			id[0] = st.st_dev;
+			id[1] = st.st_ino;
+			id[2] = st.st_mode;
+		}
+		hash = hash_bytes(hash, id, sizeof(id));
+		hash = hash_bytes(hash, image->mount_to[i], strlen(image->mount_to[i]) + 1);
+	}
+	*key = hash;
+
+	path = checkcache_path(image, hash);
+	if(!path)
+		return(-1);
+	//only trust entries we (root) made, and only for the ttl
+	fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if(fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+		(st.st_uid == 0 || st.st_uid == geteuid()) &&
+		time(NULL) - st.st_mtime <= INCEPTION_CHECK_CACHE_TTL &&
+		checkcache_load(image, fd, st.st_size) == 0)
+		ret = 0;
+	if(fd >= 0)
+		close(fd);
+	free(path);
+	stats_record(ret == 0 ? "check_cache_hit" : "check_cache_miss", NULL, 0);
+	return(ret);
+}
+
+/**
+ * Remove expired entries and older versions of image's entry
+ */
+static void checkcache_gc(const image_config_t* image, const char* dir, const char* keep)
+{
+	DIR* d = opendir(dir);
+	struct dirent* ent;
+	size_t name_len = strlen(image->name);
+	time_t now = time(NULL);
+
+	if(!d)
+		return;
+	while((ent = readdir(d)))
+	{
+		struct stat st;
+		size_t len = strlen(ent->d_name);
+		int superseded;
+		if(ent->d_name[0] == '.' || strcmp(ent->d_name, keep) == 0)
+			continue;
+		superseded = len == name_len + 17 && ent->d_name[name_len] == '-' &&
+			strncmp(ent->d_name, image->name, name_len) == 0;
+		if(superseded || (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+			now - st.st_mtime > INCEPTION_CHECK_CACHE_TTL))
+			unlinkat(dirfd(d), ent->d_name, 0);
+	}
+	closedir(d);
+}
+
+void checkcache_store(const image_config_t* image, uint64_t key)
+{
+	char* path;
+	char* dir;
+
+	if(INCEPTION_CHECK_CACHE_TTL <= 0 || make_run_dir(CHECKCACHE_SUBDIR))
+		return;
+	path = checkcache_path(image, key);
+	if(!path)
+		return;
+	//the mtime is when the mounts were last checked
+	checkcache_write(image, path);
+	dir = strrchr(path, '/');
+	*dir = '\0';
+	checkcache_gc(image, path, dir + 1);
+	free(path);
+}
+
+static int cmp_name(const void* a, const void* b)
+{
+	return(strcmp(*(const char* const*) a, *(const char* const*) b));
+}
+
+void checkcache_remove(const char** names, size_t num_names)
+{
+	DIR* d;
+	struct dirent* ent;
+	char* dir;
+
+	if(asprintf(&dir, "%s/%s", INCEPTION_RUN_DIR, CHECKCACHE_SUBDIR) == -1)
+		return;
+	d = opendir(dir);
+	free(dir);
+	if(!d)
+		return;
+	while((ent = readdir(d)))
+	{
+		//<name>-<key>, or <name>-<key>.<pid> while it is written
+		char* name = strdup(ent->d_name);
+		char* dash = name ? strrchr(name, '-') : NULL;
+		if(dash && strspn(dash + 1, "0123456789abcdef") == 16 &&
+			(dash[17] == '\0' || dash[17] == '.'))
+		{
+			const char* key = name;
+			*dash = '\0';
+			if(bsearch(&key, names, num_names, sizeof(char*), cmp_name))
+				unlinkat(dirfd(d), ent->d_name, 0);
+		}
+		free(name);
+	}
+	closedir(d);
+}
@@ -37,7 +37,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <sys/auxv.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/fsuid.h>
 
 #include "inception.h"
 
@@ -55,26 +60,315 @@ void __attribute__((__noreturn__)) exec_shell(image_config_t* image)
 		if(chdir(image->cwd)) perror("Setting Working Directory Failed: ");
 	}
 	environ = image->environ;
+	inception_trace_instant("exec", image->shell_full_path);
 	execv(image->shell_full_path, args);
 	perror("execv failed");
 }
 
+/**
+ * Run argv as is, resolving argv[0] with the image's PATH since we are
+ * already inside the image root
+ */
+static void __attribute__((__noreturn__)) exec_command(image_config_t* image)
+{
+	if(image->cwd)
+	{
+		if(chdir(image->cwd)) perror("Setting Working Directory Failed: ");
+	}
+	//execvpe() looks PATH up in our environment, not the one it is given
+	environ = image->environ;
+	inception_trace_instant("exec", image->argv[0]);
+	execvpe(image->argv[0], image->argv, image->environ);
+	fprintf(stderr, "%s: %s\n", image->argv[0], strerror(errno));
+	exit(errno == ENOENT ? 127 : 126);
+}
+
+/**
+ * Join args with spaces for $SHELL -c
+ * @return ownership of the joined string or NULL
+ */
+static char* join_args(char** args, int nargs)
+{
+	size_t len = 1;
+	char* joined;
+	char* end;
+	int i;
+	for(i=0;i<nargs;i++)
+		len += strlen(args[i]) + 1;
+	joined = (char*) malloc(len);
+	if(!joined)
+		return(NULL);
+	end = joined;
+	for(i=0;i<nargs;i++)
+	{
+		size_t arg_len = strlen(args[i]);
+		if(i)
+			*end++ = ' ';
+		memcpy(end, args[i], arg_len);
+		end += arg_len;
+	}
+	*end = '\0';
+	return(joined);
+}
+
+/**
+ * Parse a byte count with an optional k/m/g/t (binary) suffix
+ * @return 0 on success
+ */
+static int parse_size(const char* str, uint64_t* size)
+{
+	char* end;
+	unsigned long long value;
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if(errno || end == str)
+		return(-1);
+	//each suffix falls through to the smaller ones
+	switch(*end) {
+		case 't': case 'T':
+			value <<= 10;
+			/* fallthrough */
+		case 'g': case 'G':
+			value <<= 10;
+			/* fallthrough */
+		case 'm': case 'M':
+			value <<= 10;
+			/* fallthrough */
+		case 'k': case 'K':
+			value <<= 10;
+			end++;
+			/* fallthrough */
+		case '\0':
+			break;
+		default:
+			return(-1);
+	}
+	if(*end)
+		return(-1);
+	*size = value;
+	return(0);
+}
+
+/**
+ * Warm the page cache for image from a manifest, as the real user
+ * @return exit status
+ */
+static int prewarm(image_config_t* image, const char* manifest_path,
+			inception_prewarm_t* opts)
+{
+	inception_identity_t* user = image_identity(image);
+	FILE* manifest;
+	int ret;
+	if(!user)
+	{
+		fprintf(stderr, "Error: You don't seem to exist\n");
+		return(1);
+	}
+	//image files are attached, nothing else needs root
+	if(drop_to_identity(user))
+		return(1);
+	if(strcmp(manifest_path, "-") == 0)
+		manifest = stdin;
+	else
+		manifest = fopen(manifest_path, "re");
+	if(!manifest)
+	{
+		fprintf(stderr, "%s: %s\n", manifest_path, strerror(errno));
+		return(1);
+	}
+	ret = prewarm_image(image, manifest, opts);
+	if(manifest != stdin)
+		fclose(manifest);
+	if(ret)
+		return(1);
+	printf("%s: %zu files, %.1f MiB in %.3f s with %d workers",
+		image->name, opts->files, opts->bytes / 1048576.0,
+		opts->elapsed_ns / 1e9, opts->workers);
+	if(opts->missing)
+		printf(", %zu missing", opts->missing);
+	if(opts->truncated || opts->skipped)
+		printf(", budget reached (%zu partial, %zu skipped)", opts->truncated,
+			opts->skipped);
+	printf("\n");
+	return(0);
+}
+
+/**
+ * fopen() with the real user's permissions, we are still setuid root
+ * @return stream, std_stream for "-", or NULL
+ */
+static FILE* fopen_as_user(const char* path, const char* mode, FILE* std_stream)
+{
+	uid_t old_fsuid;
+	gid_t old_fsgid;
+	FILE* f;
+	if(strcmp(path, "-") == 0)
+		return(std_stream);
+	old_fsgid = setfsgid(getgid());
+	old_fsuid = setfsuid(getuid());
+	f = fopen(path, mode);
+	setfsuid(old_fsuid);
+	setfsgid(old_fsgid);
+	if(!f)
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return(f);
+}
+
+/**
+ * Run the task stream inside the image we are in
+ * @return exit status, 1 if any task failed
+ */
+static int farm(image_config_t* image, FILE* commands, inception_farm_t* opts)
+{
+	int ret = farm_run(image, commands, opts);
+	if(opts->report)
+	{
+		fprintf(opts->report, "# %s: %zu tasks, %zu failed in %.3f s with %d jobs\n",
+			image->name, opts->tasks, opts->failed, opts->elapsed_ns / 1e9,
+			opts->jobs);
+		fflush(opts->report);
+	}
+	return(ret || opts->failed ? 1 : 0);
+}
+
+static const char* env_value(char** envp, const char* name)
+{
+	size_t len = strlen(name);
+	for(;*envp;envp++)
+	{
+		if(strncmp(*envp, name, len) == 0 && (*envp)[len] == '=')
+			return(*envp + len + 1);
+	}
+	return(NULL);
+}
+
+/**
+ * Find which of the node's tasks we are from what the launcher (Open MPI's
+ * mpirun or srun) told us
+ */
+static void local_task_from_env(char** envp, int* local_task, int* local_tasks)
+{
+	const char* rank = env_value(envp, "OMPI_COMM_WORLD_LOCAL_RANK");
+	const char* size = env_value(envp, "OMPI_COMM_WORLD_LOCAL_SIZE");
+	const char* per_node;
+	const char* node;
+	long remaining;
+	*local_task = -1;
+	*local_tasks = 0;
+	if(rank && size)
+	{
+		*local_task = atoi(rank);
+		*local_tasks = atoi(size);
+		return;
+	}
+	rank = env_value(envp, "SLURM_LOCALID");
+	per_node = env_value(envp, "SLURM_STEP_TASKS_PER_NODE");
+	node = env_value(envp, "SLURM_NODEID");
+	if(!rank)
+		return;
+	*local_task = atoi(rank);
+	if(!per_node || !node)
+		return;
+	//"4(x2),3": four tasks on each of the first two nodes, three on the next
+	remaining = atol(node);
+	while(*per_node)
+	{
+		char* end;
+		long tasks = strtol(per_node, &end, 10);
+		long repeat = 1;
+		if(end == per_node)
+			return;
+		if(strncmp(end, "(x", 2) == 0)
+		{
+			repeat = strtol(end + 2, &end, 10);
+			if(*end != ')')
+				return;
+			end++;
+		}
+		if(remaining < repeat)
+		{
+			*local_tasks = tasks;
+			return;
+		}
+		remaining -= repeat;
+		per_node = *end == ',' ? end + 1 : end;
+	}
+}
+
+/**
+ * Print what check_image() made of the image's mounts, for -d
+ */
+static void print_plan(const image_config_t* image)
+{
+	const inception_plan_t* plan = &image->plan;
+	size_t i;
+	printf("# %s: %zu mounts, %zu normalized, %zu shadowed, %zu covered, %zu merged\n",
+		image->name, plan->mounts_in, plan->normalized, plan->shadowed,
+		plan->covered, plan->merged);
+	printf("# %zu mount calls (was %zu)\n", image->num_mounts, plan->mounts_in);
+	//planning and checking are both skipped on a check cache hit
+	printf("# check cache miss: %zu stats (%zu planning, %zu checking) and %zu mountinfo"
+		" entries read, was %zu stats\n", plan->plan_stats + plan->stats_out,
+		plan->plan_stats, plan->stats_out, plan->mountinfo_entries, plan->stats_in);
+	for(i=0;i<image->num_mounts;i++)
+	{
+		printf("%s %s -> %s", image->mount_type[i], image->mount_from[i],
+			image->mount_to[i]);
+		if(image->mount_options[i])
+			printf(" [%s]", image->mount_options[i]);
+		printf("\n");
+	}
+	if(image->ld_cache_dir)
+		printf("# plus a bind of the library cache on %s\n", image->ld_cache_dir);
+}
+
 static void usage()
 {
+	printf("inception [options] [command [args...]]\n");
 	printf("-c {image_name}\n");
 	printf("-p {cwd}\n");
+	printf("-s #run the command with $SHELL -c (joined with spaces) instead of\n");
+	printf("    directly; without a command the shell is always started\n");
 	printf("-x #copy environment\n");
+	printf("-d #don't launch, print the mounts the image would get and what\n");
+	printf("    planning them saves; reads the config and stats the mount\n");
+	printf("    sources, changes nothing on the node\n");
+	printf("-t {file} #append launch phase trace events to file\n");
+	printf("           (or set INCEPTION_TRACE={file})\n");
+	printf("-r {manifest} #write the image files the command opens, in order, to\n");
+	printf("               manifest (for -w)\n");
+	printf("-w {manifest} #don't launch, read the image files listed in manifest\n");
+	printf("               (paths inside the image, - for stdin) into the page cache\n");
+	printf("-f {file} #run every line of file (- for stdin) with $SHELL -c, all in\n");
+	printf("           one launch of the image, instead of a command\n");
+	printf("-o {file} #report line, exit status, seconds and command of every -f\n");
+	printf("           task here, default stderr\n");
+	printf("-j {workers} #threads for -w (default one per cpu up to 16), tasks run\n");
+	printf("              at once for -f (default one per cpu)\n");
+	printf("-m {bytes[k|m|g]} #read at most this much for -w, default half of\n");
+	printf("                   the available memory\n");
 }
 
-int main(int argc, char** argv)
+int main(int argc, char** argv, char** envp)
 {
 	int ch;
 	char* config_name = NULL;
-	char* tmpptr;
-	int i;
 	char** clean_environ = {NULL};
 	char restore_environ=0;
-	char** old_environ = load_insecure_environ(getpid());
+	char use_shell=0;
+	char dry_run=0;
+	char* prewarm_manifest = NULL;
+	char* record_manifest = NULL;
+	char* farm_path = NULL;
+	char* farm_report = NULL;
+	FILE* farm_commands = NULL;
+	inception_prewarm_t prewarm_opts;
+	inception_farm_t farm_opts;
+	inception_span_t launch;
+	if(getenv("INCEPTION_TRACE"))
+		inception_trace_open(getenv("INCEPTION_TRACE"));
+	inception_span_begin(&launch, "cli");
+	//envp stays valid, we only stop libc (and NSS) from seeing it
 	environ = clean_environ;
 	//clearenv()?
 	image_config_t image;
@@ -83,11 +377,23 @@ int main(int argc, char** argv)
 		{ "new_namespace", no_argument, NULL, 'n'},
 		{ "export_environment", no_argument, NULL, 'x'},
 		{ "cwd", optional_argument, NULL, 'p'},
+		{ "shell", no_argument, NULL, 's'},
+		{ "dry-run", no_argument, NULL, 'd'},
+		{ "trace", required_argument, NULL, 't'},
+		{ "record", required_argument, NULL, 'r'},
+		{ "prewarm", required_argument, NULL, 'w'},
+		{ "prewarm-workers", required_argument, NULL, 'j'},
+		{ "prewarm-budget", required_argument, NULL, 'm'},
+		{ "farm", required_argument, NULL, 'f'},
+		{ "farm-report", required_argument, NULL, 'o'},
 		{ "help", no_argument, NULL, 'h'},
 		{ NULL, 0, NULL, 0 }	
 	};
 	memset(&image, 0, sizeof(image_config_t));
-	while((ch = getopt_long(argc, argv, "c:p:nxh", longopts, NULL))!= -1)
+	memset(&prewarm_opts, 0, sizeof(prewarm_opts));
+	memset(&farm_opts, 0, sizeof(farm_opts));
+	//'+': everything from the command on belongs to the command
+	while((ch = getopt_long(argc, argv, "+c:p:t:r:w:j:m:f:o:dnsxh", longopts, NULL))!= -1)
 	{
 		switch(ch) {
 			case 'c':
@@ -98,9 +404,42 @@ int main(int argc, char** argv)
 			case 'x':
 				restore_environ = 1;
 				break;
+			case 's':
+				use_shell = 1;
+				break;
+			case 'd':
+				dry_run = 1;
+				break;
 			case 'p':
 				asprintf(&(image.cwd), "%s", optarg);
 				break;
+			case 't':
+				inception_trace_open(optarg);
+				inception_span_begin(&launch, "cli");
+				break;
+			case 'r':
+				record_manifest = optarg;
+				break;
+			case 'w':
+				prewarm_manifest = optarg;
+				break;
+			case 'j':
+				prewarm_opts.workers = atoi(optarg);
+				farm_opts.jobs = atoi(optarg);
+				break;
+			case 'f':
+				farm_path = optarg;
+				break;
+			case 'o':
+				farm_report = optarg;
+				break;
+			case 'm':
+				if(parse_size(optarg, &prewarm_opts.budget) || !prewarm_opts.budget)
+				{
+					fprintf(stderr, "Invalid size: %s\n", optarg);
+					return(1);
+				}
+				break;
 			case 'h':
 				usage();
 				return(0);
@@ -109,36 +448,108 @@ int main(int argc, char** argv)
 				return(1);
 			}
 	}
+	if(farm_path && optind < argc)
+	{
+		fprintf(stderr, "-f runs the commands it reads, not a command\n");
+		return(1);
+	}
+	if(optind < argc && use_shell)
+	{
+		image.usercmd = join_args(argv + optind, argc - optind);
+		if(!image.usercmd)
+			return(1);
+	}
+	else if(optind < argc)
+	{
+		image.argv = argv + optind;
+	}
+
+	if(dry_run)
+	{
+		//not a launch, keep it out of the node's statistics too
+		inception_stats_disable();
+		if(plan_config(INCEPTION_CONFIG_PATH, config_name, &image) != 0)
+			return(1);
+		print_plan(&image);
+		return(0);
+	}
+	if(parse_config(INCEPTION_CONFIG_PATH, config_name, &image) != 0)
+		return(1);
+	if(prewarm_manifest)
+		return(prewarm(&image, prewarm_manifest, &prewarm_opts));
+	//setuid, glibc has already dropped LD_LIBRARY_PATH, TMPDIR and the
+	//like from envp, the kernel's copy still has them
 	if(restore_environ)
-		image.environ = old_environ;
-	else
 	{
-		image.environ = clean_environ;
-		build_default_environ(&image);
+		image.environ = getauxval(AT_SECURE) ? load_insecure_environ(getpid()) : envp;
+		if(!image.environ)
+			return(1);
+	}
+	else if(build_default_environ(&image))
+	{
+		return(1);
+	}
+	image.environ = filter_environ(&image, image.environ);
+	if(!image.environ)
+		return(1);
+	ld_cache_environ(&image);
+	if(record_manifest)
+	{
+		image.recorder = recorder_open(record_manifest);
+		if(!image.recorder)
+			return(1);
+	}
+	if(farm_path)
+	{
+		//both are host paths, so open them before entering the image
+		farm_commands = fopen_as_user(farm_path, "re", stdin);
+		if(!farm_commands)
+			return(1);
+		farm_opts.report = farm_report ?
+			fopen_as_user(farm_report, "we", stdout) : stderr;
+		if(!farm_opts.report)
+			return(1);
 	}
 
-	if(optind < argc)
+	setup_namespace(&image);
+	if(image.mempolicy || image.num_cpu_map || image.thp)
+	{
+		int local_task, local_tasks;
+		local_task_from_env(envp, &local_task, &local_tasks);
+		//a node that doesn't match the image's tuning still runs the job
+		apply_placement(&image, local_task, local_tasks);
+	}
+	if(image.recorder)
 	{
-		for(i=optind;i<argc;i++)
+		//the command runs in a child while we watch it
+		pid_t child = fork();
+		if(child < 0)
 		{
-			if(image.usercmd)
-			{
-				tmpptr = image.usercmd;
-				asprintf(&(image.usercmd), "%s %s", image.usercmd, argv[i]);
-				free(tmpptr);
-			}
-			else
-			{
-				asprintf(&(image.usercmd), "%s", argv[i]);
-			}
-
+			perror("fork");
+			return(1);
+		}
+		if(child > 0)
+		{
+			int status = recorder_run(image.recorder, &image, child);
+			recorder_free(image.recorder);
+			if(status < 0)
+				return(1);
+			return(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
 		}
 	}
-
-	parse_config(INCEPTION_CONFIG_PATH, config_name, &image);
-
-	setup_namespace(&image);
+	if(image.argv)
+	{
+		inception_span_end(&launch, image.name);
+		exec_command(&image);
+	}
+	if(farm_commands)
+	{
+		find_shell(&image);
+		inception_span_end(&launch, image.name);
+		return(farm(&image, farm_commands, &farm_opts));
+	}
 	find_shell(&image);
+	inception_span_end(&launch, image.name);
 	exec_shell(&image);
 
 	if(config_name) free(config_name);
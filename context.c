@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Context API
+ *
+ * pam_inception and slurm-inception live inside sshd and slurmstepd, which
+ * must neither exit because one session's image is broken nor grow with
+ * every session. A context owns one loaded image and everything allocated
+ * for it, reports every failure as an INCEPTION_ERR_* code and gives it all
+ * back in inception_free().
+ *
+ * Workflow engines launch from many threads at once, so a context carries
+ * its own logger and inception_spawn() builds the namespace in a child
+ * instead of the caller.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "inception.h"
+#include "inception_private.h"
+
+struct inception_ctx
+{
+	char* config_path;
+	image_config_t image;
+	int loaded;
+	int launched;
+	inception_logger_t log;
+};
+
+inception_ctx_t* inception_create(const char* config_path)
+{
+	inception_ctx_t* ctx = (inception_ctx_t*) calloc(1, sizeof(inception_ctx_t));
+	if(!ctx)
+		return(NULL);
+	ctx->config_path = strdup(config_path ? config_path : INCEPTION_CONFIG_PATH);
+	if(!ctx->config_path)
+	{
+		free(ctx);
+		return(NULL);
+	}
+	return(ctx);
+}
+
+/**
+ * Drop the loaded image and its references
+ */
+static void ctx_unload(inception_ctx_t* ctx)
+{
+	if(!ctx->loaded)
+		return;
+	if(!ctx->launched)
+	{
+		detach_image_file(&ctx->image);
+		ld_cache_detach(&ctx->image);
+	}
+	free_image_fields(&ctx->image);
+	memset(&ctx->image, 0, sizeof(image_config_t));
+	ctx->loaded = 0;
+}
+
+int inception_load(inception_ctx_t* ctx, const char* name)
+{
+	const inception_logger_t* prev = elog_thread(&ctx->log);
+	int ret;
+	ctx_unload(ctx);
+	ret = parse_config(ctx->config_path, (char*) name, &ctx->image);
+	//whatever got attached before the failure goes too
+	ctx->loaded = 1;
+	if(ret)
+		ctx_unload(ctx);
+	elog_thread(prev);
+	return(ret);
+}
+
+image_config_t* inception_image(inception_ctx_t* ctx)
+{
+	return(ctx->loaded ? &ctx->image : NULL);
+}
+
+int inception_launch(inception_ctx_t* ctx)
+{
+	const inception_logger_t* prev;
+	int ret;
+	if(!ctx->loaded)
+		return(INCEPTION_ERR_NOT_FOUND);
+	//the launched processes own the image file references from here on
+	ctx->launched = 1;
+	prev = elog_thread(&ctx->log);
+	ret = namespace_setup(&ctx->image);
+	elog_thread(prev);
+	return(ret);
+}
+
+//what the spawned child reports besides namespace_setup_forked() failures
+enum {
+	SPAWN_CWD = NS_STEPS,
+	SPAWN_EXEC
+};
+
+/**
+ * The spawned child: enter the image and exec, or report why not on
+ * report_fd. It was forked from a threaded process, so it only makes
+ * syscalls and inception_spawn() does the logging.
+ */
+static void __attribute__((__noreturn__)) spawn_child(image_config_t* image,
+				const ns_strings_t* strings, int ns_fd,
+				char* const argv[], char* const envp[], int report_fd)
+{
+	ns_report_t report;
+	trace_after_fork();
+	if(namespace_setup_forked(image, strings, ns_fd, &report))
+	{
+		write(report_fd, &report, sizeof(report));
+		_exit(127);
+	}
+	if(image->cwd && chdir(image->cwd))
+	{
+		report.step = SPAWN_CWD;
+		report.err = errno;
+		write(report_fd, &report, sizeof(report));
+	}
+	//execvpe() looks PATH up in our environment, not the one it is given
+	environ = (char**) envp;
+	execvpe(argv[0], argv, envp);
+	report.step = SPAWN_EXEC;
+	report.err = errno;
+	write(report_fd, &report, sizeof(report));
+	_exit(report.err == ENOENT ? 127 : 126);
+}
+
+int inception_spawn(inception_ctx_t* ctx, char* const argv[], char* const envp[], pid_t* pid)
+{
+	const inception_logger_t* prev;
+	image_config_t* image = &ctx->image;
+	nscache_entry_t cached;
+	ns_strings_t strings;
+	ns_report_t r;
+	inception_span_t phase;
+	int report[2];
+	int ns_fd = -1;
+	int err = 0;
+	ssize_t len;
+	pid_t child;
+
+	if(!ctx->loaded)
+		return(INCEPTION_ERR_NOT_FOUND);
+	prev = elog_thread(&ctx->log);
+	inception_span_begin(&phase, "setup_namespace");
+	//the child may only make syscalls, other threads can hold the malloc,
+	//stdio or syslog locks when we fork; NSS (sssd, LDAP) isn't safe there
+	//either. Everything else happens here.
+	if(!image_identity(image))
+	{
+		elog("Error: You don't seem to exist\n");
+		err = INCEPTION_ERR_USER;
+		goto out;
+	}
+	if(!envp)
+	{
+		if(!image->environ && (err = build_default_environ(image)))
+			goto out;
+		envp = image->environ;
+	}
+	if(make_ns_strings(image, &strings))
+	{
+		elog("Unable to spawn into %s: %s\n", image->name, strerror(errno));
+		err = INCEPTION_ERR_NOMEM;
+		goto out;
+	}
+	if(image->ns_cache_ttl > 0)
+	{
+		//a cached namespace is built here, where it can be pinned
+		ns_fd = nscache_open(image, &cached);
+		image->ns_joined = ns_fd >= 0;
+		stats_record(ns_fd >= 0 ? "nscache_hit" : "nscache_miss", NULL, 0);
+		if(ns_fd < 0)
+		{
+			ns_fd = prepare_namespace(image);
+			nscache_pin_fd(&cached, ns_fd);
+			if(ns_fd < 0)
+			{
+				err = INCEPTION_ERR_NAMESPACE;
+				goto out_strings;
+			}
+		}
+	}
+	//the first stats_record() maps the segment under a mutex
+	stats_enabled();
+	//close on exec, so it only stays open in the child if setup failed (and
+	//never leaks into children other threads are spawning)
+	if(pipe2(report, O_CLOEXEC))
+	{
+		elog("Unable to spawn into %s: %s\n", image->name, strerror(errno));
+		err = INCEPTION_ERR_NAMESPACE;
+		goto out_ns;
+	}
+	child = fork();
+	if(child == 0)
+	{
+		close(report[0]);
+		spawn_child(image, &strings, ns_fd, argv, envp, report[1]);
+	}
+	close(report[1]);
+	if(child < 0)
+	{
+		elog("Unable to spawn into %s: %s\n", image->name, strerror(errno));
+		close(report[0]);
+		err = INCEPTION_ERR_NAMESPACE;
+		goto out_ns;
+	}
+	//until the child execs (and closes the pipe) or gives up
+	while(1)
+	{
+		len = read(report[0], &r, sizeof(r));
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len != sizeof(r))
+			break;
+		if(r.step == SPAWN_CWD)
+			elog("Setting Working Directory Failed: %s\n", strerror(r.err));
+		else if(r.step == SPAWN_EXEC)
+			elog("%s: %s\n", argv[0], strerror(r.err));
+		else
+		{
+			log_ns_failure(image, &strings, &r);
+			err = r.step >= NS_SETGID ? INCEPTION_ERR_USER : INCEPTION_ERR_NAMESPACE;
+		}
+	}
+	close(report[0]);
+	if(err)
+	{
+		waitpid(child, NULL, 0);
+		goto out_ns;
+	}
+	*pid = child;
+	stats_record("launch", image->name, inception_span_end(&phase, image->name));
+out_ns:
+	if(ns_fd >= 0)
+		close(ns_fd);
+out_strings:
+	free_ns_strings(&strings);
+out:
+	elog_thread(prev);
+	return(err);
+}
+
+int inception_share_namespace(inception_ctx_t* ctx, uid_t uid, const char* scope, int ttl)
+{
+	image_config_t* image = &ctx->image;
+	if(!ctx->loaded)
+		return(INCEPTION_ERR_NOT_FOUND);
+	free(image->ns_scope);
+	image->ns_scope = strdup(scope ? scope : "");
+	if(!image->ns_scope)
+		return(INCEPTION_ERR_NOMEM);
+	image->ns_uid = uid;
+	if(ttl > image->ns_cache_ttl)
+		image->ns_cache_ttl = ttl;
+	return(0);
+}
+
+void inception_set_log(inception_ctx_t* ctx, inception_log_fun_t log_fun, void* arg)
+{
+	ctx->log.fun = log_fun;
+	ctx->log.arg = arg;
+}
+
+void inception_free(inception_ctx_t* ctx)
+{
+	if(!ctx)
+		return;
+	ctx_unload(ctx);
+	free(ctx->config_path);
+	free(ctx);
+}
+
+const char* inception_strerror(int err)
+{
+	switch(err) {
+		case 0:
+			return("Success");
+		case INCEPTION_ERR_CONFIG:
+			return("Unable to read the image config");
+		case INCEPTION_ERR_NOT_FOUND:
+			return("Image not found");
+		case INCEPTION_ERR_IMAGE:
+			return("Malformed image config");
+		case INCEPTION_ERR_CHECK:
+			return("Image failed its checks");
+		case INCEPTION_ERR_USER:
+			return("Unable to become the user");
+		case INCEPTION_ERR_NAMESPACE:
+			return("Unable to set up the image namespace");
+		case INCEPTION_ERR_NOMEM:
+			return("Out of memory");
+		default:
+			return("Unknown error");
+	}
+}
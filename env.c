@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Launch environment
+ *
+ * The environment handed to the image comes straight from the launcher
+ * (main()'s envp, pam_getenvlist() or the SPANK job environment) and is
+ * passed through the image's "environment" rules:
+ *	"allow": names (or "PREFIX*") to keep, everything else is dropped
+ *	"deny": names (or "PREFIX*") to drop, wins over allow
+ *	"set": {"NAME": "value"} replaces or adds NAME
+ * The rules are kept in image->env_rules as "+NAME", "-NAME" and "NAME=value"
+ * and compiled into a hash set the first time an environment is filtered, so
+ * every variable costs one lookup. Filtering only builds a new pointer array;
+ * no variable is copied.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define ENV_ALLOW 0x1
+#define ENV_DENY 0x2
+#define ENV_SET 0x4
+
+struct env_rule
+{
+	const char* name; //not terminated, points into image->env_rules
+	size_t len;
+	int actions;
+};
+
+struct inception_env_filter
+{
+	size_t mask;
+	struct env_rule* table;
+	size_t num_prefixes;
+	struct env_rule* prefixes;
+	int has_allow;
+};
+
+static uint32_t env_hash(const char* name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for(i=0;i<len;i++)
+	{
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+	return(hash);
+}
+
+static void env_insert(struct inception_env_filter* filter, const char* name,
+			size_t len, int action)
+{
+	size_t slot = env_hash(name, len) & filter->mask;
+	while(filter->table[slot].name)
+	{
+		if(filter->table[slot].len == len &&
+			memcmp(filter->table[slot].name, name, len) == 0)
+		{
+			filter->table[slot].actions |= action;
+			return;
+		}
+		slot = (slot + 1) & filter->mask;
+	}
+	filter->table[slot].name = name;
+	filter->table[slot].len = len;
+	filter->table[slot].actions = action;
+}
+
+static struct inception_env_filter* env_compile(image_config_t* image)
+{
+	struct inception_env_filter* filter;
+	size_t size, i;
+
+	filter = (struct inception_env_filter*) calloc(1, sizeof(*filter));
+	if(!filter)
+		return(NULL);
+	for(size=8;size<2*image->num_env_rules;size<<=1);
+	filter->mask = size - 1;
+	filter->table = (struct env_rule*) calloc(size, sizeof(struct env_rule));
+	filter->prefixes = (struct env_rule*) calloc(image->num_env_rules + 1,
+						sizeof(struct env_rule));
+	if(!filter->table || !filter->prefixes)
+	{
+		free(filter->table);
+		free(filter->prefixes);
+		free(filter);
+		return(NULL);
+	}
+	for(i=0;i<image->num_env_rules;i++)
+	{
+		const char* rule = image->env_rules[i];
+		const char* name = rule;
+		size_t len;
+		int action;
+		if(rule[0] == '+' || rule[0] == '-')
+		{
+			action = rule[0] == '+' ? ENV_ALLOW : ENV_DENY;
+			name++;
+			len = strlen(name);
+		}
+		else
+		{
+			action = ENV_SET;
+			len = strcspn(name, "=");
+		}
+		if(action == ENV_ALLOW)
+			filter->has_allow = 1;
+		if(action != ENV_SET && len && name[len-1] == '*')
+		{
+			struct env_rule* prefix = &filter->prefixes[filter->num_prefixes++];
+			prefix->name = name;
+			prefix->len = len - 1;
+			prefix->actions = action;
+			continue;
+		}
+		env_insert(filter, name, len, action);
+	}
+	return(filter);
+}
+
+static int env_actions(const struct inception_env_filter* filter, const char* entry)
+{
+	size_t len = strcspn(entry, "=");
+	size_t slot = env_hash(entry, len) & filter->mask;
+	int actions = 0;
+	size_t i;
+	while(filter->table[slot].name)
+	{
+		if(filter->table[slot].len == len &&
+			memcmp(filter->table[slot].name, entry, len) == 0)
+		{
+			actions = filter->table[slot].actions;
+			break;
+		}
+		slot = (slot + 1) & filter->mask;
+	}
+	for(i=0;i<filter->num_prefixes;i++)
+	{
+		if(filter->prefixes[i].len <= len &&
+			memcmp(filter->prefixes[i].name, entry, filter->prefixes[i].len) == 0)
+			actions |= filter->prefixes[i].actions;
+	}
+	return(actions);
+}
+
+/**
+ * @return the image's compiled rules, NULL if it has none
+ */
+static const struct inception_env_filter* env_filter(image_config_t* image)
+{
+	if(!image->num_env_rules)
+		return(NULL);
+	if(!image->env_filter)
+		image->env_filter = env_compile(image);
+	return(image->env_filter);
+}
+
+int environ_keeps(image_config_t* image, const char* entry)
+{
+	const struct inception_env_filter* filter = env_filter(image);
+	int actions;
+	if(!filter)
+		return(1);
+	actions = env_actions(filter, entry);
+	if(actions & (ENV_DENY|ENV_SET))
+		return(0);
+	return(!filter->has_allow || (actions & ENV_ALLOW));
+}
+
+char** filter_environ(image_config_t* image, char** env)
+{
+	size_t n = 0, kept = 0, i;
+	char** out;
+	inception_span_t span;
+
+	inception_span_begin(&span, "filter_environ");
+	while(env && env[n])
+		n++;
+	out = (char**) malloc(sizeof(char*)*(n + image->num_env_rules + 1));
+	if(!out)
+	{
+		inception_span_end(&span, NULL);
+		return(NULL);
+	}
+	for(i=0;i<n;i++)
+	{
+		if(environ_keeps(image, env[i]))
+			out[kept++] = env[i];
+	}
+	for(i=0;i<image->num_env_rules;i++)
+	{
+		if(image->env_rules[i][0] != '+' && image->env_rules[i][0] != '-')
+			out[kept++] = image->env_rules[i];
+	}
+	out[kept] = NULL;
+	inception_span_end(&span, image->name);
+	return(out);
+}
+
+int apply_environ(image_config_t* image, char** env,
+		int (*unset_var)(void* ctx, const char* name),
+		int (*set_var)(void* ctx, const char* entry), void* ctx)
+{
+	size_t n = 0, ndrop = 0, i;
+	char** drop;
+	int ret = 0;
+	while(env && env[n])
+		n++;
+	//unset_var() may edit env (spank_unsetenv() does), so collect first
+	drop = (char**) malloc(sizeof(char*)*(n + 1));
+	if(!drop)
+		return(-1);
+	for(i=0;i<n;i++)
+	{
+		if(environ_keeps(image, env[i]))
+			continue;
+		drop[ndrop] = strndup(env[i], strcspn(env[i], "="));
+		if(drop[ndrop])
+			ndrop++;
+		else
+			ret = -1;
+	}
+	for(i=0;i<ndrop;i++)
+	{
+		if(unset_var(ctx, drop[i]))
+			ret = -1;
+		free(drop[i]);
+	}
+	free(drop);
+	for(i=0;i<image->num_env_rules;i++)
+	{
+		if(image->env_rules[i][0] != '+' && image->env_rules[i][0] != '-' &&
+			set_var(ctx, image->env_rules[i]))
+			ret = -1;
+	}
+	return(ret);
+}
+
+void free_env_filter(image_config_t* image)
+{
+	if(!image->env_filter)
+		return;
+	free(image->env_filter->table);
+	free(image->env_filter->prefixes);
+	free(image->env_filter);
+	image->env_filter = NULL;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Task farming
+ *
+ * High throughput workloads are millions of short tasks, and a launch per
+ * task pays for the config, the namespace and every mount each time.
+ * farm_run() is called once the namespace is set up and the caller is the
+ * user inside the image; it runs every line of a command stream with the
+ * image's shell (-c), at most farm->jobs at a time, all in this namespace,
+ * and reports each task's exit status and run time as it finishes.
+ *
+ * Blank lines and lines starting with '#' are skipped, tasks are numbered
+ * by line so a report can be matched back to the input.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define FARM_MAX_JOBS 4096
+
+struct farm_task
+{
+	pid_t pid;
+	size_t line;
+	uint64_t start;
+	char* command;
+};
+
+static uint64_t farm_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec);
+}
+
+/**
+ * Start command in a child
+ * @return the child's pid, -1 if fork() failed
+ */
+static pid_t farm_start(image_config_t* image, const char* command, int null_fd)
+{
+	char* args[] = {image->shell, "-c", (char*) command, NULL};
+	pid_t pid = fork();
+	if(pid != 0)
+		return(pid);
+	//tasks don't get to eat the command stream when it is our stdin
+	if(null_fd >= 0)
+		dup2(null_fd, STDIN_FILENO);
+	else
+		close(STDIN_FILENO);
+	if(image->cwd && chdir(image->cwd))
+		perror("Setting Working Directory Failed: ");
+	environ = image->environ;
+	execv(image->shell_full_path, args);
+	perror("execv failed");
+	_exit(127);
+}
+
+/**
+ * Wait for one of the running tasks and report it
+ * @return 0, -1 if nothing was running
+ */
+static int farm_reap(struct farm_task* tasks, int jobs, inception_farm_t* farm)
+{
+	int status, i, code;
+	uint64_t dur;
+	pid_t pid;
+
+	do
+	{
+		pid = waitpid(-1, &status, 0);
+		if(pid < 0 && errno != EINTR)
+			return(-1);
+		for(i=0;i<jobs && tasks[i].pid != pid;i++);
+		//not one of ours (e.g. a daemon a task left behind), keep waiting
+	} while(pid < 0 || i == jobs);
+	dur = farm_now() - tasks[i].start;
+	code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	farm->tasks++;
+	if(code)
+		farm->failed++;
+	stats_record("farm_task", NULL, dur);
+	if(farm->report)
+	{
+		fprintf(farm->report, "%zu\t%d\t%.6f\t%s\n", tasks[i].line, code,
+			dur / 1e9, tasks[i].command);
+		fflush(farm->report);
+	}
+	free(tasks[i].command);
+	memset(&tasks[i], 0, sizeof(struct farm_task));
+	return(0);
+}
+
+int farm_run(image_config_t* image, FILE* commands, inception_farm_t* farm)
+{
+	struct farm_task* tasks;
+	char* line = NULL;
+	size_t line_cap = 0;
+	size_t lineno = 0;
+	ssize_t len;
+	uint64_t start = farm_now();
+	int running = 0;
+	int ret = 0;
+	int null_fd;
+	int i;
+
+	if(farm->jobs <= 0)
+	{
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		farm->jobs = ncpu > 0 ? ncpu : 1;
+	}
+	if(farm->jobs > FARM_MAX_JOBS)
+		farm->jobs = FARM_MAX_JOBS;
+	farm->tasks = 0;
+	farm->failed = 0;
+	tasks = (struct farm_task*) calloc(farm->jobs, sizeof(struct farm_task));
+	if(!tasks)
+		return(-4);
+	null_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+	while((len = getline(&line, &line_cap, commands)) != -1)
+	{
+		lineno++;
+		if(len > 0 && line[len-1] == '\n')
+			line[--len] = '\0';
+		if(len == 0 || line[0] == '#')
+			continue;
+		if(running == farm->jobs)
+		{
+			if(farm_reap(tasks, farm->jobs, farm) == 0)
+				running--;
+		}
+		for(i=0;i<farm->jobs && tasks[i].pid;i++);
+		if(i == farm->jobs)
+		{
+			ret = -4;
+			break;
+		}
+		tasks[i].command = strdup(line);
+		tasks[i].line = lineno;
+		tasks[i].start = farm_now();
+		if(!tasks[i].command)
+		{
+			ret = -4;
+			break;
+		}
+		tasks[i].pid = farm_start(image, line, null_fd);
+		//out of processes: let a running task finish and try once more
+		if(tasks[i].pid < 0 && running && farm_reap(tasks, farm->jobs, farm) == 0)
+		{
+			running--;
+			tasks[i].start = farm_now();
+			tasks[i].pid = farm_start(image, line, null_fd);
+		}
+		if(tasks[i].pid < 0)
+		{
+			elog("Unable to start task %zu: %s\n", lineno, strerror(errno));
+			free(tasks[i].command);
+			memset(&tasks[i], 0, sizeof(struct farm_task));
+			ret = -4;
+			break;
+		}
+		running++;
+	}
+	if(ret == 0 && ferror(commands))
+		ret = -2;
+	while(running > 0 && farm_reap(tasks, farm->jobs, farm) == 0)
+		running--;
+	farm->elapsed_ns = farm_now() - start;
+	if(null_fd >= 0)
+		close(null_fd);
+	free(line);
+	free(tasks);
+	return(ret);
+}
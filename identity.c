@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * User identity snapshot
+ *
+ * Everything a launch needs to know about the user (name, home, shell and
+ * the supplementary groups) is looked up once, before the namespace is
+ * entered, and kept in image->user. On sites where NSS means sssd or LDAP
+ * that is one passwd and one group lookup per launch instead of one per
+ * caller, and nothing depends on the image's own /etc/passwd.
+ *
+ * With INCEPTION_IDENTITY_TTL > 0 snapshots are also kept in
+ * INCEPTION_RUN_DIR/identity/<uid> for that many seconds so a burst of
+ * launches on a node only asks the directory server once. Group changes
+ * then take up to the ttl to reach new launches.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#ifndef INCEPTION_IDENTITY_TTL
+#define INCEPTION_IDENTITY_TTL 0
+#endif
+
+#define IDENTITY_SUBDIR "identity"
+#define IDENTITY_MAGIC 0x44495449 /* "ITID" */
+#define IDENTITY_VERSION 1
+#define IDENTITY_MAX_GROUPS 65536
+
+struct identity_record
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t ngroups;
+	uint32_t name_len;
+	uint32_t home_len;
+	uint32_t shell_len;
+	//gid_t groups[ngroups], then the three strings, each terminated
+};
+
+static char* identity_cache_path(uid_t uid)
+{
+	char* path;
+	if(asprintf(&path, "%s/%s/%u", INCEPTION_RUN_DIR, IDENTITY_SUBDIR, (unsigned) uid) == -1)
+		return(NULL);
+	return(path);
+}
+
+/**
+ * @return 0 if a fresh snapshot for uid/gid was found in the node cache
+ */
+static int identity_cache_load(uid_t uid, gid_t gid, inception_identity_t* id)
+{
+	struct identity_record rec;
+	struct stat st;
+	char* path = identity_cache_path(uid);
+	char* data = NULL;
+	size_t groups_len, len;
+	int fd, ret = -1;
+
+	if(!path)
+		return(-1);
+	fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	free(path);
+	if(fd < 0)
+		return(-1);
+	//only trust what we (root) wrote, and only for the ttl
+	if(fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+		(st.st_uid != 0 && st.st_uid != geteuid()) ||
+		(st.st_mode & (S_IWGRP|S_IWOTH)) ||
+		time(NULL) - st.st_mtime > INCEPTION_IDENTITY_TTL ||
+		st.st_size < (off_t) sizeof(rec) ||
+		pread(fd, &rec, sizeof(rec), 0) != sizeof(rec))
+		goto out;
+	if(rec.magic != IDENTITY_MAGIC || rec.version != IDENTITY_VERSION ||
+		rec.uid != uid || rec.gid != gid || rec.ngroups > IDENTITY_MAX_GROUPS)
+		goto out;
+	groups_len = sizeof(gid_t)*rec.ngroups;
+	len = groups_len + (size_t) rec.name_len + rec.home_len + rec.shell_len + 3;
+	if((off_t) (sizeof(rec) + len) != st.st_size)
+		goto out;
+	data = (char*) malloc(len);
+	if(!data || pread(fd, data, len, sizeof(rec)) != (ssize_t) len)
+		goto out;
+	if(data[groups_len + rec.name_len] != '\0' ||
+		data[groups_len + rec.name_len + 1 + rec.home_len] != '\0' ||
+		data[len - 1] != '\0')
+		goto out;
+	id->uid = uid;
+	id->gid = gid;
+	id->ngroups = rec.ngroups;
+	id->groups = (gid_t*) malloc(groups_len ? groups_len : 1);
+	id->name = strdup(data + groups_len);
+	id->home = strdup(data + groups_len + rec.name_len + 1);
+	id->shell = strdup(data + groups_len + rec.name_len + rec.home_len + 2);
+	if(!id->groups || !id->name || !id->home || !id->shell)
+	{
+		free_identity(id);
+		goto out;
+	}
+	memcpy(id->groups, data, groups_len);
+	ret = 0;
+out:
+	free(data);
+	close(fd);
+	return(ret);
+}
+
+static void identity_cache_store(const inception_identity_t* id)
+{
+	struct identity_record rec;
+	char* path;
+	char* tmp_path;
+	FILE* out;
+	int fd;
+
+	if(make_run_dir(IDENTITY_SUBDIR))
+		return;
+	path = identity_cache_path(id->uid);
+	if(!path)
+		return;
+	if(asprintf(&tmp_path, "%s.%d", path, getpid()) == -1)
+	{
+		free(path);
+		return;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = IDENTITY_MAGIC;
+	rec.version = IDENTITY_VERSION;
+	rec.uid = id->uid;
+	rec.gid = id->gid;
+	rec.ngroups = id->ngroups;
+	rec.name_len = strlen(id->name);
+	rec.home_len = strlen(id->home);
+	rec.shell_len = strlen(id->shell);
+	fd = open(tmp_path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	out = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if(!out)
+	{
+		if(fd >= 0)
+			close(fd);
+	}
+	else
+	{
+		fwrite(&rec, sizeof(rec), 1, out);
+		fwrite(id->groups, sizeof(gid_t), id->ngroups, out);
+		fwrite(id->name, 1, rec.name_len + 1, out);
+		fwrite(id->home, 1, rec.home_len + 1, out);
+		fwrite(id->shell, 1, rec.shell_len + 1, out);
+		if(fclose(out) == 0 && rename(tmp_path, path) == 0)
+		{
+			free(tmp_path);
+			free(path);
+			return;
+		}
+	}
+	unlink(tmp_path);
+	free(tmp_path);
+	free(path);
+}
+
+int resolve_identity(uid_t uid, gid_t gid, inception_identity_t* id)
+{
+	struct passwd pw;
+	struct passwd* found = NULL;
+	char* buf;
+	long buf_len = sysconf(_SC_GETPW_R_SIZE_MAX);
+	int ngroups = 64;
+	int ret;
+	inception_span_t span;
+
+	memset(id, 0, sizeof(inception_identity_t));
+	if(INCEPTION_IDENTITY_TTL > 0 && identity_cache_load(uid, gid, id) == 0)
+	{
+		stats_record("identity_cache_hit", NULL, 0);
+		return(0);
+	}
+	if(buf_len <= 0)
+		buf_len = 16384;
+	inception_span_begin(&span, "getpwuid");
+	while(1)
+	{
+		buf = (char*) malloc(buf_len);
+		if(!buf)
+		{
+			inception_span_end(&span, __func__);
+			return(-1);
+		}
+		ret = getpwuid_r(uid, &pw, buf, buf_len, &found);
+		if(ret != ERANGE)
+			break;
+		free(buf);
+		buf_len *= 2;
+	}
+	inception_span_end(&span, __func__);
+	if(ret || !found)
+	{
+		free(buf);
+		return(-1);
+	}
+	id->uid = uid;
+	id->gid = gid;
+	id->name = strdup(pw.pw_name ? pw.pw_name : "");
+	id->home = strdup(pw.pw_dir && *pw.pw_dir ? pw.pw_dir : "/");
+	id->shell = strdup(pw.pw_shell && *pw.pw_shell ? pw.pw_shell : "/bin/sh");
+	free(buf);
+	if(!id->name || !id->home || !id->shell)
+	{
+		free_identity(id);
+		return(-1);
+	}
+
+	//the group lookup initgroups() would do after the chroot
+	inception_span_begin(&span, "getgrouplist");
+	while(1)
+	{
+		int n = ngroups;
+		id->groups = (gid_t*) malloc(sizeof(gid_t)*ngroups);
+		if(!id->groups)
+			break;
+		if(getgrouplist(id->name, gid, id->groups, &n) >= 0)
+		{
+			id->ngroups = n;
+			break;
+		}
+		free(id->groups);
+		id->groups = NULL;
+		if(n <= ngroups || n > IDENTITY_MAX_GROUPS)
+			break;
+		ngroups = n;
+	}
+	inception_span_end(&span, __func__);
+	if(!id->groups)
+	{
+		free_identity(id);
+		return(-1);
+	}
+	if(INCEPTION_IDENTITY_TTL > 0 && geteuid() == 0)
+		identity_cache_store(id);
+	return(0);
+}
+
+void free_identity(inception_identity_t* id)
+{
+	free(id->name);
+	free(id->home);
+	free(id->shell);
+	free(id->groups);
+	memset(id, 0, sizeof(inception_identity_t));
+}
+
+inception_identity_t* image_identity(image_config_t* image)
+{
+	if(image->user)
+		return(image->user);
+	image->user = (inception_identity_t*) malloc(sizeof(inception_identity_t));
+	if(!image->user)
+		return(NULL);
+	if(resolve_identity(getuid(), getgid(), image->user))
+	{
+		free(image->user);
+		image->user = NULL;
+	}
+	return(image->user);
+}
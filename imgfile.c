@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Single file images
+ *
+ * "imgroot" may name a squashfs or EROFS file instead of a directory. The
+ * file is loop mounted read only, nosuid and nodev, once per node under
+ * INCEPTION_RUN_DIR/img/<key> (key comes from the file's identity, so a
+ * rebuilt image gets a fresh mount) and every launch chroots into that one
+ * mount. Ranks then share a single loop device and page cache and the
+ * parallel filesystem only sees large reads of one file.
+ *
+ * Every user of a mount holds a shared flock on <key>.ref. That fd is left
+ * open across exec on purpose, so the reference lasts as long as the launched
+ * process tree. A mount nobody references is unmounted by detach_image_file()
+ * (slurm-inception calls it at step exit) or, for launchers that exec away,
+ * by the next launch that has to mount an image. Loop devices are set up to
+ * autoclear, so they go away with the last copy of the mount in any namespace.
+ * Mounting and unmounting are serialized by INCEPTION_RUN_DIR/img/.lock.
+ *
+ * Layers of a layered image are attached the same way, one reference each.
+ * Image files may be mounted from a node local copy instead, see stage.c.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <linux/loop.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define IMGFILE_SUBDIR "img"
+#define IMGFILE_LOCK ".lock"
+#define IMGFILE_REF ".ref"
+
+#define SQUASHFS_MAGIC 0x73717368
+#define EROFS_MAGIC 0xe0f5e1e2
+#define EROFS_MAGIC_OFFSET 1024
+
+/**
+ * @return filesystem type to mount fd's contents with or NULL
+ */
+static const char* imgfile_fstype(int fd)
+{
+	uint32_t magic;
+	if(pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+		le32toh(magic) == SQUASHFS_MAGIC)
+		return("squashfs");
+	if(pread(fd, &magic, sizeof(magic), EROFS_MAGIC_OFFSET) == sizeof(magic) &&
+		le32toh(magic) == EROFS_MAGIC)
+		return("erofs");
+	return(NULL);
+}
+
+static uint64_t imgfile_key(const struct stat* st)
+{
+	uint64_t id[5] = {
+		st->st_dev, st->st_ino, st->st_size,
+		st->st_mtim.tv_sec, st->st_mtim.tv_nsec
+	};
+	const unsigned char* c = (const unsigned char*) id;
+	uint64_t hash = 14695981039346656037ull;
+	size_t i;
+	for(i=0;i<sizeof(id);i++)
+	{
+		hash ^= c[i];
+		hash *= 1099511628211ull;
+	}
+	return(hash);
+}
+
+static int imgfile_loop_configure(int loop_fd, int img_fd, const char* path)
+{
+	struct loop_info64 info;
+	memset(&info, 0, sizeof(info));
+	info.lo_flags = LO_FLAGS_READ_ONLY|LO_FLAGS_AUTOCLEAR;
+	strncpy((char*) info.lo_file_name, path, LO_NAME_SIZE-1);
+#ifdef LOOP_CONFIGURE
+	struct loop_config config;
+	memset(&config, 0, sizeof(config));
+	config.fd = img_fd;
+	config.info = info;
+	if(ioctl(loop_fd, LOOP_CONFIGURE, &config) == 0)
+		return(0);
+	if(errno != EINVAL && errno != ENOTTY)
+		return(-1);
+#endif
+	//pre 5.8 kernels, read only comes from img_fd's open mode here
+	if(ioctl(loop_fd, LOOP_SET_FD, img_fd))
+		return(-1);
+	if(ioctl(loop_fd, LOOP_SET_STATUS64, &info))
+	{
+		ioctl(loop_fd, LOOP_CLR_FD, 0);
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * Bind img_fd to a free loop device
+ * @return open fd of the loop device (its name in dev) or -1
+ */
+static int imgfile_loop(int img_fd, const char* path, char* dev, size_t dev_len)
+{
+	int ctl, loop_fd, n, tries;
+	ctl = open("/dev/loop-control", O_RDWR|O_CLOEXEC);
+	if(ctl < 0)
+		return(-1);
+	for(tries=0;tries<16;tries++)
+	{
+		n = ioctl(ctl, LOOP_CTL_GET_FREE);
+		if(n < 0)
+			break;
+		snprintf(dev, dev_len, "/dev/loop%d", n);
+		loop_fd = open(dev, O_RDONLY|O_CLOEXEC);
+		if(loop_fd < 0)
+			break;
+		if(imgfile_loop_configure(loop_fd, img_fd, path) == 0)
+		{
+			close(ctl);
+			return(loop_fd);
+		}
+		close(loop_fd);
+		//lost a race for the free device with another loop user
+		if(errno != EBUSY)
+			break;
+	}
+	close(ctl);
+	return(-1);
+}
+
+/**
+ * Unmount everything under dir that nobody holds a reference to.
+ * Caller holds the img lock.
+ */
+static void imgfile_reap(const char* dir)
+{
+	DIR* d = opendir(dir);
+	struct dirent* ent;
+	size_t suffix_len = strlen(IMGFILE_REF);
+
+	if(!d)
+		return;
+	while((ent = readdir(d)))
+	{
+		char* ref_path = NULL;
+		char* mnt_path = NULL;
+		size_t name_len = strlen(ent->d_name);
+		int fd;
+
+		if(name_len <= suffix_len || strcmp(ent->d_name + name_len - suffix_len, IMGFILE_REF))
+			continue;
+		if(asprintf(&ref_path, "%s/%s", dir, ent->d_name) == -1)
+			break;
+		if(asprintf(&mnt_path, "%s/%.*s", dir, (int) (name_len - suffix_len), ent->d_name) == -1)
+		{
+			free(ref_path);
+			break;
+		}
+		fd = open(ref_path, O_RDONLY|O_CLOEXEC);
+		if(fd >= 0 && flock(fd, LOCK_EX|LOCK_NB) == 0)
+		{
+			if(umount2(mnt_path, MNT_DETACH) == 0 || errno == EINVAL)
+			{
+				rmdir(mnt_path);
+				unlink(ref_path);
+				stats_record("image_unmount", NULL, 0);
+			}
+		}
+		if(fd >= 0)
+			close(fd);
+		free(ref_path);
+		free(mnt_path);
+	}
+	closedir(d);
+}
+
+static int imgfile_lock(const char* dir)
+{
+	char* path;
+	int fd;
+	if(asprintf(&path, "%s/%s", dir, IMGFILE_LOCK) == -1)
+		return(-1);
+	fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	free(path);
+	if(fd < 0)
+		return(-1);
+	if(flock(fd, LOCK_EX))
+	{
+		close(fd);
+		return(-1);
+	}
+	return(fd);
+}
+
+/**
+ * @return nonzero if path is a mount point (a different device than dir)
+ */
+static int imgfile_mounted(const char* dir, const char* path)
+{
+	struct stat dir_st, st;
+	if(stat(dir, &dir_st) || stat(path, &st))
+		return(0);
+	return(S_ISDIR(st.st_mode) && st.st_dev != dir_st.st_dev);
+}
+
+/**
+ * Loop mount img_fd read only on path
+ * @return 0 on success
+ */
+static int imgfile_mount(int img_fd, const char* image_path, const char* fstype,
+				const char* dir, const char* path)
+{
+	char dev[32];
+	int loop_fd, ret;
+	inception_span_t span;
+
+	//keep the node's image mounts from propagating into every namespace
+	if(make_private_dir(dir))
+		return(-1);
+	if(mkdir(path, 0755) && errno != EEXIST)
+		return(-1);
+	inception_span_begin(&span, "image_mount");
+	loop_fd = imgfile_loop(img_fd, image_path, dev, sizeof(dev));
+	if(loop_fd < 0)
+	{
+		elog("Unable to set up a loop device for %s: %s\n", image_path, strerror(errno));
+		return(-1);
+	}
+	ret = mount(dev, path, fstype, MS_RDONLY|MS_NOSUID|MS_NODEV, NULL);
+	if(ret)
+		elog("Unable to mount %s image %s: %s\n", fstype, image_path, strerror(errno));
+	//autoclear releases the device once the last mount of it is gone
+	close(loop_fd);
+	stats_record("image_mount", fstype, inception_span_end(&span, image_path));
+	return(ret);
+}
+
+int imgfile_in_use(const struct stat* st)
+{
+	char* ref_path;
+	int fd, ret = 0;
+	if(asprintf(&ref_path, "%s/%s/%016llx%s", INCEPTION_RUN_DIR, IMGFILE_SUBDIR,
+		(unsigned long long) imgfile_key(st), IMGFILE_REF) == -1)
+		return(1);
+	fd = open(ref_path, O_RDONLY|O_CLOEXEC);
+	free(ref_path);
+	if(fd < 0)
+		return(0);
+	if(flock(fd, LOCK_EX|LOCK_NB))
+		ret = 1;
+	close(fd);
+	return(ret);
+}
+
+int imgfile_attach_path(const char* image_path, const char* sha256, char** mount_path,
+			int* ref_fd_out)
+{
+	struct stat st;
+	char* dir = NULL;
+	char* path = NULL;
+	char* ref_path = NULL;
+	const char* fstype;
+	int img_fd, lock_fd = -1, ref_fd = -1, ret = -1;
+
+	img_fd = open(image_path, O_RDONLY|O_CLOEXEC);
+	if(img_fd < 0)
+		return(1);
+	if(fstat(img_fd, &st) || !S_ISREG(st.st_mode))
+	{
+		close(img_fd);
+		return(1);
+	}
+	//the kernel parses this file, so it has to be as trusted as the config
+	if((st.st_uid != 0 && st.st_uid != geteuid()) ||
+		(st.st_mode & (S_IWGRP|S_IWOTH)))
+	{
+		elog("Image file %s must be root owned and not group/world writable\n",
+			image_path);
+		close(img_fd);
+		return(-1);
+	}
+	fstype = imgfile_fstype(img_fd);
+	if(!fstype)
+	{
+		elog("Image file %s is not a squashfs or erofs image\n", image_path);
+		close(img_fd);
+		return(-1);
+	}
+	//from here on img_fd and st may be the node local copy, which was
+	//checked against sha256 when it was made; the original has to be
+	//checked every time
+	ret = stage_image(image_path, sha256, imgfile_key(&st), &img_fd, &st);
+	if(ret < 0 || (ret > 0 && sha256 && stage_verify(image_path, sha256, img_fd, st.st_size)))
+	{
+		close(img_fd);
+		return(-1);
+	}
+	ret = -1;
+	if(make_run_dir(IMGFILE_SUBDIR) ||
+		asprintf(&dir, "%s/%s", INCEPTION_RUN_DIR, IMGFILE_SUBDIR) == -1)
+	{
+		elog("Unable to use %s/%s\n", INCEPTION_RUN_DIR, IMGFILE_SUBDIR);
+		close(img_fd);
+		return(-1);
+	}
+	if(asprintf(&path, "%s/%016llx", dir, (unsigned long long) imgfile_key(&st)) == -1 ||
+		asprintf(&ref_path, "%s%s", path, IMGFILE_REF) == -1)
+		goto out;
+
+	lock_fd = imgfile_lock(dir);
+	if(lock_fd < 0)
+		goto out;
+	//left open across exec, it is this launch's reference to the mount
+	ref_fd = open(ref_path, O_RDONLY|O_CREAT, 0644);
+	if(ref_fd < 0 || flock(ref_fd, LOCK_SH))
+		goto out;
+	if(imgfile_mounted(dir, path))
+	{
+		stats_record("image_shared", NULL, 0);
+	}
+	else
+	{
+		if(imgfile_mount(img_fd, image_path, fstype, dir, path))
+			goto out;
+		//we are paying for a mount anyway, drop the ones nobody uses
+		imgfile_reap(dir);
+	}
+	*mount_path = path;
+	*ref_fd_out = ref_fd;
+	path = NULL;
+	ref_fd = -1;
+	ret = 0;
+out:
+	if(ref_fd >= 0)
+		close(ref_fd);
+	if(lock_fd >= 0)
+		close(lock_fd);
+	close(img_fd);
+	free(dir);
+	free(path);
+	free(ref_path);
+	return(ret);
+}
+
+int imgfile_attach(image_config_t* image)
+{
+	char* path;
+	int ret = imgfile_attach_path(image->imgroot, image->image_sha256, &path,
+					&image->image_ref_fd);
+	if(ret == 0)
+	{
+		image->image_file = image->imgroot;
+		image->imgroot = path;
+	}
+	return(ret);
+}
+
+void detach_image_file(image_config_t* image)
+{
+	char* dir;
+	size_t i;
+	int lock_fd, held = 0;
+
+	if(image->image_file && image->image_ref_fd >= 0)
+		held = 1;
+	for(i=0;image->layer_ref_fds && i<image->num_layers;i++)
+	{
+		if(image->layer_ref_fds[i] >= 0)
+			held = 1;
+	}
+	if(!held)
+		return;
+	if(asprintf(&dir, "%s/%s", INCEPTION_RUN_DIR, IMGFILE_SUBDIR) == -1)
+		return;
+	lock_fd = imgfile_lock(dir);
+	if(image->image_file && image->image_ref_fd >= 0)
+	{
+		close(image->image_ref_fd);
+		image->image_ref_fd = -1;
+	}
+	for(i=0;image->layer_ref_fds && i<image->num_layers;i++)
+	{
+		if(image->layer_ref_fds[i] >= 0)
+			close(image->layer_ref_fds[i]);
+		image->layer_ref_fds[i] = -1;
+	}
+	if(lock_fd >= 0)
+	{
+		imgfile_reap(dir);
+		close(lock_fd);
+	}
+	free(dir);
+}
@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
@@ -40,18 +41,21 @@
 #include <linux/sched.h>
 #include <sched.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/wait.h>
 #include <grp.h>
 #include <pwd.h>
-#include <libgen.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <jansson.h>
 #include "inception.h"
+#include "inception_private.h"
 
 static struct jump_table {
-void (*log_fun)(const char const * format, va_list ap);
+void (*log_fun)(const char * format, va_list ap);
 } jt;
 
 void __attribute__((constructor)) inception_init()
@@ -59,16 +63,31 @@ void __attribute__((constructor)) inception_init()
 	jt.log_fun = NULL;
 }
 
-void set_inception_log(void (*log_fun)(const char const * format, va_list ap))
+void set_inception_log(void (*log_fun)(const char * format, va_list ap))
 {
 	jt.log_fun = log_fun;
 }
 
-static void elog(const char const * format, ...)
+//set by the context API around calls made for one context, so threads
+//launching different contexts each log to their own caller
+static __thread const inception_logger_t* thread_log = NULL;
+
+const inception_logger_t* elog_thread(const inception_logger_t* logger)
+{
+	const inception_logger_t* prev = thread_log;
+	thread_log = logger;
+	return(prev);
+}
+
+void elog(const char * format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	if(!jt.log_fun)
+	if(thread_log && thread_log->fun)
+	{
+		(thread_log->fun)(thread_log->arg, format, args);
+	}
+	else if(!jt.log_fun)
 	{
 		vfprintf(stderr, format, args);
 	}
@@ -81,6 +100,8 @@ static void elog(const char const * format, ...)
 
 #define abort() exit(1) //otherwise we can leak ptys
 
+#define READ_CHUNK_SIZE 1024
+
 void drop_permissions(uid_t real_uid, gid_t real_gid, char* real_name)
 {
 	char* errcode = NULL;
@@ -112,11 +133,43 @@ void drop_permissions(uid_t real_uid, gid_t real_gid, char* real_name)
 	}
 }
 
+int drop_to_identity(const inception_identity_t* id)
+{
+	char* errcode = NULL;
+	uid_t euid = geteuid();
+
+	if(id->uid == 0)
+	    return(0);
+	if(id->uid == euid)
+	{
+		elog("euid == uid == %d\n", euid);
+		return(0);
+	}
+	if(setgid(id->gid) == -1)
+	{
+		errcode = strerror(errno);
+		elog("Error changing UID: %s\n", errcode);
+		return(-1);
+	}
+	if(setgroups(id->ngroups, id->groups) == -1)
+	{
+		errcode = strerror(errno);
+		elog("Error dropping supplementary groups: %s\n", errcode);
+		return(-1);
+	}
+	if(setuid(id->uid) == -1)
+	{
+		elog("Error changing GID\n");
+		return(-1);
+	}
+	return(0);
+}
+
 /**
  * Join Mount path to root path
  * @return ownership of cstring of joined string or NULL
  */
-const char const * join_mount_path(const char * const root, const char * const path)
+const char * join_mount_path(const char * const root, const char * const path)
 {
     char* dest;
 
@@ -126,34 +179,262 @@ const char const * join_mount_path(const char * const root, const char * const p
 	return dest;
 }
 
-void do_bind_mounts(image_config_t* image)
+int mount_is_bind(const char* type)
+{
+	return(!type || strcasecmp(type, "bind") == 0 || mount_is_recursive(type));
+}
+
+int mount_is_recursive(const char* type)
+{
+	return(type && strcasecmp(type, "rbind") == 0);
+}
+
+int mount_type_known(const char* type)
+{
+	return(mount_is_bind(type) || strcmp(type, "tmpfs") == 0 ||
+		strcmp(type, "hugetlbfs") == 0);
+}
+
+void free_ns_strings(ns_strings_t* s)
 {
 	size_t i;
-	int ret;
+	for(i=0;i<s->num_mounts;i++)
+	{
+		free(s->dest[i]);
+		free(s->data[i]);
+	}
+	free(s->dest);
+	free(s->data);
+	free(s->layer_opts);
+	free(s->upper);
+	free(s->upper_opts);
+	free(s->upper_dir);
+	free(s->work_dir);
+	memset(s, 0, sizeof(ns_strings_t));
+}
+
+/**
+ * Fill in s for image's layers
+ * @return 0 on success
+ */
+static int layer_strings(image_config_t* image, ns_strings_t* s)
+{
+	size_t opts_len, i;
+	FILE* opts_mem;
+
+	//a single layer without an upper is just bind mounted
+	if(!image->num_layers || (image->num_layers == 1 && !image->tmpfs_upper))
+		return(0);
+	if(image->tmpfs_upper)
+	{
+		//private to this namespace, so it goes away with the last process
+		if(asprintf(&s->upper, "%s/%s", INCEPTION_RUN_DIR, LAYERS_UPPER) == -1)
+		{
+			s->upper = NULL;
+			return(-1);
+		}
+		if(asprintf(&s->upper_opts, "mode=0755,size=%s", image->tmpfs_upper) == -1)
+		{
+			s->upper_opts = NULL;
+			return(-1);
+		}
+		s->upper_dir = (char*) join_mount_path(s->upper, "upper");
+		s->work_dir = (char*) join_mount_path(s->upper, "work");
+		if(!s->upper_dir || !s->work_dir)
+			return(-1);
+	}
+	opts_mem = open_memstream(&s->layer_opts, &opts_len);
+	if(!opts_mem)
+		return(-1);
+	//overlayfs wants the top layer first
+	fputs("lowerdir=", opts_mem);
+	for(i=image->num_layers;i>0;i--)
+		fprintf(opts_mem, "%s%s", image->layers[i-1], i > 1 ? ":" : "");
+	if(s->upper)
+		fprintf(opts_mem, ",upperdir=%s,workdir=%s", s->upper_dir, s->work_dir);
+	if(fclose(opts_mem) || !s->layer_opts)
+		return(-1);
+	return(0);
+}
+
+/**
+ * Options for a fresh tmpfs/hugetlbfs. They come from the (root owned) image
+ * config, and the mount is root's with mode 1777 like /tmp and /dev/shm
+ * unless they say otherwise (the kernel takes the last value).
+ * @return ownership of the options or NULL
+ */
+static char* typed_mount_data(image_config_t* image, size_t i)
+{
+	const char* options = image->mount_options ? image->mount_options[i] : NULL;
+	char* data;
+	if(asprintf(&data, "mode=1777,uid=0,gid=0%s%s", options ? "," : "", options ? options : "") == -1)
+		return(NULL);
+	return(data);
+}
+
+/**
+ * Fill in s for image's mounts
+ * @return 0 on success
+ */
+static int mount_strings(image_config_t* image, ns_strings_t* s)
+{
+	size_t i;
+	if(!image->num_mounts)
+		return(0);
+	s->dest = calloc(image->num_mounts, sizeof(char*));
+	s->data = calloc(image->num_mounts, sizeof(char*));
+	if(!s->dest || !s->data)
+		return(-1);
+	s->num_mounts = image->num_mounts;
 	for(i=0;i<image->num_mounts;i++)
 	{
 		//find target path in global namespace
-		const char* const dest = join_mount_path(image->imgroot, (image->mount_to)[i]);
-		if(!dest) abort();
+		s->dest[i] = (char*) join_mount_path(image->imgroot, (image->mount_to)[i]);
+		if(!s->dest[i])
+			return(-1);
+		if(!mount_is_bind(image->mount_type[i]))
+		{
+			s->data[i] = typed_mount_data(image, i);
+			if(!s->data[i])
+				return(-1);
+		}
+	}
+	return(0);
+}
+
+int make_ns_strings(image_config_t* image, ns_strings_t* s)
+{
+	memset(s, 0, sizeof(ns_strings_t));
+	if(layer_strings(image, s) || mount_strings(image, s))
+	{
+		free_ns_strings(s);
+		return(-1);
+	}
+	return(0);
+}
 
-		ret = mount((image->mount_from)[i],
-					 dest,
+static int ns_fail(ns_report_t* r, int step)
+{
+	r->step = step;
+	r->err = errno;
+	return(-1);
+}
+
+void log_ns_failure(image_config_t* image, const ns_strings_t* s,
+				const ns_report_t* r)
+{
+	const char* errcode = strerror(r->err);
+	switch(r->step) {
+		case NS_READY:
+			break;
+		case NS_UNSHARE:
+			elog("unshare: %s\n", errcode);
+			break;
+		case NS_ROOT_SLAVE:
+			elog("Error bind mouting /: %s\n", errcode);
+			break;
+		case NS_LAYERS:
+			elog("Unable to compose layers on %s: %s\n", image->imgroot, errcode);
+			break;
+		case NS_IMAGE_ROOT:
+			elog("Unable to bind image root %s: %s\n", image->imgroot, errcode);
+			break;
+		case NS_MOUNT:
+			elog("Mount Failed: %s, %s: %s\n", image->mount_from[r->mount],
+				s->dest[r->mount], errcode);
+			break;
+		case NS_PIVOT:
+			elog("Unable to pivot into image root %s: %s\n", image->imgroot, errcode);
+			break;
+		case NS_JOIN:
+			elog("Unable to join image namespace: %s\n", errcode);
+			break;
+		case NS_ROOT:
+			elog("Unable to enter image root %s: %s\n", image->imgroot, errcode);
+			break;
+		case NS_SETGID:
+			elog("Error changing UID: %s\n", errcode);
+			break;
+		case NS_SETGROUPS:
+			elog("Error dropping supplementary groups: %s\n", errcode);
+			break;
+		case NS_SETUID:
+			elog("Error changing GID\n");
+			break;
+	}
+}
+
+/**
+ * Compose image's layers on imgroot
+ * @return 0 on success
+ */
+static int compose_layers(image_config_t* image, const ns_strings_t* s)
+{
+	if(!s->layer_opts)
+		//nothing to overlay
+		return(mount(image->layers[0], image->imgroot, NULL, MS_BIND, NULL));
+	if(s->upper && (mount("tmpfs", s->upper, "tmpfs", MS_NOSUID|MS_NODEV, s->upper_opts) ||
+		mkdir(s->upper_dir, 0755) || mkdir(s->work_dir, 0755)))
+		return(-1);
+	return(mount("overlay", image->imgroot, "overlay", 0, s->layer_opts));
+}
+
+/**
+ * Mount image's mounts on the destinations in s. Nothing on a tmpfs/hugetlbfs
+ * may be setuid or a device.
+ * @return 0 on success, otherwise failed is the mount that did not work
+ */
+static int attach_mounts(image_config_t* image, const ns_strings_t* s, size_t* failed)
+{
+	size_t i;
+	int ret;
+	inception_span_t span;
+	for(i=0;i<image->num_mounts;i++)
+	{
+		inception_span_begin(&span, "mount");
+		if(!mount_is_bind(image->mount_type[i]))
+			ret = mount(image->mount_from[i], s->dest[i], image->mount_type[i],
+				MS_NOSUID|MS_NODEV, s->data[i]);
+		else
+			ret = mount((image->mount_from)[i],
+					 s->dest[i],
 					 "none",
-					 MS_MGC_VAL|MS_BIND|MS_PRIVATE,
+					 MS_MGC_VAL|MS_BIND|MS_PRIVATE|
+					 (mount_is_recursive(image->mount_type[i]) ? MS_REC : 0),
 					 NULL
 					);
 		if(ret < 0)
 		{
-			elog("Mount Failed: %s, %s",
-				  (image->mount_from[i]),
-				   dest
-				);
-			abort();
+			stats_record("mount_failed", NULL, 0);
+			*failed = i;
+			return(-1);
 		}
+		inception_span_end(&span, s->dest[i]);
+	}
+	return(0);
+}
 
-		free((char *)dest);
+void do_bind_mounts(image_config_t* image)
+{
+	if(bind_mounts(image))
+		abort();
+}
 
+int bind_mounts(image_config_t* image)
+{
+	ns_strings_t s;
+	ns_report_t r;
+	int ret;
+	if(make_ns_strings(image, &s))
+		return(-1);
+	ret = attach_mounts(image, &s, &r.mount);
+	if(ret)
+	{
+		ns_fail(&r, NS_MOUNT);
+		log_ns_failure(image, &s, &r);
 	}
+	free_ns_strings(&s);
+	return(ret);
 }
 
 int systemd_workaround(image_config_t* image)
@@ -165,39 +446,115 @@ int systemd_workaround(image_config_t* image)
 	ret = mount("/", "/", NULL, MS_SLAVE|MS_REC, NULL);
 	if(ret)
 	{
-		perror("Error bind mouting /: ");
+		elog("Error bind mouting /: %s\n", strerror(errno));
 		return(1);
 	}
 	return(0);
 }
 
+int mount_layers(image_config_t* image)
+{
+	ns_strings_t s;
+	int ret = -1;
+	inception_span_t span;
+
+	if(!image->num_layers)
+		return(0);
+	inception_span_begin(&span, "mount_layers");
+	if(make_ns_strings(image, &s) == 0)
+	{
+		ret = compose_layers(image, &s);
+		free_ns_strings(&s);
+	}
+	if(ret)
+		elog("Unable to compose layers on %s: %s\n", image->imgroot, strerror(errno));
+	inception_span_end(&span, image->imgroot);
+	return(ret);
+}
+
+/**
+ * Make imgroot the namespace's root and detach the host tree, leaving only
+ * the image and its own mounts in the mount table
+ * @return 0 on success
+ */
+static int pivot_image_root(image_config_t* image)
+{
+	inception_span_t span;
+	inception_span_begin(&span, "pivot_root");
+	//pivot_root(".", ".") stacks the old root on top of the new one, so
+	//unmounting "." is what drops it
+	if(chdir(image->imgroot) || syscall(SYS_pivot_root, ".", ".") ||
+		umount2(".", MNT_DETACH) || chdir("/"))
+		return(-1);
+	inception_span_end(&span, image->imgroot);
+	return(0);
+}
+
+/**
+ * Unshare a mount namespace and build image's tree in it from s. This only
+ * makes syscalls, so it is safe in a child forked from a threaded process;
+ * whoever made s logs the failure.
+ * @return 0 on success, otherwise r says which step failed and why
+ */
+static int build_namespace(image_config_t* image, const ns_strings_t* s, ns_report_t* r)
+{
+	int ret;
+	inception_span_t span;
+
+	memset(r, 0, sizeof(ns_report_t));
+	//flags |= CLONE_FILES | CLONE_FS | CLONE_NEWIPC;
+	//flags |= CLONE_NEWNS | CLONE_NEWPID;
+	//flags |= CLONE_NEWUTS //Do we want to mess with hostname?
+	inception_span_begin(&span, "unshare");
+	ret = unshare(CLONE_NEWNS | CLONE_FS);
+	inception_span_end(&span, NULL);
+	if(ret == -1)
+		return(ns_fail(r, NS_UNSHARE));
+	//systemd_workaround(), which would log
+	inception_span_begin(&span, "systemd_workaround");
+	ret = mount("/", "/", NULL, MS_SLAVE|MS_REC, NULL);
+	inception_span_end(&span, NULL);
+	if(ret)
+		return(ns_fail(r, NS_ROOT_SLAVE));
+	if(image->num_layers)
+	{
+		inception_span_begin(&span, "mount_layers");
+		ret = compose_layers(image, s);
+		inception_span_end(&span, image->imgroot);
+		if(ret)
+			return(ns_fail(r, NS_LAYERS));
+	}
+	//pivot_root() needs the new root to be a mount point, which a
+	//directory imgroot usually isn't
+	if(image->minimal_mounts && mount(image->imgroot, image->imgroot, NULL, MS_BIND, NULL))
+		return(ns_fail(r, NS_IMAGE_ROOT));
+	inception_span_begin(&span, "mount_tree");
+	if(do_bind_mounts_fd(image))
+	{
+		inception_span_end(&span, "fd engine unavailable");
+		stats_record("mount_fd_fallback", NULL, 0);
+		inception_span_begin(&span, "do_bind_mounts");
+		if(attach_mounts(image, s, &r->mount))
+			return(ns_fail(r, NS_MOUNT));
+	}
+	inception_span_end(&span, image->imgroot);
+	return(0);
+}
+
 void find_shell(image_config_t* image)
 {
-	//This ugly block of code due to the way posix getpwuid() and basename()
-	//handle memory
-	//
-	//** may fail if /etc/passwd doesn't exist in jail and jail has already been
-	//** entered
-	//
-	//
-	struct passwd* pw = NULL;
-	uid_t realuid = getuid();
-	pw = getpwuid(realuid);
-	if(!pw)
+	//the identity was resolved before the jail was entered, so this works
+	//even if /etc/passwd doesn't exist in the jail
+	inception_identity_t* user = image_identity(image);
+	if(!user)
 	{
 		elog("Error: You don't seem to exist\n");
 		abort();
 	}	
-	char* tmp;
-	char* alloced_tmp;
-	asprintf(&tmp, "%s", pw->pw_shell);
-	alloced_tmp = tmp;
-	char* shell = basename(tmp);
-	char* shell_cpy;
-	asprintf(&shell_cpy, "%s", shell);
-	free(alloced_tmp);
-	image->shell = shell_cpy;
-	int len = asprintf(&(image->shell_full_path), "%s", pw->pw_shell);
+	//not basename(), which may modify its argument or return static storage
+	const char* shell = strrchr(user->shell, '/');
+	asprintf(&(image->shell), "%s", shell ? shell + 1 : user->shell);
+	int len = asprintf(&(image->shell_full_path), "%s", user->shell);
 	if(len <= 0)
 	{
 		image->shell_full_path = NULL;
@@ -206,29 +563,218 @@ void find_shell(image_config_t* image)
 
 void setup_namespace(image_config_t* image)
 {
-	struct passwd* pw = NULL;
-	int flags = 0;
+	if(namespace_setup(image))
+		abort();
+}
+
+int namespace_setup(image_config_t* image)
+{
+	inception_identity_t* user = NULL;
+	ns_strings_t strings;
+	ns_report_t report;
 	int ret;
-	uid_t realuid = getuid();
-	gid_t realgid = getgid();
-	pw = getpwuid(realuid);
-	if(!pw)
+	inception_span_t span;
+	inception_span_t phase;
+	inception_span_begin(&phase, "setup_namespace");
+	user = image_identity(image);
+	if(!user)
 	{
 		elog("Error: You don't seem to exist\n");
-		abort();
+		return(INCEPTION_ERR_USER);
 	}
 
-	//flags |= CLONE_FILES | CLONE_FS | CLONE_NEWIPC;
-	//flags |= CLONE_NEWNS | CLONE_NEWPID;
-	flags = CLONE_NEWNS | CLONE_FS;
-	//flags |= CLONE_NEWUTS //Do we want to mess with hostname?
-	ret = unshare(flags);
-	if(ret == -1) perror("unshare: ");
-	systemd_workaround(image);
-	do_bind_mounts(image);
-	chdir(image->imgroot);
-	chroot(image->imgroot);
-	drop_permissions(realuid, realgid, pw->pw_name);
+	nscache_entry_t cached;
+	ret = 1;
+	if(image->ns_cache_ttl > 0)
+	{
+		inception_span_begin(&span, "nscache_enter");
+		ret = nscache_enter(image, &cached);
+		inception_span_end(&span, ret == 0 ? "hit" : "miss");
+		image->ns_joined = ret == 0;
+		stats_record(ret == 0 ? "nscache_hit" : "nscache_miss", NULL, 0);
+	}
+	if(ret != 0)
+	{
+		if(make_ns_strings(image, &strings))
+		{
+			elog("Unable to set up image namespace: %s\n", strerror(errno));
+			return(INCEPTION_ERR_NOMEM);
+		}
+		ret = build_namespace(image, &strings, &report);
+		if(ret)
+			log_ns_failure(image, &strings, &report);
+		free_ns_strings(&strings);
+		if(ret)
+			return(INCEPTION_ERR_NAMESPACE);
+		if(image->ns_cache_ttl > 0)
+		{
+			inception_span_begin(&span, "nscache_pin");
+			if(nscache_pin(&cached) < 0)
+				return(INCEPTION_ERR_NAMESPACE);
+			inception_span_end(&span, NULL);
+		}
+	}
+	if(image->recorder && recorder_mark(image->recorder, image->imgroot))
+		return(INCEPTION_ERR_NAMESPACE);
+	if(image->minimal_mounts)
+	{
+		//a cached namespace was pivoted when it was built and setns()
+		//already put us at its root
+		if(image->ns_joined ? chdir("/") : pivot_image_root(image))
+		{
+			elog("Unable to pivot into image root %s: %s\n", image->imgroot, strerror(errno));
+			return(INCEPTION_ERR_NAMESPACE);
+		}
+	}
+	else
+	{
+		inception_span_begin(&span, "chroot");
+		if(chdir(image->imgroot) || chroot(image->imgroot))
+		{
+			elog("Unable to enter image root %s: %s\n", image->imgroot, strerror(errno));
+			return(INCEPTION_ERR_NAMESPACE);
+		}
+		inception_span_end(&span, image->imgroot);
+	}
+	inception_span_begin(&span, "drop_permissions");
+	ret = drop_to_identity(user);
+	inception_span_end(&span, NULL);
+	if(ret)
+		return(INCEPTION_ERR_USER);
+	stats_record("launch", image->name, inception_span_end(&phase, image->name));
+	return(0);
+}
+
+int namespace_setup_forked(image_config_t* image, const ns_strings_t* s,
+				int ns_fd, ns_report_t* r)
+{
+	const inception_identity_t* user = image->user;
+
+	memset(r, 0, sizeof(ns_report_t));
+	if(ns_fd >= 0)
+	{
+		if(setns(ns_fd, CLONE_NEWNS))
+			return(ns_fail(r, NS_JOIN));
+	}
+	else if(build_namespace(image, s, r))
+		return(-1);
+	else if(image->minimal_mounts && pivot_image_root(image))
+		return(ns_fail(r, NS_PIVOT));
+	//a minimal namespace was pivoted into the image, we are there
+	if(image->minimal_mounts ? chdir("/") :
+		chdir(image->imgroot) || chroot(image->imgroot))
+		return(ns_fail(r, NS_ROOT));
+	//drop_to_identity(), which would log
+	if(user->uid == 0 || user->uid == geteuid())
+		return(0);
+	if(setgid(user->gid) == -1)
+		return(ns_fail(r, NS_SETGID));
+	if(setgroups(user->ngroups, user->groups) == -1)
+		return(ns_fail(r, NS_SETGROUPS));
+	if(setuid(user->uid) == -1)
+		return(ns_fail(r, NS_SETUID));
+	return(0);
+}
+
+int prepare_namespace(image_config_t* image)
+{
+	ns_strings_t strings;
+	ns_report_t report;
+	int ready[2];
+	int done[2];
+	char ns_path[64];
+	char c = 0;
+	int ns_fd = -1;
+	ssize_t len;
+	pid_t pid;
+
+	//slurmstepd has threads that may hold the malloc, stdio or syslog
+	//locks when we fork, so the child only makes syscalls: everything it
+	//needs is made here and it reports failures for us to log
+	if(make_ns_strings(image, &strings))
+	{
+		elog("Unable to set up image namespace: %s\n", strerror(errno));
+		return(-1);
+	}
+	//the first stats_record() maps the segment under a mutex
+	stats_enabled();
+	if(pipe(ready))
+	{
+		free_ns_strings(&strings);
+		return(-1);
+	}
+	if(pipe(done))
+	{
+		close(ready[0]);
+		close(ready[1]);
+		free_ns_strings(&strings);
+		return(-1);
+	}
+	pid = fork();
+	if(pid < 0)
+	{
+		elog("Unable to fork namespace builder: %s\n", strerror(errno));
+		close(ready[0]);
+		close(ready[1]);
+		close(done[0]);
+		close(done[1]);
+		free_ns_strings(&strings);
+		return(-1);
+	}
+	if(pid == 0)
+	{
+		close(ready[0]);
+		close(done[1]);
+		trace_after_fork();
+		if(build_namespace(image, &strings, &report) == 0 &&
+			image->minimal_mounts && pivot_image_root(image))
+			ns_fail(&report, NS_PIVOT);
+		write(ready[1], &report, sizeof(report));
+		//hold the namespace until the parent has its own reference
+		if(report.step == NS_READY)
+			read(done[0], &c, 1);
+		_exit(0);
+	}
+	close(ready[1]);
+	close(done[0]);
+	while((len = read(ready[0], &report, sizeof(report))) < 0 && errno == EINTR);
+	if(len != sizeof(report))
+		elog("Namespace builder for %s died\n", image->imgroot);
+	else if(report.step != NS_READY)
+		log_ns_failure(image, &strings, &report);
+	else
+	{
+		snprintf(ns_path, sizeof(ns_path), "/proc/%d/ns/mnt", pid);
+		ns_fd = open(ns_path, O_RDONLY|O_CLOEXEC);
+		if(ns_fd < 0)
+			elog("Unable to open image namespace: %s\n", strerror(errno));
+	}
+	close(done[1]);
+	close(ready[0]);
+	waitpid(pid, NULL, 0);
+	free_ns_strings(&strings);
+	return(ns_fd);
+}
+
+int enter_namespace(image_config_t* image, int ns_fd)
+{
+	inception_span_t span;
+	inception_span_begin(&span, "enter_namespace");
+	//setns() refuses to switch mount namespace with a shared fs struct
+	if(unshare(CLONE_FS) || setns(ns_fd, CLONE_NEWNS))
+	{
+		elog("Unable to join image namespace: %s\n", strerror(errno));
+		return(-1);
+	}
+	//a minimal namespace was pivoted into the image, setns() put us there
+	if(image->minimal_mounts ? chdir("/") :
+		chdir(image->imgroot) || chroot(image->imgroot))
+	{
+		elog("Unable to enter image root %s: %s\n", image->imgroot, strerror(errno));
+		return(-1);
+	}
+	stats_record("launch", image->name, inception_span_end(&span, image->name));
+	return(0);
 }
 
 static char check_dir(const char* path)
@@ -314,31 +860,177 @@ static bool check_path(const char* const src_path, const char* const dest_path)
 	return true;
 }
 
-int load_image(json_t* config_root, image_config_t* image)
+/**
+ * @return nonzero if name can be used in environment rules, patterns may end
+ * in '*'
+ */
+static int env_rule_name(const char* name, int pattern)
+{
+	const char* star;
+	if(!name || !*name || strpbrk(name, "=\n"))
+	{
+		elog("Error: Malformed environment variable name\n");
+		return(0);
+	}
+	star = strchr(name, '*');
+	if(star && (!pattern || star[1] != '\0'))
+	{
+		elog("Error: '*' is only allowed at the end of %s\n", name);
+		return(0);
+	}
+	return(1);
+}
+
+int image_from_json(json_t* config_root, image_config_t* image)
 {
 	if(!json_is_object(config_root))
 	{
 		elog("%s\n", "no configuration object found\n");
 		return(-2);
 	}
+	json_t* layer_list = json_object_get(config_root, "layers");
+	if(layer_list)
+	{
+		size_t layer_index;
+		json_t* layer;
+		if(!json_is_array(layer_list) || json_array_size(layer_list) == 0)
+		{
+			elog("Error: layers must be a non empty list\n");
+			return(-128);
+		}
+		image->layers = (char**) malloc(sizeof(char*)*json_array_size(layer_list));
+		json_array_foreach(layer_list, layer_index, layer)
+		{
+			//these end up in overlayfs' option string
+			const char* layer_s = json_string_value(layer);
+			if(!layer_s || strpbrk(layer_s, ":,\\"))
+			{
+				elog("Error: Malformed layer\n");
+				return(-128);
+			}
+			asprintf(&((image->layers)[layer_index]), "%s", layer_s);
+			image->num_layers = layer_index + 1;
+		}
+	}
+	const char* upper_s = json_string_value(json_object_get(config_root, "tmpfs_upper"));
+	if(upper_s)
+	{
+		if(!layer_list || strchr(upper_s, ','))
+		{
+			elog("Error: tmpfs_upper needs layers and a tmpfs size\n");
+			return(-128);
+		}
+		asprintf(&(image->tmpfs_upper), "%s", upper_s);
+	}
+	const char* sha256_s = json_string_value(json_object_get(config_root, "sha256"));
+	if(sha256_s)
+	{
+		size_t i;
+		if(strlen(sha256_s) != 64 || strspn(sha256_s, "0123456789abcdefABCDEF") != 64)
+		{
+			elog("Error: sha256 must be 64 hex digits\n");
+			return(-128);
+		}
+		asprintf(&(image->image_sha256), "%s", sha256_s);
+		for(i=0;i<64;i++)
+			image->image_sha256[i] = tolower((unsigned char) image->image_sha256[i]);
+	}
+	json_t* ld_cache = json_object_get(config_root, "ld_cache");
+	image->ld_cache_ref_fd = -1;
+	if(ld_cache)
+	{
+		json_t* ld_path = json_object_get(ld_cache, "path");
+		const char* ld_dir_s = json_string_value(json_object_get(ld_cache, "dir"));
+		size_t ld_index;
+		json_t* ld_entry;
+		if(!ld_dir_s || !json_is_array(ld_path))
+		{
+			elog("Error: ld_cache needs a dir and a path list\n");
+			return(-128);
+		}
+		asprintf(&(image->ld_cache_dir), "%s", ld_dir_s);
+		image->ld_cache_path = (char**) malloc(sizeof(char*)*(json_array_size(ld_path)+1));
+		json_array_foreach(ld_path, ld_index, ld_entry)
+		{
+			const char* ld_entry_s = json_string_value(ld_entry);
+			if(!ld_entry_s || strchr(ld_entry_s, ':'))
+			{
+				elog("Error: Malformed ld_cache path\n");
+				return(-128);
+			}
+			asprintf(&((image->ld_cache_path)[ld_index]), "%s", ld_entry_s);
+			image->num_ld_cache_path = ld_index + 1;
+		}
+	}
+	json_t* placement = json_object_get(config_root, "placement");
+	if(placement && placement_from_json(placement, image))
+		return(-128);
+	json_t* env_config = json_object_get(config_root, "environment");
+	if(env_config)
+	{
+		json_t* allow = json_object_get(env_config, "allow");
+		json_t* deny = json_object_get(env_config, "deny");
+		json_t* set = json_object_get(env_config, "set");
+		size_t env_index;
+		const char* env_key;
+		json_t* env_entry;
+		if((allow && !json_is_array(allow)) || (deny && !json_is_array(deny)) ||
+			(set && !json_is_object(set)))
+		{
+			elog("Error: Malformed environment rules\n");
+			return(-128);
+		}
+		image->env_rules = (char**) malloc(sizeof(char*)*(json_array_size(allow) +
+					json_array_size(deny) + json_object_size(set) + 1));
+		json_array_foreach(allow, env_index, env_entry)
+		{
+			if(!env_rule_name(json_string_value(env_entry), 1))
+				return(-128);
+			asprintf(&((image->env_rules)[image->num_env_rules++]), "+%s",
+				json_string_value(env_entry));
+		}
+		json_array_foreach(deny, env_index, env_entry)
+		{
+			if(!env_rule_name(json_string_value(env_entry), 1))
+				return(-128);
+			asprintf(&((image->env_rules)[image->num_env_rules++]), "-%s",
+				json_string_value(env_entry));
+		}
+		json_object_foreach(set, env_key, env_entry)
+		{
+			const char* value = json_string_value(env_entry);
+			if(!env_rule_name(env_key, 0) || !value || strchr(value, '\n'))
+			{
+				elog("Error: Malformed environment value for %s\n", env_key);
+				return(-128);
+			}
+			asprintf(&((image->env_rules)[image->num_env_rules++]), "%s=%s",
+				env_key, value);
+		}
+	}
 	json_t* imgroot = json_object_get(config_root, "imgroot");
-	if(!imgroot)
+	if(!imgroot && !layer_list)
 	{
 		elog("No valid image root entry found\n");
 		return(-4);
 	}
-	const char* imgroot_s = json_string_value(imgroot);
+	//layered images are composed on a scratch directory by default
+	const char* imgroot_s = imgroot ? json_string_value(imgroot) :
+		INCEPTION_RUN_DIR "/" LAYERS_ROOT;
 	if(!imgroot_s)
 	{
 		elog("No valid image root found\n");
 		return(-8);
 	}
-	if(!check_dir(imgroot_s))
-	{
-		elog("Image root not a directory: %s\n", imgroot_s);
-		return(-16);
-	}
 	asprintf(&(image->imgroot), "%s", imgroot_s);
+	const char* name_s = json_string_value(json_object_get(config_root, "name"));
+	if(name_s)
+		asprintf(&(image->name), "%s", name_s);
+	json_t* ns_cache_ttl = json_object_get(config_root, "namespace_cache_ttl");
+	if(json_is_integer(ns_cache_ttl) && json_integer_value(ns_cache_ttl) > 0)
+		image->ns_cache_ttl = json_integer_value(ns_cache_ttl);
+	if(json_is_true(json_object_get(config_root, "minimal_mounts")))
+		image->minimal_mounts = 1;
 	json_t* mount_list = json_object_get(config_root, "mounts");
 	if(!mount_list || !json_is_array(mount_list))
 	{
@@ -346,82 +1038,423 @@ int load_image(json_t* config_root, image_config_t* image)
 		return(-32);
 	}
 	int nmounts = json_array_size(mount_list);
-	image->num_mounts = nmounts;
+	image->num_mounts = 0;
 	image->mount_from = (char**) malloc(sizeof(char*)*nmounts);
 	image->mount_to = (char**) malloc(sizeof(char*)*nmounts);
 	image->mount_type = (char**) malloc(sizeof(char*)*nmounts);
+	image->mount_options = (char**) malloc(sizeof(char*)*nmounts);
 	size_t index;
 	json_t* mount_obj;
 	json_t* from;
 	json_t* to;
 	json_t* type;
+	json_t* options;
 	size_t i = 0;
 	json_array_foreach(mount_list, index, mount_obj)
 	{
+		const char* type_s = "bind";
 		from = NULL;
 		to = NULL;
 		from = json_object_get(mount_obj, "from");
 		to = json_object_get(mount_obj, "to");
 		type = json_object_get(mount_obj, "type");
-		if(from == NULL || to == NULL)
+		options = json_object_get(mount_obj, "options");
+		if(type && json_string_value(type))
+			type_s = json_string_value(type);
+		if(!mount_type_known(type_s))
 		{
-			elog("Error: Malformed Mount\n");
-			abort();
+			elog("Error: Unknown mount type %s\n", type_s);
+			return(-64);
 		}
-		asprintf(&((image->mount_from)[i]), "%s", json_string_value(from));
-		asprintf(&((image->mount_to)[i]), "%s", json_string_value(to));
-		if(type)
+		//tmpfs and hugetlbfs have nothing to mount from, "from" only
+		//names them in the mount table
+		if(!from && !mount_is_bind(type_s))
+			from = type;
+		if(from == NULL || to == NULL ||
+			!json_string_value(from) || !json_string_value(to) ||
+			(options && !json_string_value(options)))
 		{
-			asprintf(&((image->mount_type)[i]), "%s", json_string_value(type));
+			elog("Error: Malformed Mount\n");
+			return(-64);
 		}
-		else
+		if(options && mount_is_bind(type_s))
 		{
-			asprintf(&((image->mount_type)[i]), "bind");
+			elog("Error: mount options are only for tmpfs and hugetlbfs: %s\n",
+				json_string_value(to));
+			return(-64);
 		}
+		asprintf(&((image->mount_from)[i]), "%s", json_string_value(from));
+		asprintf(&((image->mount_to)[i]), "%s", json_string_value(to));
+		asprintf(&((image->mount_type)[i]), "%s", type_s);
+		(image->mount_options)[i] = NULL;
+		if(options)
+			asprintf(&((image->mount_options)[i]), "%s", json_string_value(options));
+		i++;
+		image->num_mounts = i;
+	}
+	return(0);
+}
 
-		const char * const mount_to = join_mount_path(image->imgroot, (image->mount_to)[i]);
-		if(!mount_to) abort();
+/**
+ * Attach layers that are image files and make sure the rest are directories
+ * @return 0 on success
+ */
+static int check_layers(image_config_t* image)
+{
+	size_t i;
+	char* path;
+	inception_span_t span;
+	if(!image->num_layers)
+		return(0);
+	if(make_run_dir(LAYERS_ROOT) || (image->tmpfs_upper && make_run_dir(LAYERS_UPPER)))
+	{
+		elog("Unable to use %s for layered images\n", INCEPTION_RUN_DIR);
+		return(-1);
+	}
+	if(!image->layer_ref_fds)
+	{
+		image->layer_ref_fds = (int*) malloc(sizeof(int)*image->num_layers);
+		if(!image->layer_ref_fds)
+			return(-1);
+		for(i=0;i<image->num_layers;i++)
+			image->layer_ref_fds[i] = -1;
+	}
+	for(i=0;i<image->num_layers;i++)
+	{
+		if(check_dir(image->layers[i]))
+			continue;
+		inception_span_begin(&span, "image_attach");
+		int attached = imgfile_attach_path(image->layers[i], NULL, &path,
+						&image->layer_ref_fds[i]);
+		inception_span_end(&span, image->layers[i]);
+		if(attached > 0)
+			elog("Layer not a directory or image file: %s\n", image->layers[i]);
+		if(attached)
+			return(-1);
+		free(image->layers[i]);
+		image->layers[i] = path;
+	}
+	return(0);
+}
+
+/**
+ * Where dest_path will come from once the layers are composed
+ * @return ownership of cstring of the path to check or NULL
+ */
+static const char* layer_mount_path(image_config_t* image, const char* dest_path)
+{
+	struct stat st;
+	size_t i;
+	for(i=image->num_layers;i>0;i--)
+	{
+		const char* path = join_mount_path(image->layers[i-1], dest_path);
+		if(!path || lstat(path, &st) == 0)
+			return(path);
+		free((char*) path);
+	}
+	return(join_mount_path(image->imgroot, dest_path));
+}
+
+int check_image(image_config_t* image)
+{
+	size_t i;
+	bool ret;
+	uint64_t check_key = 0;
+	int cached = -1;
+	inception_span_t span;
+	if(check_layers(image))
+		return(-16);
+	if(!check_dir(image->imgroot))
+	{
+		inception_span_begin(&span, "image_attach");
+		int attached = imgfile_attach(image);
+		inception_span_end(&span, image->imgroot);
+		if(attached > 0)
+			elog("Image root not a directory or image file: %s\n", image->imgroot);
+		if(attached)
+			return(-16);
+	}
+	else if(image->image_sha256)
+	{
+		elog("Error: sha256 is only for image files, %s is a directory\n", image->imgroot);
+		return(-16);
+	}
+	//adds a mount, so it has to come before the paths are checked
+	if(ldcache_attach(image))
+		return(-16);
+	//a hit brings back the planned mounts, so planning them (which costs
+	//stats of its own) is only paid on a miss, like the checks
+	inception_span_begin(&span, "check_cache");
+	cached = checkcache_lookup(image, &check_key);
+	inception_span_end(&span, cached == 0 ? "hit" : "miss");
+	if(cached == 0)
+		return(0);
+	if(plan_mounts(image))
+		return(INCEPTION_ERR_NOMEM);
+	for(i=0;i<image->num_mounts;i++)
+	{
+		const char * const mount_to = image->num_layers ?
+			layer_mount_path(image, (image->mount_to)[i]) :
+			join_mount_path(image->imgroot, (image->mount_to)[i]);
+		if(!mount_to)
+			return(INCEPTION_ERR_NOMEM);
+		inception_span_begin(&span, "check_path");
 #ifdef NCAR_UNSAFE
-		if(0) //disable sanity check to allow nested filesystems
+		ret = false; //disable sanity check to allow nested filesystems
 #else
-		if(check_path((image->mount_from)[i], mount_to ))
+		if(mount_is_bind((image->mount_type)[i]))
+			ret = check_path((image->mount_from)[i], mount_to);
+		else
+			ret = !check_dir(mount_to); //nothing to mount from
 #endif
+		inception_span_end(&span, mount_to);
+		if(ret)
 		{
-			if(strcasecmp(((image->mount_from)[i]), "none") == 0 && type)
-			{
-				//ignore this case for "special" filesystems
-			}
-			else
-			{
-				elog("Error: check paths: %s -> %s\n",
-					(image->mount_from)[i],
-					(image->mount_to)[i]);
-				abort();
-			}
+			stats_record("check_path_failed", NULL, 0);
+			elog("Error: check paths: %s -> %s\n",
+				(image->mount_from)[i],
+				(image->mount_to)[i]);
+			free((char*) mount_to);
+			return(-16);
 		}
 
 		free((char*) mount_to);
-		i++;
 	}
+	if(cached == 1)
+		checkcache_store(image, check_key);
 	return(0);
 }
 
-int parse_config(char* filename, char* key, image_config_t* imagestru)
+int load_image(json_t* config_root, image_config_t* image)
+{
+	int ret = image_from_json(config_root, image);
+	if(ret == -64 || ret == -128)
+		abort();
+	if(ret)
+		return(ret);
+	return(check_image(image));
+}
+
+/**
+ * load_image() for parse_config(), which reports malformed entries instead
+ * of exiting
+ * @return 0 or an INCEPTION_ERR_* code
+ */
+static int image_load(json_t* config_root, image_config_t* image)
 {
+	if(image_from_json(config_root, image))
+		return(INCEPTION_ERR_IMAGE);
+	return(check_image(image));
+}
+
+/**
+ * load_image() for plan_config(): plan the mounts, touch nothing else
+ * @return 0 or an INCEPTION_ERR_* code
+ */
+static int image_plan(json_t* config_root, image_config_t* image)
+{
+	if(image_from_json(config_root, image))
+		return(INCEPTION_ERR_IMAGE);
+	if(plan_mounts(image))
+		return(INCEPTION_ERR_NOMEM);
+	return(0);
+}
+
+void free_image_fields(image_config_t* image)
+{
+	size_t i;
+	for(i=0;i<image->num_mounts;i++)
+	{
+		free(image->mount_from[i]);
+		free(image->mount_to[i]);
+		free(image->mount_type[i]);
+		if(image->mount_options)
+			free(image->mount_options[i]);
+	}
+	free(image->mount_from);
+	free(image->mount_to);
+	free(image->mount_type);
+	free(image->mount_options);
+	free(image->imgroot);
+	free(image->name);
+	free(image->image_file);
+	for(i=0;i<image->num_layers;i++)
+		free(image->layers[i]);
+	free(image->layers);
+	free(image->layer_ref_fds);
+	free(image->tmpfs_upper);
+	free(image->image_sha256);
+	for(i=0;i<image->num_ld_cache_path;i++)
+		free(image->ld_cache_path[i]);
+	free(image->ld_cache_path);
+	free(image->ld_cache_dir);
+	for(i=0;i<image->num_env_rules;i++)
+		free(image->env_rules[i]);
+	free(image->env_rules);
+	free_env_filter(image);
+	free(image->mempolicy);
+	free(image->mem_nodes);
+	for(i=0;i<image->num_cpu_map;i++)
+		free(image->cpu_map[i]);
+	free(image->cpu_map);
+	free(image->thp);
+	free(image->shell);
+	free(image->shell_full_path);
+	free(image->ns_scope);
+	if(image->user)
+	{
+		free_identity(image->user);
+		free(image->user);
+	}
+	image->user = NULL;
+	image->ns_scope = NULL;
+	image->shell = NULL;
+	image->shell_full_path = NULL;
+	image->mount_from = NULL;
+	image->mount_to = NULL;
+	image->mount_type = NULL;
+	image->mount_options = NULL;
+	image->imgroot = NULL;
+	image->name = NULL;
+	image->image_file = NULL;
+	image->layers = NULL;
+	image->layer_ref_fds = NULL;
+	image->tmpfs_upper = NULL;
+	image->image_sha256 = NULL;
+	image->ld_cache_path = NULL;
+	image->ld_cache_dir = NULL;
+	image->num_ld_cache_path = 0;
+	image->env_rules = NULL;
+	image->num_env_rules = 0;
+	image->mempolicy = NULL;
+	image->mem_nodes = NULL;
+	image->cpu_map = NULL;
+	image->num_cpu_map = 0;
+	image->thp = NULL;
+	image->num_layers = 0;
+	image->num_mounts = 0;
+}
+
+static uint64_t hash_str(uint64_t hash, const char* str)
+{
+	//hash the terminator too so ("ab","c") != ("a","bc")
+	const char* c = str ? str : "";
+	do
+	{
+		hash ^= (unsigned char) *c;
+		hash *= 1099511628211ull;
+	} while(*c++);
+	return(hash);
+}
+
+uint64_t image_hash(const image_config_t* image)
+{
+	uint64_t hash = 14695981039346656037ull;
+	size_t i;
+	hash = hash_str(hash, image->name);
+	hash = hash_str(hash, image->imgroot);
+	for(i=0;i<image->num_mounts;i++)
+	{
+		hash = hash_str(hash, image->mount_from[i]);
+		hash = hash_str(hash, image->mount_to[i]);
+		hash = hash_str(hash, image->mount_type[i]);
+		if(image->mount_options && image->mount_options[i])
+			hash = hash_str(hash, image->mount_options[i]);
+	}
+	for(i=0;i<image->num_layers;i++)
+		hash = hash_str(hash, image->layers[i]);
+	hash = hash_str(hash, image->tmpfs_upper);
+	if(image->minimal_mounts)
+		hash = hash_str(hash, "minimal_mounts");
+	return(hash);
+}
+
+int make_run_dir(const char* subdir)
+{
+	char* path = NULL;
+	struct stat st;
+	int ret = 0;
+	if(mkdir(INCEPTION_RUN_DIR, 0755) && errno != EEXIST)
+		return(-1);
+	if(!subdir)
+		path = strdup(INCEPTION_RUN_DIR);
+	else if(asprintf(&path, "%s/%s", INCEPTION_RUN_DIR, subdir) == -1)
+		return(-1);
+	if(!path)
+		return(-1);
+	if(subdir && mkdir(path, 0755) && errno != EEXIST)
+		ret = -1;
+	//everything under here is trusted by the setuid binary, so refuse
+	//anything a user could have planted
+	else if(lstat(path, &st) || !S_ISDIR(st.st_mode) ||
+		(st.st_uid != 0 && st.st_uid != geteuid()) ||
+		(st.st_mode & (S_IWGRP|S_IWOTH)))
+		ret = -1;
+	free(path);
+	return(ret);
+}
+
+int make_private_dir(const char* dir)
+{
+	if(mount(NULL, dir, NULL, MS_PRIVATE, NULL) == 0)
+		return(0);
+	if(errno != EINVAL)
+		return(-1);
+	if(mount(dir, dir, NULL, MS_BIND|MS_REC, NULL))
+		return(-1);
+	return(mount(NULL, dir, NULL, MS_PRIVATE, NULL));
+}
+
+/**
+ * Find image key (the first image if NULL) in the json config filename and
+ * hand it to load
+ * @return 0 or an INCEPTION_ERR_* code
+ */
+static int config_find(char* filename, char* key, image_config_t* imagestru,
+			int (*load)(json_t*, image_config_t*))
+{
+	inception_span_t span;
+	int ret = 0;
 	FILE* config_fd = fopen(filename, "r");
+	if(!config_fd)
+	{
+		elog("Unable to open config %s: %s\n", filename, strerror(errno));
+		return(INCEPTION_ERR_CONFIG);
+	}
+	inception_span_begin(&span, "config_read");
+	size_t config_len = 0;
+	char* config_buf = NULL;
+	FILE* config_mem = open_memstream(&config_buf, &config_len);
+	char chunk[READ_CHUNK_SIZE*64];
+	size_t br;
+	while(config_mem && (br = fread(chunk, 1, sizeof(chunk), config_fd)) > 0)
+		fwrite(chunk, 1, br, config_mem);
+	if(config_mem)
+		fclose(config_mem);
+	inception_span_end(&span, filename);
+	if(!config_buf)
+	{
+		elog("Unable to read config %s\n", filename);
+		fclose(config_fd);
+		return(INCEPTION_ERR_CONFIG);
+	}
 	json_error_t json_err;
-	json_t* config_root = json_loadf(config_fd, 0, &json_err);
-	int ret = 0;
+	inception_span_begin(&span, "json_parse");
+	json_t* config_root = json_loadb(config_buf, config_len, 0, &json_err);
+	inception_span_end(&span, filename);
+	free(config_buf);
 	if(!config_root)
 	{
 		elog("%s\n", json_err.text);
-		return(-1);
+		fclose(config_fd);
+		return(INCEPTION_ERR_CONFIG);
 	}
 	json_t* image_list = json_object_get(config_root, "images");
 	if(!json_is_array(image_list))
 	{
 		elog("Config Parse Error: Image List not found\n");
-		return(-1);
+		ret = INCEPTION_ERR_CONFIG;
+		goto cleanup;
 	}
 	json_t* image;
 	json_t* image_name;
@@ -433,150 +1466,206 @@ int parse_config(char* filename, char* key, image_config_t* imagestru)
 		if(!image_name)
 		{
 			elog("Config Parse Erorr: Image without a name found\n");
-			return(-1);
+			ret = INCEPTION_ERR_CONFIG;
+			goto cleanup;
 		}
 		image_name_str = json_string_value(image_name);
 		if(!image_name_str)
 		{
 			elog("Config Parse Error: Image name is invalid\n");
-			return(-1);
-		}
-		if(!key)
-		{
-			load_image(image, imagestru);
+			ret = INCEPTION_ERR_CONFIG;
 			goto cleanup;
 		}
-		if(strcasecmp(image_name_str, key) == 0)
+		if(!key || strcasecmp(image_name_str, key) == 0)
 		{
-			ret = load_image(image, imagestru);
-			goto cleanup; //TODO: would break work here?
+			ret = load(image, imagestru);
+			goto cleanup;
 		}
 	}
 	elog("Error: Image not found\n");
-	abort();
-	return(-1);
+	ret = INCEPTION_ERR_NOT_FOUND;
 cleanup:
 	json_decref(config_root);
 	fclose(config_fd);
 	return(ret);
 }
 
+int parse_config(char* filename, char* key, image_config_t* imagestru)
+{
+	inception_span_t span;
+	inception_span_begin(&span, "catalog_lookup");
+	int ret = catalog_find_image(filename, key, imagestru);
+	inception_span_end(&span, key);
+	stats_record(ret == CATALOG_UNAVAILABLE ? "catalog_miss" : "catalog_hit", NULL, 0);
+	if(ret == 0)
+		return(check_image(imagestru));
+	if(ret == CATALOG_NOT_FOUND)
+	{
+		elog("Error: Image not found\n");
+		return(INCEPTION_ERR_NOT_FOUND);
+	}
+	//no usable catalog, fall back to reading the json directly
+	return(config_find(filename, key, imagestru, image_load));
+}
+
+int plan_config(char* filename, char* key, image_config_t* imagestru)
+{
+	//the catalog would be built on a miss, so read the json
+	return(config_find(filename, key, imagestru, image_plan));
+}
+
+static int cmp_image_name(const void* a, const void* b)
+{
+	return(strcmp(*(const char* const*) a, *(const char* const*) b));
+}
+
+int inception_forget_config(const char* filename)
+{
+	json_error_t json_err;
+	json_t* config_root = json_load_file(filename, 0, &json_err);
+	json_t* image_list;
+	json_t* image;
+	const char** names;
+	size_t index, n = 0;
+
+	if(!config_root)
+		return(INCEPTION_ERR_CONFIG);
+	image_list = json_object_get(config_root, "images");
+	names = (const char**) malloc(sizeof(char*)*(json_array_size(image_list) + 1));
+	if(names)
+	{
+		json_array_foreach(image_list, index, image)
+		{
+			const char* name = json_string_value(json_object_get(image, "name"));
+			if(name)
+				names[n++] = name;
+		}
+		qsort(names, n, sizeof(char*), cmp_image_name);
+		checkcache_remove(names, n);
+		free(names);
+	}
+	catalog_remove(filename);
+	json_decref(config_root);
+	return(0);
+}
+
 
-void build_default_environ(image_config_t* image)
+int build_default_environ(image_config_t* image)
 {
 	//POSIX says that there should be a little default environment
 	//provided by login(1).. fake that
-	char** env = (char**) malloc(sizeof(char*)*4);
-	env[3] = NULL;
+	inception_identity_t* user = image_identity(image);
+	char** env;
 
-	struct passwd* pw = NULL;
-	uid_t realuid = getuid();
-	pw = getpwuid(realuid);
-	if(!pw)
+	if(!user)
 	{
 		elog("Error: You don't seem to exist\n");
-		abort();
-	}	
-	if(pw->pw_dir)
-	{
-		asprintf(&(env[0]), "HOME=%s", pw->pw_dir);
+		return(INCEPTION_ERR_USER);
 	}
-	else
+	if(!*user->name)
 	{
-		asprintf(&(env[0]), "HOME=/");
-	}
-	asprintf(&(env[1]), "PATH=/usr/bin:/bin");
-	if(pw->pw_name)
-	{
-		asprintf(&(env[2]), "LOGNAME=%s", pw->pw_name);
+		elog("You don't seem to have a user name.. odd\n");
+		return(INCEPTION_ERR_USER);
 	}
+	env = (char**) calloc(4, sizeof(char*));
+	if(!env)
+		return(INCEPTION_ERR_NOMEM);
+	if(asprintf(&(env[0]), "HOME=%s", user->home) == -1)
+		env[0] = NULL;
+	else if(asprintf(&(env[2]), "LOGNAME=%s", user->name) == -1)
+		env[2] = NULL;
 	else
+		env[1] = strdup("PATH=/usr/bin:/bin");
+	if(!env[0] || !env[1] || !env[2])
 	{
-		env[2] = NULL;
-		elog("You don't seem to have a user name.. odd");
-		abort();
+		free(env[0]);
+		free(env[1]);
+		free(env[2]);
+		free(env);
+		return(INCEPTION_ERR_NOMEM);
 	}
 	image->environ = env;
+	return(0);
 }
-#define READ_CHUNK_SIZE 1024
+
 char** load_insecure_environ(pid_t pid)
 {
+	inception_span_t span;
 	char* env_path;
-	asprintf(&env_path, "/proc/%d/environ", pid);
-	int env_fd = open(env_path, O_RDONLY);
+	char* buf = NULL;
+	char** env = NULL;
+	size_t len = 0, cap = READ_CHUNK_SIZE*64, vars = 0, i;
+	ssize_t br;
+	int env_fd;
+
+	inception_span_begin(&span, "load_insecure_environ");
+	if(asprintf(&env_path, "/proc/%d/environ", (int) pid) == -1)
+		return(NULL);
+	env_fd = open(env_path, O_RDONLY|O_CLOEXEC);
+	free(env_path);
 	if(env_fd < 0)
 	{
-		elog("Error loading environment\n");
-		abort();
+		elog("Error loading environment: %s\n", strerror(errno));
+		return(NULL);
 	}
-	char* procenviron = (char*) malloc(sizeof(char)*READ_CHUNK_SIZE);
-	memset(procenviron, 0, sizeof(char)*READ_CHUNK_SIZE);
-
-	size_t br = 0;
-	size_t offset = 0;
-	size_t i;
-	size_t vars = 0;
-	char** environ = NULL;
-	size_t read_size = READ_CHUNK_SIZE;
-	while(1)
+	//one buffer, doubled as needed, that the variables are split out of
+	//in place
+	for(;;)
 	{
-		br = read(env_fd, procenviron+offset, read_size);
-		if(br <= 0)
+		if(!buf || cap - len < READ_CHUNK_SIZE)
 		{
-			br += offset;
-			break;
+			char* grown;
+			if(buf)
+				cap *= 2;
+			grown = (char*) realloc(buf, cap + 1);
+			if(!grown)
+				goto fail;
+			buf = grown;
 		}
-		if(br < READ_CHUNK_SIZE)
-		{
-			offset += br;
-			read_size = read_size - br;
-			if(read_size <= 0)
-			{
-				procenviron = realloc(procenviron, offset + READ_CHUNK_SIZE);
-				read_size = READ_CHUNK_SIZE;
-			}
+		br = read(env_fd, buf + len, cap - len);
+		if(br < 0 && errno == EINTR)
 			continue;
-		}
-		if(br == READ_CHUNK_SIZE)
-		{
-			offset += READ_CHUNK_SIZE;
-			procenviron = realloc(procenviron, offset + READ_CHUNK_SIZE);
-			memset(procenviron+offset, 0, sizeof(char)*READ_CHUNK_SIZE);
-			continue;
-		}
-
-		elog("BUG\n");
-		abort();
-	}
-	for(i=0;i<br;i++)
-	{
-		//find null delimited vars, ignore leading/trailing nulls
-		//TODO: should we also check for invalid entries?
-		if(
-			procenviron[i] == '\0' &&
-			(i == 0 || procenviron[i-1] != '\0') &&
-			(i < br-1 && procenviron[i+1] != '\0')
-		)
-		{
-			vars++;
-		}
-	}
-	environ = (char**) malloc(sizeof(char*)*(vars+1));
-	memset(environ, 0, sizeof(char*)*(vars+1));
-	offset = 0;
-	for(i=0;i<vars;i++)
-	{
-		//TODO: this is easy, but is it safe?
-		br = asprintf(&(environ[i]), "%s", procenviron+offset);
 		if(br < 0)
 		{
-			elog("Error writing environment (no memory?)\n");
-			abort();
+			elog("Error loading environment: %s\n", strerror(errno));
+			goto fail;
 		}
-		offset = offset + br + 1; //skip the null
+		if(br == 0)
+			break;
+		len += br;
 	}
 	close(env_fd);
-	free(env_path);
-	free(procenviron);
-	return(environ);
+	env_fd = -1;
+	buf[len] = '\0';
+	for(i=0;i<len;i+=strlen(buf + i)+1)
+		if(buf[i])
+			vars++;
+	//the slot after the terminating NULL keeps the buffer for
+	//free_insecure_environ()
+	env = (char**) malloc(sizeof(char*)*(vars+2));
+	if(!env)
+		goto fail;
+	for(i=0, vars=0;i<len;i+=strlen(buf + i)+1)
+		if(buf[i])
+			env[vars++] = buf + i;
+	env[vars] = NULL;
+	env[vars+1] = buf;
+	inception_span_end(&span, NULL);
+	return(env);
+fail:
+	if(env_fd >= 0)
+		close(env_fd);
+	free(buf);
+	inception_span_end(&span, NULL);
+	return(NULL);
+}
+
+void free_insecure_environ(char** env)
+{
+	char** e;
+	if(!env)
+		return;
+	for(e=env;*e;e++);
+	free(e[1]);
+	free(env);
 }
@@ -1,6 +1,9 @@
 #ifndef __INCEPTION_H__
 #define __INCEPTION_H__
 
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 #include <jansson.h>
@@ -9,36 +12,462 @@
 #define INCEPTION_CONFIG_PATH "./inception.json"
 #endif
 
+/*
+ * Errors returned by parse_config(), check_image() and the context API
+ */
+#define INCEPTION_ERR_CONFIG -2 //config file can't be read or parsed
+#define INCEPTION_ERR_NOT_FOUND -4 //no image with that name
+#define INCEPTION_ERR_IMAGE -8 //malformed image entry
+#define INCEPTION_ERR_CHECK -16 //image root or a mount failed the checks
+#define INCEPTION_ERR_USER -32 //unknown user or unable to become them
+#define INCEPTION_ERR_NAMESPACE -64 //unable to build or enter the namespace
+#define INCEPTION_ERR_NOMEM -128
+
+/**
+ * Who is launching, looked up once per launch before entering the image
+ */
+typedef struct inception_identity
+{
+	uid_t uid;
+	gid_t gid;
+	char* name;
+	char* home;
+	char* shell;
+	int ngroups;
+	gid_t* groups; //supplementary groups as initgroups() would set them
+} inception_identity_t;
+
+/*
+ * What plan_mounts() did to an image's mount list, for inception -d
+ */
+typedef struct inception_plan
+{
+	size_t mounts_in; //mounts as configured
+	size_t normalized; //mounts whose paths were rewritten
+	size_t shadowed; //dropped, hidden by a later mount
+	size_t covered; //dropped, already shown by a parent bind
+	size_t merged; //dropped, brought along by an rbind of their parent
+	size_t stats_in; //stats a check cache miss costs without planning
+	size_t stats_out; //stats a check cache miss costs after planning
+	size_t plan_stats; //stats (and realpath() lookups) planning itself made
+	size_t mountinfo_entries; //host mount table entries planning read
+	int cached; //the plan (and these counts) came from the check cache
+} inception_plan_t;
+
 typedef struct image_config
 {
 	size_t num_mounts;
 	char** mount_from;
 	char** mount_to;
-	char** mount_type;
+	char** mount_type; //"bind", "rbind", "tmpfs" or "hugetlbfs"
+	char** mount_options; //tmpfs/hugetlbfs mount options, or NULL
 	char* imgroot;
-	char* usercmd;
+	char* usercmd; //run with the user's shell -c
+	char** argv; //run directly with execvpe() (not owned), or NULL
 	char* shell_full_path;
 	char* shell;
 	char** environ;
 	char* cwd;
+	char* name;
+	int ns_cache_ttl; //seconds a prepared namespace is kept idle, 0 disables
+	int minimal_mounts; //pivot_root() into imgroot, keeping only the image's mounts
+	char* image_file; //squashfs/erofs file imgroot is mounted from, or NULL
+	int image_ref_fd; //our reference to the node's mount of image_file
+	size_t num_layers;
+	char** layers; //overlay lower layers, base first, composed on imgroot
+	int* layer_ref_fds; //references to layers that are image files, or -1
+	char* tmpfs_upper; //size of a writable tmpfs layer on top, or NULL
+	char* image_sha256; //expected digest of the imgroot image file, or NULL
+	char* ld_cache_dir; //where the flattened library directory is mounted
+	size_t num_ld_cache_path;
+	char** ld_cache_path; //library directories flattened into ld_cache_dir
+	int ld_cache_ref_fd; //our reference to the ld_cache_dir cache, or -1
+	size_t num_env_rules;
+	char** env_rules; //"+NAME" allow, "-NAME" deny or "NAME=value" set
+	struct inception_env_filter* env_filter; //env_rules compiled, see env.c
+	char* mempolicy; //"interleave", "preferred", "bind", "local" or NULL
+	char* mem_nodes; //NUMA nodes for mempolicy, e.g. "0-1"
+	size_t num_cpu_map;
+	char** cpu_map; //cpu list per local task id, or just "auto"
+	char* thp; //"never", "madvise", "default" or NULL
+	inception_identity_t* user; //resolved on first use, see identity.c
+	struct inception_recorder* recorder; //file access recorder, or NULL
+	char* ns_scope; //cached namespace shared by ns_uid's launches in this scope
+	uid_t ns_uid;
+	int ns_joined; //setup_namespace() joined a cached namespace
+	inception_plan_t plan; //filled by check_image()
 } image_config_t;
 
 void drop_permissions(uid_t real_uid, gid_t real_gid, char* real_name);
 
+/**
+ * drop_permissions() with the supplementary groups already resolved, so it
+ * needs no NSS lookup (and works after the chroot)
+ * @return 0 on success
+ */
+int drop_to_identity(const inception_identity_t* id);
+
+/**
+ * Look up uid's name, home, shell and groups (gid is the primary group)
+ * @return 0 on success, -1 if the user does not exist or on error
+ */
+int resolve_identity(uid_t uid, gid_t gid, inception_identity_t* id);
+
+void free_identity(inception_identity_t* id);
+
+/**
+ * The launching user's identity, resolved on the first call
+ * @return NULL if the user does not exist
+ */
+inception_identity_t* image_identity(image_config_t* image);
+
 void do_bind_mounts(image_config_t* image);
 
+/**
+ * Build the image tree detached with the fd based mount api and attach it
+ * over imgroot in one step
+ * @return 0 on success, nonzero if the caller should use do_bind_mounts()
+ */
+int do_bind_mounts_fd(image_config_t* image);
+
 int systemd_workaround(image_config_t* image);
 
 void find_shell(image_config_t* image);
 
 void setup_namespace(image_config_t* image);
 
+/**
+ * Build image's mount namespace in a helper child, leaving the caller (which
+ * may be multithreaded) where it is
+ * @return O_CLOEXEC fd referring to the new namespace or -1
+ */
+int prepare_namespace(image_config_t* image);
+
+/**
+ * Join a namespace from prepare_namespace() and chroot into the image
+ * @return 0 on success
+ */
+int enter_namespace(image_config_t* image, int ns_fd);
+
 int load_image(json_t* config_root, image_config_t* image);
 
+/**
+ * @return 0 or INCEPTION_ERR_CHECK
+ */
+int check_image(image_config_t* image);
+
+/**
+ * Drop this process's reference to a single file image mounted by
+ * check_image() (imgroot or layers), unmounting it if nobody else on the
+ * node uses it
+ */
+void detach_image_file(image_config_t* image);
+
+/**
+ * Overlay a layered image's layers on imgroot (nothing for plain images),
+ * must run inside the image's mount namespace before the bind mounts
+ * @return 0 on success
+ */
+int mount_layers(image_config_t* image);
+
+/*
+ * Flattened library directories, see ldcache.c
+ */
+
+/**
+ * Rewrite an LD_LIBRARY_PATH value for image, replacing the directories
+ * flattened into the image's library cache with the cache itself when that
+ * keeps the search order: all of them have to be there, consecutive and in
+ * the order the cache was built in
+ * @return ownership of the new value, or NULL if it doesn't change
+ */
+char* ld_cache_library_path(image_config_t* image, const char* ld_library_path);
+
+/**
+ * ld_cache_library_path() applied to LD_LIBRARY_PATH in image->environ
+ */
+void ld_cache_environ(image_config_t* image);
+
+/**
+ * Remove library caches built for older versions of image that no running
+ * launch uses
+ * @return number of caches removed, negative on error
+ */
+int ld_cache_prune(image_config_t* image);
+
+/**
+ * Drop this process's reference to image's library cache (launched
+ * processes keep theirs)
+ */
+void ld_cache_detach(image_config_t* image);
+
+/**
+ * Load image key (the first image if NULL) from filename and check it
+ * @return 0 or an INCEPTION_ERR_* code
+ */
 int parse_config(char* filename, char* key, image_config_t* imagestru);
 
-void build_default_environ(image_config_t* image);
+/**
+ * Free what parse_config() (or plan_config()) allocated in image, leaving
+ * it ready to load again
+ */
+void free_image_fields(image_config_t* image);
+
+/**
+ * Load image key like parse_config() and plan its mounts (image->plan)
+ * without changing anything on the node: no catalog is built, image files
+ * and library caches are not attached, nothing is checked or cached
+ * @return 0 or an INCEPTION_ERR_* code
+ */
+int plan_config(char* filename, char* key, image_config_t* imagestru);
+
+/**
+ * Remove what loading filename's images left in INCEPTION_RUN_DIR: the
+ * config's catalog and its images' check cache entries. For tools that load
+ * throwaway configs; a later load just rebuilds them.
+ * @return 0 or INCEPTION_ERR_CONFIG if filename can't be read
+ */
+int inception_forget_config(const char* filename);
+
+/**
+ * Give image the little environment login(1) would: HOME, PATH and LOGNAME
+ * @return 0, INCEPTION_ERR_USER if the user can't be resolved or has no
+ * name, or INCEPTION_ERR_NOMEM
+ */
+int build_default_environ(image_config_t* image);
 
+/**
+ * Read pid's environment as the kernel has it (for a setuid process, before
+ * glibc removed the unsafe variables)
+ * @return NULL terminated array, free with free_insecure_environ(), or NULL
+ * on error
+ */
 char** load_insecure_environ(pid_t pid);
 
+void free_insecure_environ(char** env);
+
+/**
+ * Apply image's placement (memory policy, cpu affinity, transparent
+ * hugepages) to the calling process, to be inherited by what it execs
+ * @param local_task this task's index among the tasks of the job on this
+ * node, or -1 if unknown (then only single entry cpu maps apply)
+ * @param local_tasks number of tasks of the job on this node, or 0
+ * @return 0, or -1 if some of it couldn't be applied (the rest is)
+ */
+int apply_placement(image_config_t* image, int local_task, int local_tasks);
+
+/*
+ * Launch environment, see env.c
+ */
+
+/**
+ * Apply image's environment rules to env
+ * @return NULL terminated array of pointers into env and image (nothing is
+ * copied, free only the array), NULL if out of memory
+ */
+char** filter_environ(image_config_t* image, char** env);
+
+/**
+ * @return nonzero if the variable entry ("NAME=value") passes image's rules
+ * unchanged
+ */
+int environ_keeps(image_config_t* image, const char* entry);
+
+/**
+ * Apply image's environment rules to an environment that can only be edited
+ * in place (PAM, SPANK): unset_var() is called with the name of every
+ * variable to drop and set_var() with every "NAME=value" to add
+ * @return 0, or -1 if a callback failed
+ */
+int apply_environ(image_config_t* image, char** env,
+		int (*unset_var)(void* ctx, const char* name),
+		int (*set_var)(void* ctx, const char* entry), void* ctx);
+
+/*
+ * Context API, see context.c
+ *
+ * For processes that outlive a launch (PAM, SPANK): nothing in here exits
+ * the process, failures come back as INCEPTION_ERR_* codes. Different
+ * contexts can be used from different threads at once, one context must
+ * not be used by two threads at a time.
+ */
+typedef struct inception_ctx inception_ctx_t;
+
+typedef void (*inception_log_fun_t)(void* arg, const char* format, va_list ap);
+
+/**
+ * @param config_path json config to load images from, NULL for
+ * INCEPTION_CONFIG_PATH
+ * @return new context or NULL if out of memory
+ */
+inception_ctx_t* inception_create(const char* config_path);
+
+/**
+ * Load and check image name (the first image if NULL), replacing any image
+ * loaded before
+ * @return 0 or an INCEPTION_ERR_* code
+ */
+int inception_load(inception_ctx_t* ctx, const char* name);
+
+/**
+ * @return the loaded image (environment rules, ld cache, ...) or NULL
+ */
+image_config_t* inception_image(inception_ctx_t* ctx);
+
+/**
+ * Move the calling process into the loaded image: build (or join) its mount
+ * namespace, chroot and become the real user. A failure can leave the
+ * process in a half built namespace, so don't carry on with the session.
+ * @return 0 or an INCEPTION_ERR_* code
+ */
+int inception_launch(inception_ctx_t* ctx);
+
+/**
+ * Run argv (resolved with the PATH in envp) inside the loaded image in a new
+ * child process, leaving the calling process and its other threads where
+ * they are. The caller reaps the child; a command that can't be executed
+ * exits 127 (not found) or 126 like a shell.
+ * @param envp environment of the command, NULL for the image's default
+ * @param pid set to the child's pid on success
+ * @return 0, or an INCEPTION_ERR_* code if the image couldn't be entered
+ */
+int inception_spawn(inception_ctx_t* ctx, char* const argv[], char* const envp[], pid_t* pid);
+
+/**
+ * Send what calls on ctx log (including from a spawned child before it
+ * execs) to log_fun instead of the set_inception_log() logger
+ */
+void inception_set_log(inception_ctx_t* ctx, inception_log_fun_t log_fun, void* arg);
+
+/**
+ * Free everything ctx holds. References to image file mounts are dropped
+ * unless this process launched, then they stay open (and are inherited
+ * across exec) for as long as the launched processes run.
+ */
+void inception_free(inception_ctx_t* ctx);
+
+/**
+ * Have inception_launch() join the namespace that launches of the loaded
+ * image for uid in scope (e.g. a job id, NULL for none) share, building and
+ * pinning it if there is none, even if the image sets no
+ * namespace_cache_ttl. Afterwards inception_image(ctx)->ns_joined says which.
+ * @param ttl seconds the namespace is kept when unused (at least the
+ * image's namespace_cache_ttl)
+ * @return 0 or an INCEPTION_ERR_* code
+ */
+int inception_share_namespace(inception_ctx_t* ctx, uid_t uid, const char* scope, int ttl);
+
+const char* inception_strerror(int err);
+
+void set_inception_log(void (*log_fun)(const char * format, va_list ap));
+
+/*
+ * Launch phase tracing, see trace.c
+ */
+typedef struct inception_span
+{
+	const char* name;
+	uint64_t start;
+} inception_span_t;
+
+/**
+ * Append trace events to path, opened with the real uid's permissions
+ * @return 0 on success
+ */
+int inception_trace_open(const char* path);
+
+/**
+ * Also (or only) report finished spans through the set_inception_log() logger
+ */
+void inception_trace_log(int enable);
+
+int inception_tracing(void);
+
+void inception_span_begin(inception_span_t* span, const char* name);
+
+/**
+ * @return span duration in ns, 0 if nothing was timed
+ */
+uint64_t inception_span_end(inception_span_t* span, const char* detail);
+
+void inception_trace_instant(const char* name, const char* detail);
+
+/*
+ * Node wide launch statistics, see stats.c
+ */
+int inception_stats_print(FILE* out, int as_json);
+
+int inception_stats_reset(void);
+
+/**
+ * Stop this process from contributing to the node statistics
+ */
+void inception_stats_disable(void);
+
+/*
+ * Page cache prewarming, see prewarm.c
+ */
+typedef struct inception_prewarm
+{
+	int workers; //threads, 0 for one per cpu (up to 16); set to those used
+	uint64_t budget; //bytes to read ahead at most, 0 for half of MemAvailable
+	size_t files; //files read ahead
+	size_t missing; //not in the image or not regular files
+	size_t truncated; //only partly read ahead, the budget ran out
+	size_t skipped; //never looked at, the budget ran out
+	uint64_t bytes;
+	uint64_t elapsed_ns;
+} inception_prewarm_t;
+
+/**
+ * Read the files listed in manifest (paths inside image) into the page cache
+ * with prewarm->workers threads until prewarm->budget is used up, image must
+ * have been loaded (parse_config()) in this namespace
+ * @return 0 on success, -2 if the manifest can't be read, -4 if the image
+ * root can't be opened
+ */
+int prewarm_image(image_config_t* image, FILE* manifest, inception_prewarm_t* prewarm);
+
+/*
+ * Task farming, see farm.c
+ */
+typedef struct inception_farm
+{
+	int jobs; //tasks run at once, 0 for one per cpu; set to those used
+	FILE* report; //"line\tstatus\tseconds\tcommand" per finished task, or NULL
+	size_t tasks; //tasks run
+	size_t failed; //tasks that exited nonzero or were killed
+	uint64_t elapsed_ns;
+} inception_farm_t;
+
+/**
+ * Run every line of commands with the image's shell (-c), farm->jobs at a
+ * time, in the namespace we are in: call after setup_namespace() and
+ * find_shell()
+ * @return 0 once every task has finished (whatever their status), -2 if
+ * commands can't be read, -4 if a task couldn't be started
+ */
+int farm_run(image_config_t* image, FILE* commands, inception_farm_t* farm);
+
+/*
+ * File access recording, see record.c
+ */
+typedef struct inception_recorder inception_recorder_t;
+
+/**
+ * Start recording into path (created with the real uid's permissions), needs
+ * root. Set image->recorder before setup_namespace() to watch the image.
+ * @return recorder or NULL
+ */
+inception_recorder_t* recorder_open(const char* path);
+
+/**
+ * Record the image files opened until child exits, call after
+ * setup_namespace() in the parent of the launched command
+ * @return child's wait status, -1 on error
+ */
+int recorder_run(inception_recorder_t* rec, image_config_t* image, pid_t child);
+
+void recorder_free(inception_recorder_t* rec);
+
 #endif
\ No newline at end of file
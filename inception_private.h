@@ -0,0 +1,315 @@
+#ifndef __INCEPTION_PRIVATE_H__
+#define __INCEPTION_PRIVATE_H__
+
+/*
+ * Helpers shared between the libinception translation units. Nothing in here
+ * is part of the public API, so keep it out of inception.h.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "inception.h"
+
+#ifndef INCEPTION_RUN_DIR
+#define INCEPTION_RUN_DIR "/run/inception"
+#endif
+
+#define INCEPTION_HIDDEN __attribute__((visibility("hidden")))
+
+//under INCEPTION_RUN_DIR, where layered images are composed and where
+//their tmpfs upper layer is mounted (both only inside image namespaces)
+#define LAYERS_ROOT "root"
+#define LAYERS_UPPER "upper"
+
+INCEPTION_HIDDEN void elog(const char * format, ...);
+
+typedef struct inception_logger
+{
+	inception_log_fun_t fun;
+	void* arg;
+} inception_logger_t;
+
+/**
+ * Send elog() calls from this thread to logger (NULL for the process wide
+ * logger)
+ * @return the logger it replaces
+ */
+INCEPTION_HIDDEN const inception_logger_t* elog_thread(const inception_logger_t* logger);
+
+INCEPTION_HIDDEN const char * join_mount_path(const char * const root, const char * const path);
+
+/**
+ * @return nonzero if mount type (NULL for the default) is a bind mount
+ */
+INCEPTION_HIDDEN int mount_is_bind(const char* type);
+
+/**
+ * @return nonzero if mount type is a recursive bind ("rbind"), which brings
+ * the mounts below its source along
+ */
+INCEPTION_HIDDEN int mount_is_recursive(const char* type);
+
+/**
+ * @return nonzero if mount type is one we know how to mount
+ */
+INCEPTION_HIDDEN int mount_type_known(const char* type);
+
+/**
+ * Fill image from one entry of the "images" array without touching the
+ * filesystem
+ * @return 0 on success, negative on a malformed entry
+ */
+INCEPTION_HIDDEN int image_from_json(json_t* config_root, image_config_t* image);
+
+/**
+ * Hash of everything that shapes an image's mount namespace
+ */
+INCEPTION_HIDDEN uint64_t image_hash(const image_config_t* image);
+
+/**
+ * Make sure INCEPTION_RUN_DIR (and optionally a subdirectory of it) exists
+ * @return 0 if the directory is usable
+ */
+INCEPTION_HIDDEN int make_run_dir(const char* subdir);
+
+/**
+ * Make dir a private mount so mounts under it don't propagate to or from
+ * other namespaces, bind mounting it onto itself first if it isn't a mount
+ * @return 0 on success
+ */
+INCEPTION_HIDDEN int make_private_dir(const char* dir);
+
+/* catalog.c */
+#define CATALOG_UNAVAILABLE 1
+#define CATALOG_NOT_FOUND 2
+
+INCEPTION_HIDDEN int catalog_find_image(const char* config_path, const char* key,
+				image_config_t* image);
+
+/**
+ * Remove config_path's catalog (and its lock) if there is one
+ */
+INCEPTION_HIDDEN void catalog_remove(const char* config_path);
+
+/* nscache.c */
+typedef struct nscache_entry
+{
+	int lock_fd;
+	int host_ns_fd;
+	char* pin_path;
+	char* lock_path;
+	int ttl;
+} nscache_entry_t;
+
+/**
+ * Join a cached namespace for image if there is a live one
+ * @return 0 if we are now in the cached namespace, otherwise the caller has
+ * to build the namespace itself and then hand entry to nscache_pin()
+ */
+INCEPTION_HIDDEN int nscache_enter(image_config_t* image, nscache_entry_t* entry);
+
+/**
+ * Pin the namespace we just built (we must be inside it) for later launches
+ * @return 0, or -1 if we could not get back into the new namespace
+ */
+INCEPTION_HIDDEN int nscache_pin(nscache_entry_t* entry);
+
+/**
+ * nscache_enter() that leaves the calling process where it is
+ * @return fd of the cached namespace, or -1 if the caller has to build it
+ * (prepare_namespace()) and hand it to nscache_pin_fd()
+ */
+INCEPTION_HIDDEN int nscache_open(image_config_t* image, nscache_entry_t* entry);
+
+/**
+ * Pin ns_fd for later launches (-1 if it could not be built), from the host
+ * namespace
+ */
+INCEPTION_HIDDEN void nscache_pin_fd(nscache_entry_t* entry, int ns_fd);
+
+/* stats.c */
+/**
+ * @return nonzero if this process is recording node statistics
+ */
+INCEPTION_HIDDEN int stats_enabled(void);
+
+/**
+ * Count one event of dur_ns under "name" (or "name:detail")
+ */
+INCEPTION_HIDDEN void stats_record(const char* name, const char* detail, uint64_t dur_ns);
+
+/* trace.c */
+/**
+ * Keep trace events out of the log in a child forked from a threaded process
+ */
+INCEPTION_HIDDEN void trace_after_fork(void);
+
+/* imgfile.c */
+/**
+ * If imgroot is a squashfs/erofs file, share the node's read only mount of
+ * it (mounting it first if needed) and point imgroot at that mount
+ * @return 0 if attached, 1 if imgroot is not a regular file, negative on error
+ */
+INCEPTION_HIDDEN int imgfile_attach(image_config_t* image);
+
+/**
+ * imgfile_attach() for any image file path, sha256 is its expected digest
+ * or NULL
+ * @return as imgfile_attach(), on success mount_path and ref_fd are set
+ */
+INCEPTION_HIDDEN int imgfile_attach_path(const char* image_path, const char* sha256,
+					char** mount_path, int* ref_fd);
+
+/**
+ * @return nonzero if a launch holds the node's mount of the image file st
+ */
+INCEPTION_HIDDEN int imgfile_in_use(const struct stat* st);
+
+/* ldcache.c */
+/**
+ * Build (once per node) the image's flattened library directory if it has
+ * one and add the mount that puts it on ld_cache_dir
+ * @return 0 on success
+ */
+INCEPTION_HIDDEN int ldcache_attach(image_config_t* image);
+
+/* placement.c */
+/**
+ * Fill image's placement fields from its "placement" object
+ * @return 0, or -128 if malformed
+ */
+INCEPTION_HIDDEN int placement_from_json(json_t* placement, image_config_t* image);
+
+/* plan.c */
+/**
+ * Rewrite image's mount list into the smallest one that builds the same
+ * tree, counting what it saved in image->plan
+ * @return 0 on success
+ */
+INCEPTION_HIDDEN int plan_mounts(image_config_t* image);
+
+/* env.c */
+INCEPTION_HIDDEN void free_env_filter(image_config_t* image);
+
+/* checkcache.c */
+/**
+ * Look up whether image's mounts (as configured) were planned and passed
+ * check_image() recently, computing the key to hand to checkcache_store()
+ * on a miss
+ * @return 0 on a hit, with image's mounts replaced by their plan, 1 on a
+ * miss, -1 if the cache can't be used
+ */
+INCEPTION_HIDDEN int checkcache_lookup(image_config_t* image, uint64_t* key);
+
+/**
+ * Remember image's planned mounts, which passed check_image()
+ */
+INCEPTION_HIDDEN void checkcache_store(const image_config_t* image, uint64_t key);
+
+/**
+ * Remove the entries of the images named in names (sorted with strcmp())
+ */
+INCEPTION_HIDDEN void checkcache_remove(const char** names, size_t num_names);
+
+/* record.c */
+/**
+ * Watch the image root mount of the namespace we are in, before the chroot
+ * @return 0 on success
+ */
+INCEPTION_HIDDEN int recorder_mark(inception_recorder_t* rec, const char* imgroot);
+
+/* stage.c */
+/**
+ * Hash size bytes of the image file open in img_fd against sha256
+ * @return 0 if it matches, -1 if not or if it can't be read
+ */
+INCEPTION_HIDDEN int stage_verify(const char* image_path, const char* sha256, int img_fd,
+				off_t size);
+
+/**
+ * Use (copying it first if needed) the node local copy of the image file
+ * open in img_fd, key identifies the original
+ * @return 0 if img_fd and st now refer to the copy, 1 if the original has
+ * to be used, negative if the image must not be used
+ */
+INCEPTION_HIDDEN int stage_image(const char* image_path, const char* sha256, uint64_t key,
+				int* img_fd, struct stat* st);
+
+/* inception.c, setup_namespace() and do_bind_mounts() without the exit */
+/**
+ * @return 0 or an INCEPTION_ERR_* code
+ */
+INCEPTION_HIDDEN int namespace_setup(image_config_t* image);
+
+/**
+ * @return 0 on success
+ */
+INCEPTION_HIDDEN int bind_mounts(image_config_t* image);
+
+/**
+ * The paths and options building an image's namespace needs, made up front
+ * so that a child forked from a threaded process (slurmstepd, a workflow
+ * engine) only has to make syscalls
+ */
+typedef struct ns_strings
+{
+	size_t num_mounts;
+	char** dest; //imgroot joined with each mount_to
+	char** data; //options of each tmpfs/hugetlbfs mount
+	char* layer_opts; //overlayfs options, NULL if there is nothing to overlay
+	char* upper; //tmpfs holding the overlay's upper and work dirs, or NULL
+	char* upper_opts;
+	char* upper_dir;
+	char* work_dir;
+} ns_strings_t;
+
+//where setting up a namespace in a forked child stopped
+enum ns_step {
+	NS_READY = 0,
+	NS_UNSHARE,
+	NS_ROOT_SLAVE,
+	NS_LAYERS,
+	NS_IMAGE_ROOT,
+	NS_MOUNT,
+	NS_PIVOT,
+	NS_JOIN,
+	NS_ROOT,
+	NS_SETGID,
+	NS_SETGROUPS,
+	NS_SETUID,
+	NS_STEPS
+};
+
+typedef struct ns_report
+{
+	int step;
+	int err; //errno
+	size_t mount; //which mount, for NS_MOUNT
+} ns_report_t;
+
+/**
+ * @return 0 on success, otherwise s is freed
+ */
+INCEPTION_HIDDEN int make_ns_strings(image_config_t* image, ns_strings_t* s);
+
+INCEPTION_HIDDEN void free_ns_strings(ns_strings_t* s);
+
+/**
+ * Log what went wrong in a forked child, from the process that made s
+ */
+INCEPTION_HIDDEN void log_ns_failure(image_config_t* image, const ns_strings_t* s,
+				const ns_report_t* r);
+
+/**
+ * namespace_setup() for a child forked from a threaded process: join ns_fd
+ * (a cached or prepare_namespace() namespace) or, if it is -1, build the
+ * namespace from s, then enter the image root and become the user resolved
+ * before the fork. Only makes syscalls.
+ * @return 0 on success, otherwise r says which step failed and why
+ */
+INCEPTION_HIDDEN int namespace_setup_forked(image_config_t* image, const ns_strings_t* s,
+				int ns_fd, ns_report_t* r);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * inception-ldcache: build the flattened library directories of images ahead
+ * of the first launch (e.g. from a node prolog) and clean out old versions
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "inception.h"
+
+static void usage()
+{
+	printf("inception-ldcache [-p] image...\n");
+	printf("-p #also remove caches built for older versions of the images, unless in use\n");
+}
+
+int main(int argc, char** argv)
+{
+	int ch, i, ret = 0;
+	int prune = 0;
+	size_t j;
+	image_config_t image;
+	static struct option longopts[] = {
+		{ "prune", no_argument, NULL, 'p' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	while((ch = getopt_long(argc, argv, "ph", longopts, NULL)) != -1)
+	{
+		switch(ch) {
+			case 'p':
+				prune = 1;
+				break;
+			case 'h':
+				usage();
+				return(0);
+			default:
+				fprintf(stderr, "Getopt Error\n");
+				return(1);
+		}
+	}
+	if(optind >= argc)
+	{
+		usage();
+		return(1);
+	}
+	if(geteuid() != 0)
+	{
+		fprintf(stderr, "Library caches are built as root\n");
+		return(1);
+	}
+	for(i=optind;i<argc;i++)
+	{
+		//parse_config() builds the cache while checking the image
+		memset(&image, 0, sizeof(image_config_t));
+		if(parse_config(INCEPTION_CONFIG_PATH, argv[i], &image) != 0)
+		{
+			ret = 1;
+			continue;
+		}
+		if(!image.ld_cache_dir)
+			printf("%s: no ld_cache configured\n", argv[i]);
+		for(j=0;image.ld_cache_dir && j<image.num_mounts;j++)
+		{
+			if(strcmp(image.mount_to[j], image.ld_cache_dir) == 0)
+				printf("%s: %s -> %s\n", argv[i], image.mount_from[j], image.ld_cache_dir);
+		}
+		if(prune && ld_cache_prune(&image) > 0)
+			printf("%s: removed old caches\n", argv[i]);
+		detach_image_file(&image);
+		ld_cache_detach(&image);
+	}
+	return(ret);
+}
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Flattened library directories
+ *
+ * An image with an "ld_cache" object gets one directory of symlinks, one per
+ * shared library found in the image's ld_cache "path" directories (first
+ * directory wins), built under INCEPTION_RUN_DIR/ldcache and bind mounted on
+ * the image's ld_cache "dir". Launch then collapses those entries of
+ * LD_LIBRARY_PATH into that single directory, so the loader finds each
+ * library with one lookup instead of probing every directory on the
+ * parallel filesystem.
+ *
+ * The directory is named <image>-<key>, where key covers the image config
+ * and the identity and mtime of every scanned directory (a library added to
+ * or removed from one changes its mtime), so a changed image gets a fresh
+ * directory. Every launch holds a shared flock on <image>-<key>.ref for as
+ * long as its processes run (the fd is inherited across exec), and
+ * inception-ldcache -p removes the old versions nobody holds.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define LDCACHE_SUBDIR "ldcache"
+
+static size_t ldcache_num_roots(image_config_t* image)
+{
+	return(image->num_layers ? image->num_layers : 1);
+}
+
+/**
+ * Roots the image's files come from, top most (index 0) first
+ */
+static const char* ldcache_root(image_config_t* image, size_t index)
+{
+	if(!image->num_layers)
+		return(image->imgroot);
+	return(image->layers[image->num_layers - index - 1]);
+}
+
+static uint64_t ldcache_hash(uint64_t hash, const void* data, size_t len)
+{
+	const unsigned char* c = (const unsigned char*) data;
+	size_t i;
+	for(i=0;i<len;i++)
+	{
+		hash ^= c[i];
+		hash *= 1099511628211ull;
+	}
+	return(hash);
+}
+
+static uint64_t ldcache_key(image_config_t* image)
+{
+	uint64_t hash = image_hash(image);
+	size_t i, j;
+	hash = ldcache_hash(hash, image->ld_cache_dir, strlen(image->ld_cache_dir) + 1);
+	for(i=0;i<image->num_ld_cache_path;i++)
+	{
+		hash = ldcache_hash(hash, image->ld_cache_path[i],
+				strlen(image->ld_cache_path[i]) + 1);
+		for(j=0;j<ldcache_num_roots(image);j++)
+		{
+			struct stat st;
+			uint64_t id[4] = {0, 0, 0, 0};
+			const char* dir = join_mount_path(ldcache_root(image, j),
+							image->ld_cache_path[i]);
+			if(dir && stat(dir, &st) == 0)
+			{
+				id[0] = st.st_dev;
+				id[1] = st.st_ino;
+				id[2] = st.st_mtim.tv_sec;
+				id[3] = st.st_mtim.tv_nsec;
+			}
+			free((char*) dir);
+			hash = ldcache_hash(hash, id, sizeof(id));
+		}
+	}
+	return(hash);
+}
+
+/**
+ * @return ownership of cstring of image's "<name>-" prefix under dir
+ */
+static char* ldcache_prefix(image_config_t* image, const char* dir)
+{
+	char* prefix;
+	char* c;
+	if(asprintf(&prefix, "%s/%s-", dir, image->name ? image->name : "image") == -1)
+		return(NULL);
+	for(c=prefix+strlen(dir)+1;*c;c++)
+	{
+		if(!isalnum((unsigned char) *c) && *c != '.' && *c != '_' && *c != '-')
+			*c = '_';
+	}
+	return(prefix);
+}
+
+static void ldcache_remove(const char* path)
+{
+	DIR* d = opendir(path);
+	struct dirent* ent;
+	if(d)
+	{
+		while((ent = readdir(d)))
+			unlinkat(dirfd(d), ent->d_name, 0);
+		closedir(d);
+	}
+	rmdir(path);
+}
+
+static int ldcache_is_library(const char* name)
+{
+	const char* so = strstr(name, ".so");
+	return(so && (so[3] == '\0' || so[3] == '.'));
+}
+
+/**
+ * Fill a fresh directory with links to every library and move it into place
+ * @return 0 on success
+ */
+static int ldcache_build(image_config_t* image, const char* path)
+{
+	char* tmp_path;
+	size_t i, j;
+	int ret = -1;
+
+	if(asprintf(&tmp_path, "%s.%d", path, getpid()) == -1)
+		return(-1);
+	if(mkdir(tmp_path, 0755))
+	{
+		free(tmp_path);
+		return(-1);
+	}
+	for(i=0;i<image->num_ld_cache_path;i++)
+	{
+		for(j=0;j<ldcache_num_roots(image);j++)
+		{
+			const char* dir = join_mount_path(ldcache_root(image, j),
+							image->ld_cache_path[i]);
+			DIR* d = dir ? opendir(dir) : NULL;
+			struct dirent* ent;
+			free((char*) dir);
+			if(!d)
+				continue;
+			while((ent = readdir(d)))
+			{
+				char* target;
+				char* link_path;
+				if(ent->d_type == DT_DIR || !ldcache_is_library(ent->d_name))
+					continue;
+				//the link resolves inside the image, not here
+				if(asprintf(&target, "%s/%s", image->ld_cache_path[i], ent->d_name) == -1)
+					continue;
+				if(asprintf(&link_path, "%s/%s", tmp_path, ent->d_name) == -1)
+				{
+					free(target);
+					continue;
+				}
+				//EEXIST: an earlier directory or higher layer has it
+				symlink(target, link_path);
+				free(target);
+				free(link_path);
+			}
+			closedir(d);
+		}
+	}
+	if(rename(tmp_path, path) == 0)
+		ret = 0;
+	else
+		ldcache_remove(tmp_path);
+	free(tmp_path);
+	return(ret);
+}
+
+int ldcache_attach(image_config_t* image)
+{
+	char* dir = NULL;
+	char* prefix = NULL;
+	char* path = NULL;
+	char* lock_path = NULL;
+	char* ref_path = NULL;
+	char** grown;
+	struct stat st;
+	int lock_fd = -1, ref_fd = -1, ret = -1;
+	inception_span_t span;
+
+	if(!image->ld_cache_dir)
+		return(0);
+	inception_span_begin(&span, "ld_cache");
+	if(make_run_dir(LDCACHE_SUBDIR) ||
+		asprintf(&dir, "%s/%s", INCEPTION_RUN_DIR, LDCACHE_SUBDIR) == -1)
+	{
+		dir = NULL;
+		goto out;
+	}
+	prefix = ldcache_prefix(image, dir);
+	if(!prefix || asprintf(&path, "%s%016llx", prefix,
+		(unsigned long long) ldcache_key(image)) == -1)
+	{
+		path = NULL;
+		goto out;
+	}
+	if(asprintf(&lock_path, "%s/.lock", dir) == -1)
+	{
+		lock_path = NULL;
+		goto out;
+	}
+	if(asprintf(&ref_path, "%s.ref", path) == -1)
+	{
+		ref_path = NULL;
+		goto out;
+	}
+	//shared keeps ld_cache_prune() away until we hold our reference
+	lock_fd = open(lock_path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if(lock_fd < 0 || flock(lock_fd, LOCK_SH))
+		goto out;
+	if(stat(path, &st))
+	{
+		//one launch per node builds it, the rest wait and reuse it
+		if(flock(lock_fd, LOCK_EX))
+			goto out;
+		if(stat(path, &st))
+		{
+			if(ldcache_build(image, path))
+				goto out;
+			stats_record("ld_cache_build", NULL, 0);
+		}
+	}
+	//left open across exec, it is this launch's reference to the cache
+	ref_fd = open(ref_path, O_RDONLY|O_CREAT, 0644);
+	if(ref_fd < 0 || flock(ref_fd, LOCK_SH))
+		goto out;
+
+	grown = (char**) realloc(image->mount_from, sizeof(char*)*(image->num_mounts+1));
+	if(!grown)
+		goto out;
+	image->mount_from = grown;
+	grown = (char**) realloc(image->mount_to, sizeof(char*)*(image->num_mounts+1));
+	if(!grown)
+		goto out;
+	image->mount_to = grown;
+	grown = (char**) realloc(image->mount_type, sizeof(char*)*(image->num_mounts+1));
+	if(!grown)
+		goto out;
+	image->mount_type = grown;
+	grown = (char**) realloc(image->mount_options, sizeof(char*)*(image->num_mounts+1));
+	if(!grown)
+		goto out;
+	image->mount_options = grown;
+	image->mount_from[image->num_mounts] = path;
+	image->mount_options[image->num_mounts] = NULL;
+	asprintf(&(image->mount_to[image->num_mounts]), "%s", image->ld_cache_dir);
+	asprintf(&(image->mount_type[image->num_mounts]), "bind");
+	image->num_mounts++;
+	image->ld_cache_ref_fd = ref_fd;
+	path = NULL;
+	ref_fd = -1;
+	ret = 0;
+out:
+	if(ret)
+		elog("Unable to set up the library cache for %s\n", image->name);
+	inception_span_end(&span, image->name);
+	if(ref_fd >= 0)
+		close(ref_fd);
+	if(lock_fd >= 0)
+		close(lock_fd);
+	free(dir);
+	free(prefix);
+	free(path);
+	free(lock_path);
+	free(ref_path);
+	return(ret);
+}
+
+/**
+ * Remove path's reference file unless a launch still holds it
+ * @return 1 if path's cache is still in use
+ */
+static int ldcache_in_use(const char* path)
+{
+	char* ref_path;
+	int fd, ret = 0;
+	if(asprintf(&ref_path, "%s.ref", path) == -1)
+		return(1);
+	fd = open(ref_path, O_RDONLY|O_CLOEXEC);
+	if(fd >= 0)
+	{
+		if(flock(fd, LOCK_EX|LOCK_NB))
+			ret = 1;
+		else
+			unlink(ref_path);
+		close(fd);
+	}
+	free(ref_path);
+	return(ret);
+}
+
+void ld_cache_detach(image_config_t* image)
+{
+	if(image->ld_cache_dir && image->ld_cache_ref_fd >= 0)
+		close(image->ld_cache_ref_fd);
+	image->ld_cache_ref_fd = -1;
+}
+
+int ld_cache_prune(image_config_t* image)
+{
+	char* dir = NULL;
+	char* prefix = NULL;
+	DIR* d;
+	struct dirent* ent;
+	size_t i, prefix_len;
+	int lock_fd = -1, removed = 0;
+
+	if(!image->ld_cache_dir)
+		return(0);
+	if(asprintf(&dir, "%s/%s", INCEPTION_RUN_DIR, LDCACHE_SUBDIR) == -1)
+		return(-1);
+	prefix = ldcache_prefix(image, dir);
+	d = opendir(dir);
+	if(prefix && d)
+	{
+		char* lock_path;
+		if(asprintf(&lock_path, "%s/.lock", dir) != -1)
+		{
+			lock_fd = open(lock_path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+			free(lock_path);
+		}
+		if(lock_fd >= 0)
+			flock(lock_fd, LOCK_EX);
+		prefix_len = strlen(prefix) - strlen(dir) - 1;
+		while((ent = readdir(d)))
+		{
+			char* path;
+			int current = 0;
+			if(strncmp(ent->d_name, prefix + strlen(dir) + 1, prefix_len) ||
+				strlen(ent->d_name) != prefix_len + 16)
+				continue;
+			if(asprintf(&path, "%s/%s", dir, ent->d_name) == -1)
+				break;
+			for(i=0;i<image->num_mounts;i++)
+			{
+				if(strcmp(image->mount_from[i], path) == 0)
+					current = 1;
+			}
+			if(!current && !ldcache_in_use(path))
+			{
+				ldcache_remove(path);
+				removed++;
+			}
+			free(path);
+		}
+	}
+	if(d)
+		closedir(d);
+	if(lock_fd >= 0)
+		close(lock_fd);
+	free(prefix);
+	free(dir);
+	return(removed);
+}
+
+/**
+ * @return 1 + the index of entry in the directories flattened into the cache,
+ * or 0 if it isn't one of them
+ */
+static size_t ldcache_covers(image_config_t* image, const char* entry, size_t len)
+{
+	size_t i;
+	while(len > 1 && entry[len-1] == '/')
+		len--;
+	for(i=0;i<image->num_ld_cache_path;i++)
+	{
+		const char* path = image->ld_cache_path[i];
+		size_t path_len = strlen(path);
+		while(path_len > 1 && path[path_len-1] == '/')
+			path_len--;
+		if(path_len == len && strncmp(path, entry, len) == 0)
+			return(i + 1);
+	}
+	return(0);
+}
+
+char* ld_cache_library_path(image_config_t* image, const char* ld_library_path)
+{
+	char* out = NULL;
+	size_t out_len;
+	FILE* out_mem;
+	const char* entry;
+	size_t covered, last = 0;
+	int runs = 0, in_run = 0, first = 1;
+
+	if(!image->ld_cache_dir || !ld_library_path)
+		return(NULL);
+	//the cache only searches like the path if the covered entries are one
+	//run (else its libraries jump ahead of the entries between runs) of
+	//every directory in it (else libraries that weren't on the path show
+	//up) in the order it was built in (the first directory listed wins)
+	for(entry=ld_library_path;;)
+	{
+		size_t len = strcspn(entry, ":");
+		covered = len ? ldcache_covers(image, entry, len) : 0;
+		if(covered && !in_run)
+			runs++;
+		if(covered && covered != last && covered != last + 1)
+			return(NULL);
+		if(covered)
+			last = covered;
+		in_run = covered != 0;
+		if(entry[len] == '\0')
+			break;
+		entry += len + 1;
+	}
+	if(runs != 1 || last != image->num_ld_cache_path)
+		return(NULL);
+	out_mem = open_memstream(&out, &out_len);
+	if(!out_mem)
+		return(NULL);
+	in_run = 0;
+	for(entry=ld_library_path;;)
+	{
+		size_t len = strcspn(entry, ":");
+		if(len && ldcache_covers(image, entry, len))
+		{
+			//the run becomes the cache
+			if(!in_run)
+				fprintf(out_mem, "%s%s", first ? "" : ":", image->ld_cache_dir);
+			in_run = 1;
+			first = 0;
+		}
+		else
+		{
+			fprintf(out_mem, "%s%.*s", first ? "" : ":", (int) len, entry);
+			in_run = 0;
+			first = 0;
+		}
+		if(entry[len] == '\0')
+			break;
+		entry += len + 1;
+	}
+	fclose(out_mem);
+	return(out);
+}
+
+void ld_cache_environ(image_config_t* image)
+{
+	size_t i;
+	const char* var = "LD_LIBRARY_PATH=";
+	for(i=0;image->environ && image->environ[i];i++)
+	{
+		char* value;
+		if(strncmp(image->environ[i], var, strlen(var)))
+			continue;
+		value = ld_cache_library_path(image, image->environ[i] + strlen(var));
+		if(value)
+		{
+			//the old entry may belong to somebody else's block, leak it
+			asprintf(&(image->environ[i]), "%s%s", var, value);
+			free(value);
+		}
+		return;
+	}
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * fd based mount engine
+ *
+ * Instead of mount(MS_BIND)ing every entry onto "imgroot/<to>" in our
+ * namespace, clone the image root into a detached tree, bind every mount into
+ * that tree through fds (targets are resolved with RESOLVE_IN_ROOT, so image
+ * symlinks cannot point us back out at the host) and attach the finished tree
+ * over imgroot with a single move_mount(). Nobody ever sees a half built tree.
+ *
+ * Mounting onto a detached tree needs a recent kernel (6.15+), anything that
+ * says no sends us back to do_bind_mounts().
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#if defined(SYS_open_tree) && defined(SYS_move_mount) && \
+	defined(SYS_mount_setattr) && defined(SYS_openat2)
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef MOVE_MOUNT_T_EMPTY_PATH
+#define MOVE_MOUNT_T_EMPTY_PATH 0x00000040
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef RESOLVE_NO_MAGICLINKS
+#define RESOLVE_NO_MAGICLINKS 0x02
+#endif
+#ifndef RESOLVE_IN_ROOT
+#define RESOLVE_IN_ROOT 0x10
+#endif
+#define INCEPTION_MS_PRIVATE (1<<18)
+
+//private copies of the uapi structs, <linux/mount.h> fights with <sys/mount.h>
+//on some libcs and <linux/openat2.h> is missing on older ones
+struct inception_mount_attr
+{
+	uint64_t attr_set;
+	uint64_t attr_clr;
+	uint64_t propagation;
+	uint64_t userns_fd;
+};
+
+struct inception_open_how
+{
+	uint64_t flags;
+	uint64_t mode;
+	uint64_t resolve;
+};
+
+static int sys_open_tree(int dfd, const char* path, unsigned int flags)
+{
+	return(syscall(SYS_open_tree, dfd, path, flags));
+}
+
+static int sys_move_mount(int from_dfd, const char* from_path, int to_dfd,
+				const char* to_path, unsigned int flags)
+{
+	return(syscall(SYS_move_mount, from_dfd, from_path, to_dfd, to_path, flags));
+}
+
+static int sys_mount_setattr(int dfd, const char* path, unsigned int flags,
+				struct inception_mount_attr* attr)
+{
+	return(syscall(SYS_mount_setattr, dfd, path, flags, attr, sizeof(*attr)));
+}
+
+static int sys_openat2(int dfd, const char* path, struct inception_open_how* how)
+{
+	return(syscall(SYS_openat2, dfd, path, how, sizeof(*how)));
+}
+
+/**
+ * Bind one mount into the detached tree
+ * @return 0 on success
+ */
+static int attach_one(int tree_fd, const char* from, const char* to, int recursive)
+{
+	struct inception_open_how how;
+	int src_fd, dest_fd, ret;
+
+	src_fd = sys_open_tree(AT_FDCWD, from,
+		OPEN_TREE_CLONE|OPEN_TREE_CLOEXEC|(recursive ? AT_RECURSIVE : 0));
+	if(src_fd < 0)
+		return(-1);
+	memset(&how, 0, sizeof(how));
+	how.flags = O_PATH|O_CLOEXEC;
+	how.resolve = RESOLVE_IN_ROOT|RESOLVE_NO_MAGICLINKS;
+	//leading slashes are fine, RESOLVE_IN_ROOT treats tree_fd as /
+	dest_fd = sys_openat2(tree_fd, to, &how);
+	if(dest_fd < 0)
+	{
+		close(src_fd);
+		return(-1);
+	}
+	ret = sys_move_mount(src_fd, "", dest_fd, "",
+		MOVE_MOUNT_F_EMPTY_PATH|MOVE_MOUNT_T_EMPTY_PATH);
+	close(dest_fd);
+	close(src_fd);
+	return(ret);
+}
+
+int do_bind_mounts_fd(image_config_t* image)
+{
+	struct inception_mount_attr attr;
+	size_t i;
+	int tree_fd;
+
+	//tmpfs/hugetlbfs mounts are left to do_bind_mounts()
+	for(i=0;i<image->num_mounts;i++)
+	{
+		if(!mount_is_bind(image->mount_type[i]))
+			return(1);
+	}
+	tree_fd = sys_open_tree(AT_FDCWD, image->imgroot,
+		OPEN_TREE_CLONE|OPEN_TREE_CLOEXEC|AT_RECURSIVE);
+	if(tree_fd < 0)
+		return(1);
+	for(i=0;i<image->num_mounts;i++)
+	{
+		inception_span_t span;
+		int ret;
+		inception_span_begin(&span, "mount");
+		ret = attach_one(tree_fd, image->mount_from[i], image->mount_to[i],
+			mount_is_recursive(image->mount_type[i]));
+		inception_span_end(&span, image->mount_to[i]);
+		if(ret)
+		{
+			//old kernels give EINVAL for mounts onto a detached tree,
+			//real errors get reported by do_bind_mounts() on the way out
+			close(tree_fd);
+			return(1);
+		}
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.propagation = INCEPTION_MS_PRIVATE;
+	if(sys_mount_setattr(tree_fd, "", AT_EMPTY_PATH|AT_RECURSIVE, &attr) ||
+		sys_move_mount(tree_fd, "", AT_FDCWD, image->imgroot, MOVE_MOUNT_F_EMPTY_PATH))
+	{
+		close(tree_fd);
+		return(1);
+	}
+	close(tree_fd);
+	return(0);
+}
+
+#else
+
+int do_bind_mounts_fd(image_config_t* image)
+{
+	return(1);
+}
+
+#endif
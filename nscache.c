@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Prepared namespace cache
+ *
+ * Images with "namespace_cache_ttl" set keep the mount namespace from their
+ * first launch alive by bind mounting its nsfs inode under
+ * INCEPTION_RUN_DIR/ns. Later launches of the same image by the same user
+ * setns() into it instead of unsharing and redoing every bind mount.
+ *
+ * Entries are named <image>-<image_hash>-<uid>, or <uid>.<scope> for
+ * launches that share a namespace only within a scope (pam_inception uses
+ * the job id so every ssh session of a job joins one). A config change produces a
+ * new hash, so stale namespaces are never joined; they (and anything idle for
+ * longer than its ttl) are reaped the next time somebody has to build one.
+ * The mtime of the <key>.lock file is the last use time.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/vfs.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#ifndef NSFS_MAGIC
+#define NSFS_MAGIC 0x6e736673
+#endif
+
+#define NSCACHE_SUBDIR "ns"
+
+/**
+ * Open and flock path, retrying if it was unlinked while we waited
+ * @return locked fd or -1
+ */
+static int nscache_lock(const char* path, int op)
+{
+	struct stat fd_st, path_st;
+	int fd;
+	while(1)
+	{
+		fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+		if(fd < 0)
+			return(-1);
+		if(flock(fd, op))
+		{
+			close(fd);
+			return(-1);
+		}
+		if(fstat(fd, &fd_st) == 0 && stat(path, &path_st) == 0 &&
+			fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)
+			return(fd);
+		close(fd);
+	}
+}
+
+static void nscache_drop(const char* pin_path, const char* lock_path)
+{
+	umount2(pin_path, MNT_DETACH);
+	unlink(pin_path);
+	if(lock_path)
+		unlink(lock_path);
+}
+
+/**
+ * Try to join the namespace pinned at entry->pin_path, or with ns_fd only
+ * open it for somebody else to join
+ * @return 0 if we are in it (or ns_fd is set)
+ */
+static int nscache_join(nscache_entry_t* entry, int lock_fd, int* ns_fd)
+{
+	struct stat lock_st;
+	struct statfs pin_fs;
+	int pin_fd, ret;
+	if(fstat(lock_fd, &lock_st) ||
+		time(NULL) - lock_st.st_mtime > entry->ttl)
+		return(1);
+	pin_fd = open(entry->pin_path, O_RDONLY|O_CLOEXEC);
+	if(pin_fd < 0)
+		return(1);
+	if(fstatfs(pin_fd, &pin_fs) || pin_fs.f_type != NSFS_MAGIC)
+	{
+		close(pin_fd);
+		return(1);
+	}
+	if(ns_fd)
+	{
+		*ns_fd = pin_fd;
+		futimens(lock_fd, NULL);
+		return(0);
+	}
+	//setns() refuses to switch mount namespace with a shared fs struct
+	unshare(CLONE_FS);
+	ret = setns(pin_fd, CLONE_NEWNS);
+	close(pin_fd);
+	if(ret)
+		return(1);
+	futimens(lock_fd, NULL);
+	return(0);
+}
+
+/**
+ * Reap entries that are idle past their ttl or built from another version
+ * of key's image config. Caller must be in the host namespace.
+ */
+static void nscache_gc(const char* dir, const char* key)
+{
+	DIR* d = opendir(dir);
+	struct dirent* ent;
+	//every version of this image's entry shares "<name>-" and "-<uid>"
+	const char* uid_suffix = strrchr(key, '-');
+	size_t prefix_len = (uid_suffix - key) - 16;
+	size_t key_len = strlen(key);
+	time_t now = time(NULL);
+
+	if(!d)
+		return;
+	while((ent = readdir(d)))
+	{
+		char* lock_path = NULL;
+		char* pin_path = NULL;
+		char buf[32];
+		struct stat st;
+		ssize_t len;
+		int fd, ttl = 0, superseded;
+		size_t name_len = strlen(ent->d_name);
+
+		if(name_len <= 5 || strcmp(ent->d_name + name_len - 5, ".lock"))
+			continue;
+		if(name_len == key_len + 5 && strncmp(ent->d_name, key, key_len) == 0)
+			continue;
+		superseded = name_len == key_len + 5 &&
+			strncmp(ent->d_name, key, prefix_len) == 0 &&
+			strncmp(ent->d_name + prefix_len + 16, uid_suffix, strlen(uid_suffix)) == 0;
+		if(asprintf(&lock_path, "%s/%s", dir, ent->d_name) == -1)
+			break;
+		if(asprintf(&pin_path, "%s/%.*s", dir, (int) name_len - 5, ent->d_name) == -1)
+		{
+			free(lock_path);
+			break;
+		}
+		fd = open(lock_path, O_RDWR|O_CLOEXEC);
+		if(fd >= 0 && flock(fd, LOCK_EX|LOCK_NB) == 0 && fstat(fd, &st) == 0)
+		{
+			len = pread(fd, buf, sizeof(buf)-1, 0);
+			if(len > 0)
+			{
+				buf[len] = '\0';
+				ttl = atoi(buf);
+			}
+			if(superseded || now - st.st_mtime > ttl)
+				nscache_drop(pin_path, lock_path);
+		}
+		if(fd >= 0)
+			close(fd);
+		free(lock_path);
+		free(pin_path);
+	}
+	closedir(d);
+}
+
+static void nscache_release(nscache_entry_t* entry)
+{
+	if(entry->host_ns_fd >= 0)
+		close(entry->host_ns_fd);
+	if(entry->lock_fd >= 0)
+	{
+		flock(entry->lock_fd, LOCK_UN);
+		close(entry->lock_fd);
+	}
+	free(entry->pin_path);
+	free(entry->lock_path);
+	entry->host_ns_fd = -1;
+	entry->lock_fd = -1;
+	entry->pin_path = NULL;
+	entry->lock_path = NULL;
+}
+
+/**
+ * nscache_enter(), or with ns_fd nscache_open()
+ */
+static int nscache_lookup(image_config_t* image, nscache_entry_t* entry, int* ns_fd)
+{
+	char* dir = NULL;
+	char* key = NULL;
+	char* scope = NULL;
+	char* c;
+	uid_t uid = image->ns_scope ? image->ns_uid : getuid();
+	int fd;
+
+	memset(entry, 0, sizeof(nscache_entry_t));
+	entry->lock_fd = -1;
+	entry->host_ns_fd = -1;
+	entry->ttl = image->ns_cache_ttl;
+	if(!image->name || make_run_dir(NSCACHE_SUBDIR))
+		return(-1);
+	if(asprintf(&dir, "%s/%s", INCEPTION_RUN_DIR, NSCACHE_SUBDIR) == -1)
+		return(-1);
+	if(image->ns_scope && *image->ns_scope)
+	{
+		scope = strdup(image->ns_scope);
+		if(!scope)
+		{
+			free(dir);
+			return(-1);
+		}
+		//nscache_gc() finds the uid by the last '-'
+		for(c=scope;*c;c++)
+		{
+			if(!isalnum((unsigned char) *c) && *c != '.' && *c != '_')
+				*c = '_';
+		}
+	}
+	if(asprintf(&key, "%s-%016llx-%u%s%s", image->name,
+		(unsigned long long) image_hash(image), (unsigned) uid, scope ? "." : "",
+		scope ? scope : "") == -1)
+	{
+		free(dir);
+		free(scope);
+		return(-1);
+	}
+	free(scope);
+	for(c=key;*c;c++)
+	{
+		if(!isalnum((unsigned char) *c) && *c != '.' && *c != '_' && *c != '-')
+			*c = '_';
+	}
+	if(asprintf(&entry->pin_path, "%s/%s", dir, key) == -1 ||
+		asprintf(&entry->lock_path, "%s/%s.lock", dir, key) == -1)
+		goto miss;
+
+	fd = nscache_lock(entry->lock_path, LOCK_SH);
+	if(fd >= 0)
+	{
+		if(nscache_join(entry, fd, ns_fd) == 0)
+		{
+			flock(fd, LOCK_UN);
+			close(fd);
+			free(dir);
+			free(key);
+			nscache_release(entry);
+			return(0);
+		}
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+
+	//slow path, one launch builds while the rest of the node waits here
+	entry->lock_fd = nscache_lock(entry->lock_path, LOCK_EX);
+	if(entry->lock_fd < 0)
+		goto miss;
+	if(nscache_join(entry, entry->lock_fd, ns_fd) == 0)
+	{
+		free(dir);
+		free(key);
+		nscache_release(entry);
+		return(0);
+	}
+	umount2(entry->pin_path, MNT_DETACH);
+	nscache_gc(dir, key);
+	//pins would otherwise propagate into the namespaces they pin
+	if(make_private_dir(dir))
+		goto miss;
+	//nscache_pin() comes back here to pin, nscache_pin_fd() never leaves
+	entry->host_ns_fd = ns_fd ? -1 : open("/proc/self/ns/mnt", O_RDONLY|O_CLOEXEC);
+	if(!ns_fd && entry->host_ns_fd < 0)
+		goto miss;
+	free(dir);
+	free(key);
+	return(1);
+miss:
+	free(dir);
+	free(key);
+	nscache_release(entry);
+	return(1);
+}
+
+int nscache_enter(image_config_t* image, nscache_entry_t* entry)
+{
+	return(nscache_lookup(image, entry, NULL));
+}
+
+int nscache_open(image_config_t* image, nscache_entry_t* entry)
+{
+	int ns_fd = -1;
+	if(nscache_lookup(image, entry, &ns_fd))
+		return(-1);
+	return(ns_fd);
+}
+
+/**
+ * Bind mount ns_fd's namespace on entry->pin_path, from the host namespace
+ */
+static void nscache_pin_at(nscache_entry_t* entry, int ns_fd)
+{
+	char src[64];
+	char ttl[32];
+	int pin_fd;
+
+	pin_fd = open(entry->pin_path, O_WRONLY|O_CREAT|O_CLOEXEC, 0600);
+	if(pin_fd >= 0)
+		close(pin_fd);
+	snprintf(src, sizeof(src), "/proc/self/fd/%d", ns_fd);
+	if(pin_fd < 0 || mount(src, entry->pin_path, NULL, MS_BIND, NULL))
+	{
+		elog("Unable to cache namespace %s: %s\n", entry->pin_path, strerror(errno));
+		unlink(entry->pin_path);
+	}
+	else
+	{
+		snprintf(ttl, sizeof(ttl), "%d\n", entry->ttl);
+		if(ftruncate(entry->lock_fd, 0) == 0)
+			pwrite(entry->lock_fd, ttl, strlen(ttl), 0);
+		futimens(entry->lock_fd, NULL);
+	}
+}
+
+int nscache_pin(nscache_entry_t* entry)
+{
+	int new_ns_fd, ret = 0;
+
+	if(entry->lock_fd < 0 || entry->host_ns_fd < 0)
+	{
+		nscache_release(entry);
+		return(0);
+	}
+	new_ns_fd = open("/proc/self/ns/mnt", O_RDONLY|O_CLOEXEC);
+	if(new_ns_fd < 0)
+	{
+		nscache_release(entry);
+		return(0);
+	}
+	if(setns(entry->host_ns_fd, CLONE_NEWNS))
+	{
+		close(new_ns_fd);
+		nscache_release(entry);
+		return(0);
+	}
+	nscache_pin_at(entry, new_ns_fd);
+	if(setns(new_ns_fd, CLONE_NEWNS))
+	{
+		elog("Unable to re-enter image namespace: %s\n", strerror(errno));
+		ret = -1;
+	}
+	close(new_ns_fd);
+	nscache_release(entry);
+	return(ret);
+}
+
+void nscache_pin_fd(nscache_entry_t* entry, int ns_fd)
+{
+	if(entry->lock_fd >= 0 && ns_fd >= 0)
+		nscache_pin_at(entry, ns_fd);
+	nscache_release(entry);
+}
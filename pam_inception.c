@@ -29,9 +29,15 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #define PAM_SM_SESSION
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pwd.h>
 #include <syslog.h>
 #include <security/pam_modules.h>
 
@@ -42,29 +48,133 @@
 		openlog(NULL, 0, 0); \
 		closelog() 
 
+//seconds an ssh session's namespace is kept for the next session of the
+//same user, job and image once the last one using it is gone
+#define DEFAULT_NAMESPACE_TTL 600
 
-extern char** environ;
-void print_env(char** env)
+static int namespace_ttl = DEFAULT_NAMESPACE_TTL;
+
+static void pilog(const char* format, va_list ap)
+{
+	char* tagged_fmt;
+	if(asprintf(&tagged_fmt, "pam_inception: %s", format) == -1)
+		return;
+	vsyslog(LOG_WARNING, tagged_fmt, ap);
+	free(tagged_fmt);
+}
+
+static int pam_unset_var(void* pamh, const char* name)
+{
+	//pam_putenv() without an '=' removes the variable
+	return(pam_putenv((pam_handle_t*) pamh, name) == PAM_SUCCESS ? 0 : -1);
+}
+
+static int pam_set_var(void* pamh, const char* entry)
+{
+	return(pam_putenv((pam_handle_t*) pamh, entry) == PAM_SUCCESS ? 0 : -1);
+}
+
+/**
+ * Module arguments: "trace" logs launch phase timings to syslog,
+ * "trace=/path" appends trace events to /path, "namespace_ttl=seconds"
+ * (0 builds a new namespace for every session)
+ */
+static void parse_args(int argc, const char** argv)
 {
-	int i = 0;
-	for(i=0;env[i] != NULL; i++)
+	int i;
+	for(i=0;i<argc;i++)
 	{
-		syslog(LOG_WARNING, "%s", env[i]);
+		if(strcmp(argv[i], "trace") == 0)
+			inception_trace_log(1);
+		else if(strncmp(argv[i], "trace=", 6) == 0)
+			inception_trace_open(argv[i] + 6);
+		else if(strncmp(argv[i], "namespace_ttl=", 14) == 0)
+			namespace_ttl = atoi(argv[i] + 14);
 	}
 }
 
+/**
+ * Find the batch job this session belongs to: from the environment, or
+ * from the job cgroup pam_slurm_adopt moved sshd into
+ * @return ownership of the job id, or NULL outside a job
+ */
+static char* find_job(pam_handle_t* pamh)
+{
+	const char* env_job = pam_getenv(pamh, "SLURM_JOB_ID");
+	char* line = NULL;
+	char* job = NULL;
+	size_t cap = 0;
+	FILE* cgroup;
+	if(!env_job)
+		env_job = pam_getenv(pamh, "PBS_JOBID");
+	if(env_job)
+		return(strdup(env_job));
+	cgroup = fopen("/proc/self/cgroup", "re");
+	if(!cgroup)
+		return(NULL);
+	while(!job && getline(&line, &cap, cgroup) != -1)
+	{
+		char* c = strstr(line, "/job_");
+		if(c)
+			job = strndup(c + 5, strspn(c + 5, "0123456789"));
+	}
+	free(line);
+	fclose(cgroup);
+	if(job && !*job)
+	{
+		free(job);
+		job = NULL;
+	}
+	return(job);
+}
+
+/**
+ * Share the session's namespace with the user's other sessions in the same
+ * job (hundreds of them when MPI launches over ssh)
+ * @return job id to log, ownership passes to the caller
+ */
+static char* share_namespace(pam_handle_t* pamh, inception_ctx_t* ctx, const char* user)
+{
+	struct passwd pw;
+	struct passwd* found = NULL;
+	char buf[4096];
+	char* job;
+	if(namespace_ttl <= 0)
+		return(NULL);
+	if(getpwnam_r(user, &pw, buf, sizeof(buf), &found) || !found)
+		return(NULL);
+	job = find_job(pamh);
+	if(inception_share_namespace(ctx, found->pw_uid, job, namespace_ttl))
+	{
+		free(job);
+		return(NULL);
+	}
+	return(job);
+}
+
+static uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec);
+}
+
 PAM_EXTERN int pam_sm_open_session(pam_handle_t* pamh, int flags,
 				int argc, const char** argv)
 {
-	image_config_t image;
+	inception_ctx_t* ctx;
+	image_config_t* image;
 	char* config_name = NULL;
+	char* job = NULL;
 	int ret = 0;
 	char* user = NULL;
+	uint64_t start = now_ns();
 	//FIXME (maybe): we're dropping a const here rather than moving everything 
 	//to a modern C dialect 
 	openlog("pam_inception", LOG_PID|LOG_NDELAY|LOG_NOWAIT, LOG_AUTH);
+	set_inception_log(&pilog);
+	parse_args(argc, argv);
 	config_name = (char*) pam_getenv(pamh, "PBS_INCEPTION_IMAGE");
-	print_env(environ);
 	if(!config_name)
 		config_name = (char*) pam_getenv(pamh, "INCEPTION_IMAGE");
 	if(!config_name)
@@ -81,27 +191,75 @@ PAM_EXTERN int pam_sm_open_session(pam_handle_t* pamh, int flags,
 		close_syslog();
 		return(PAM_SUCCESS);
 	}
-	memset(&image, 0, sizeof(image_config_t));
-	ret = parse_config(INCEPTION_CONFIG_PATH, config_name, &image);
-	if(ret != 0) 
+	//sshd outlives this session, so nothing below may exit or leak
+	ctx = inception_create(INCEPTION_CONFIG_PATH);
+	if(!ctx)
+	{
+		syslog(LOG_ERR, "Out of memory\n Inception FAILURE");
+		close_syslog();
+		return(PAM_SESSION_ERR);
+	}
+	ret = inception_load(ctx, config_name);
+	if(ret == INCEPTION_ERR_NOT_FOUND)
 	{
 		syslog(LOG_WARNING, 
 			"inception requested, but unable to find user: %s image: %s",
 			 user,
 			 config_name);
+		inception_free(ctx);
 		close_syslog();
 		return(PAM_SUCCESS);
 	}
-	else
+	else if(ret != 0)
 	{
-		syslog(LOG_WARNING, "containerizing user: %s image: %s", 
-			user,
-			config_name);
+		//a broken image must not turn into an uncontained session
+		syslog(LOG_ERR, "unable to load image: %s for user: %s: %s",
+			config_name, user, inception_strerror(ret));
+		inception_free(ctx);
+		close_syslog();
+		return(PAM_SESSION_ERR);
 	}
-	setup_namespace(&image);
-	close_syslog();
-	if(0)
+	job = share_namespace(pamh, ctx, user);
+	ret = inception_launch(ctx);
+	if(ret != 0)
+	{
+		syslog(LOG_ERR, "unable to containerize user: %s image: %s: %s",
+			user, config_name, inception_strerror(ret));
+		free(job);
+		inception_free(ctx);
+		close_syslog();
 		return(PAM_SESSION_ERR);
+	}
+	image = inception_image(ctx);
+	char** env = pam_getenvlist(pamh);
+	if(env)
+	{
+		size_t i;
+		if(apply_environ(image, env, &pam_unset_var, &pam_set_var, pamh))
+			syslog(LOG_WARNING, "unable to apply environment rules for image: %s",
+				config_name);
+		for(i=0;env[i];i++)
+			free(env[i]);
+		free(env);
+	}
+	char* cached = ld_cache_library_path(image, pam_getenv(pamh, "LD_LIBRARY_PATH"));
+	if(cached)
+	{
+		char* ld_env;
+		if(asprintf(&ld_env, "LD_LIBRARY_PATH=%s", cached) != -1)
+		{
+			pam_putenv(pamh, ld_env);
+			free(ld_env);
+		}
+		free(cached);
+	}
+	//one line per session, there can be hundreds a second
+	syslog(LOG_INFO, "containerized user: %s image: %s job: %s (%s namespace) in %.1f ms",
+		user, config_name, job ? job : "none",
+		image->ns_joined ? "joined" : "new", (now_ns() - start) / 1e6);
+	free(job);
+	inception_free(ctx);
+	close_syslog();
 	return(PAM_SUCCESS);
 }
 
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Per image CPU, memory and transparent hugepage placement
+ *
+ * An image's "placement" is applied to the launched process (and inherited
+ * by everything it execs) once it is inside the image:
+ *	"mempolicy": set_mempolicy() mode, with "mem_nodes" as its nodes
+ *	"cpus": "auto" splits the cpus we may use evenly between the node's
+ *		tasks, or a list of cpu lists indexed by local task id
+ *	"thp": "never" or "madvise" restricts transparent hugepages for the
+ *		process, "default" leaves the node's setting
+ * so tuned images perform the same on our dual socket nodes without every
+ * user wrapping their command in numactl/taskset.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <jansson.h>
+#include "inception.h"
+#include "inception_private.h"
+
+//<numaif.h> comes with libnuma, which we don't otherwise need
+#define PLACEMENT_MPOL_DEFAULT 0
+#define PLACEMENT_MPOL_PREFERRED 1
+#define PLACEMENT_MPOL_BIND 2
+#define PLACEMENT_MPOL_INTERLEAVE 3
+#define PLACEMENT_MPOL_LOCAL 4
+
+#define PLACEMENT_MAX_NODES 1024
+
+#ifndef PR_SET_THP_DISABLE
+#define PR_SET_THP_DISABLE 41
+#endif
+#ifndef PR_THP_DISABLE_EXCEPT_ADVISED
+#define PR_THP_DISABLE_EXCEPT_ADVISED (1 << 1)
+#endif
+
+/**
+ * @return MPOL_* mode for name, -1 if unknown
+ */
+static int placement_mpol(const char* name)
+{
+	if(strcmp(name, "default") == 0)
+		return(PLACEMENT_MPOL_DEFAULT);
+	if(strcmp(name, "preferred") == 0)
+		return(PLACEMENT_MPOL_PREFERRED);
+	if(strcmp(name, "bind") == 0)
+		return(PLACEMENT_MPOL_BIND);
+	if(strcmp(name, "interleave") == 0)
+		return(PLACEMENT_MPOL_INTERLEAVE);
+	if(strcmp(name, "local") == 0)
+		return(PLACEMENT_MPOL_LOCAL);
+	return(-1);
+}
+
+/**
+ * Parse a list like "0-3,8,10-11" calling set_bit() for every member below max
+ * (just check it if set_bit is NULL)
+ * @return 0 on success, -1 if malformed or out of range
+ */
+static int placement_list(const char* list, int max, void (*set_bit)(int bit, void* set),
+				void* set)
+{
+	const char* c = list;
+	if(!*c)
+		return(-1);
+	while(*c)
+	{
+		char* end;
+		long first, last;
+		first = last = strtol(c, &end, 10);
+		if(end == c || first < 0)
+			return(-1);
+		c = end;
+		if(*c == '-')
+		{
+			last = strtol(++c, &end, 10);
+			if(end == c || last < first)
+				return(-1);
+			c = end;
+		}
+		if(last >= max)
+			return(-1);
+		for(;set_bit && first<=last;first++)
+			set_bit(first, set);
+		if(*c == ',')
+			c++;
+		else if(*c)
+			return(-1);
+	}
+	return(0);
+}
+
+static void set_cpu(int cpu, void* set)
+{
+	CPU_SET(cpu, (cpu_set_t*) set);
+}
+
+static void set_node(int node, void* set)
+{
+	unsigned long* mask = (unsigned long*) set;
+	mask[node / (8*sizeof(unsigned long))] |= 1ul << (node % (8*sizeof(unsigned long)));
+}
+
+int placement_from_json(json_t* placement, image_config_t* image)
+{
+	json_t* cpus = json_object_get(placement, "cpus");
+	const char* mempolicy = json_string_value(json_object_get(placement, "mempolicy"));
+	const char* mem_nodes = json_string_value(json_object_get(placement, "mem_nodes"));
+	const char* thp = json_string_value(json_object_get(placement, "thp"));
+	size_t index;
+	json_t* entry;
+
+	if(!json_is_object(placement) ||
+		(json_object_get(placement, "mempolicy") && !mempolicy) ||
+		(json_object_get(placement, "mem_nodes") && !mem_nodes) ||
+		(json_object_get(placement, "thp") && !thp))
+	{
+		elog("Error: Malformed placement\n");
+		return(-128);
+	}
+	if(mempolicy)
+	{
+		int mode = placement_mpol(mempolicy);
+		int needs_nodes = mode == PLACEMENT_MPOL_PREFERRED ||
+			mode == PLACEMENT_MPOL_BIND || mode == PLACEMENT_MPOL_INTERLEAVE;
+		if(mode < 0 || needs_nodes != (mem_nodes != NULL) || (mem_nodes &&
+			placement_list(mem_nodes, PLACEMENT_MAX_NODES, NULL, NULL)))
+		{
+			elog("Error: placement mempolicy %s needs %s\n", mempolicy,
+				needs_nodes ? "a mem_nodes list" : "no mem_nodes");
+			return(-128);
+		}
+		asprintf(&(image->mempolicy), "%s", mempolicy);
+		if(mem_nodes)
+			asprintf(&(image->mem_nodes), "%s", mem_nodes);
+	}
+	else if(mem_nodes)
+	{
+		elog("Error: placement mem_nodes needs a mempolicy\n");
+		return(-128);
+	}
+	if(thp)
+	{
+		if(strcmp(thp, "never") && strcmp(thp, "madvise") && strcmp(thp, "default"))
+		{
+			elog("Error: placement thp must be never, madvise or default\n");
+			return(-128);
+		}
+		asprintf(&(image->thp), "%s", thp);
+	}
+	if(json_is_string(cpus) && strcmp(json_string_value(cpus), "auto") == 0)
+	{
+		image->cpu_map = (char**) malloc(sizeof(char*));
+		asprintf(&((image->cpu_map)[0]), "auto");
+		image->num_cpu_map = 1;
+	}
+	else if(json_is_array(cpus) && json_array_size(cpus))
+	{
+		image->cpu_map = (char**) malloc(sizeof(char*)*json_array_size(cpus));
+		json_array_foreach(cpus, index, entry)
+		{
+			cpu_set_t set;
+			const char* cpus_s = json_string_value(entry);
+			CPU_ZERO(&set);
+			if(!cpus_s || placement_list(cpus_s, CPU_SETSIZE, set_cpu, &set))
+			{
+				elog("Error: Malformed placement cpu list\n");
+				return(-128);
+			}
+			asprintf(&((image->cpu_map)[index]), "%s", cpus_s);
+			image->num_cpu_map = index + 1;
+		}
+	}
+	else if(cpus)
+	{
+		elog("Error: placement cpus must be \"auto\" or a list of cpu lists\n");
+		return(-128);
+	}
+	return(0);
+}
+
+/**
+ * The cpus of local_task when the cpus we may use are split evenly between
+ * local_tasks tasks
+ * @return 0 on success
+ */
+static int placement_auto_cpus(int local_task, int local_tasks, cpu_set_t* set)
+{
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE];
+	int ncpus = 0;
+	int first, last, i;
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed))
+		return(-1);
+	for(i=0;i<CPU_SETSIZE;i++)
+	{
+		if(CPU_ISSET(i, &allowed))
+			cpus[ncpus++] = i;
+	}
+	if(!ncpus)
+		return(-1);
+	CPU_ZERO(set);
+	//more tasks than cpus: share them round robin
+	if(local_tasks > ncpus)
+	{
+		CPU_SET(cpus[local_task % ncpus], set);
+		return(0);
+	}
+	first = (int) ((long) local_task * ncpus / local_tasks);
+	last = (int) ((long) (local_task + 1) * ncpus / local_tasks);
+	for(i=first;i<last;i++)
+		CPU_SET(cpus[i], set);
+	return(0);
+}
+
+int apply_placement(image_config_t* image, int local_task, int local_tasks)
+{
+	int ret = 0;
+
+	if(image->mempolicy)
+	{
+		unsigned long nodes[PLACEMENT_MAX_NODES / (8*sizeof(unsigned long))];
+		memset(nodes, 0, sizeof(nodes));
+		if(image->mem_nodes)
+			placement_list(image->mem_nodes, PLACEMENT_MAX_NODES, set_node, nodes);
+		if(syscall(SYS_set_mempolicy, placement_mpol(image->mempolicy),
+			image->mem_nodes ? nodes : NULL,
+			image->mem_nodes ? PLACEMENT_MAX_NODES + 1 : 0))
+		{
+			elog("Unable to set memory policy %s %s: %s\n", image->mempolicy,
+				image->mem_nodes ? image->mem_nodes : "", strerror(errno));
+			ret = -1;
+		}
+	}
+	if(image->num_cpu_map)
+	{
+		cpu_set_t set;
+		int have_set = 0;
+		CPU_ZERO(&set);
+		if(strcmp(image->cpu_map[0], "auto") == 0)
+		{
+			if(local_task >= 0 && local_tasks > 0 && local_task < local_tasks)
+				have_set = placement_auto_cpus(local_task, local_tasks, &set) == 0;
+		}
+		else if(local_task >= 0 || image->num_cpu_map == 1)
+		{
+			const char* cpus = image->cpu_map[local_task >= 0 ?
+				(size_t) local_task % image->num_cpu_map : 0];
+			have_set = placement_list(cpus, CPU_SETSIZE, set_cpu, &set) == 0;
+		}
+		//a task we can't place runs wherever it was going to
+		if(have_set && sched_setaffinity(0, sizeof(set), &set))
+		{
+			elog("Unable to set cpu affinity for task %d: %s\n", local_task,
+				strerror(errno));
+			ret = -1;
+		}
+	}
+	if(image->thp && strcmp(image->thp, "default"))
+	{
+		//"madvise" needs Linux 6.18, older kernels say EINVAL
+		unsigned long how = strcmp(image->thp, "madvise") == 0 ?
+			PR_THP_DISABLE_EXCEPT_ADVISED : 0;
+		if(prctl(PR_SET_THP_DISABLE, 1, how, 0, 0))
+		{
+			elog("Unable to set transparent hugepages to %s: %s\n", image->thp,
+				strerror(errno));
+			ret = -1;
+		}
+	}
+	return(ret);
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Mount planning
+ *
+ * Images list dozens of bind mounts in whatever order they were written,
+ * often nested or redundant, and every one costs stats to check it and a
+ * mount() at every launch. plan_mounts() runs between loading and checking
+ * and rewrites the list into one that builds the same tree:
+ *	- paths are normalized ("//", "/./" and trailing '/' collapse), so
+ *	  equal paths compare equal
+ *	- a mount hidden by a later mount on the same or a parent target is
+ *	  dropped, it could never be seen. Once those are gone every parent
+ *	  target is mounted before its children.
+ *	- a bind of a path inside an earlier bind, mirroring it on both sides
+ *	  ("/a" -> "/x" then "/a/b" -> "/x/b"), is dropped when "/a/b" isn't a
+ *	  mount of its own: the parent bind already shows it
+ *	- a bind whose children are binds of exactly the host mounts below it
+ *	  becomes one recursive bind ("rbind") of the parent. Only when no host
+ *	  mount below it is missing from the list, so nothing the image didn't
+ *	  ask for becomes visible.
+ * Anything it can't prove (symlinked sources, a kernel without
+ * STATX_ATTR_MOUNT_ROOT) is left as written.
+ *
+ * Planning stats sources and may read the whole host mount table, so
+ * check_image() only plans on a check cache miss and keeps the planned list
+ * in the check cache entry (see checkcache.c). image->plan counts what it
+ * saved and what it cost.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "inception.h"
+#include "inception_private.h"
+
+/**
+ * Collapse "//", "/./" and a trailing '/' in place
+ * @return nonzero if path changed
+ */
+static int plan_normalize(char* path)
+{
+	char* in = path;
+	char* out = path;
+	size_t len = strlen(path);
+	while(*in)
+	{
+		if(in[0] == '/' && (in[1] == '/' || (in[1] == '.' && (in[2] == '/' || !in[2]))))
+		{
+			in += in[1] == '/' ? 1 : 2;
+			continue;
+		}
+		*out++ = *in++;
+	}
+	if(out > path + 1 && out[-1] == '/')
+		out--;
+	if(out == path)
+		*out++ = '/';
+	*out = '\0';
+	return(strlen(path) != len);
+}
+
+/**
+ * @return the rest of path ("" or "/...") if it is parent or below it, else
+ * NULL
+ */
+static const char* plan_under(const char* parent, const char* path)
+{
+	size_t len = strlen(parent);
+	if(strcmp(parent, "/") == 0)
+		return(strcmp(path, "/") == 0 ? "" : path);
+	if(strncmp(parent, path, len) || (path[len] && path[len] != '/'))
+		return(NULL);
+	return(path + len);
+}
+
+/**
+ * @return nonzero if mount j shows what mount i shows at the same relative
+ * path: both binds and from/to of j are the same child path of i's
+ */
+static int plan_mirrors(image_config_t* image, size_t i, size_t j)
+{
+	const char* from_rest;
+	const char* to_rest;
+	if(!mount_is_bind(image->mount_type[i]) || !mount_is_bind(image->mount_type[j]))
+		return(0);
+	from_rest = plan_under(image->mount_from[i], image->mount_from[j]);
+	to_rest = plan_under(image->mount_to[i], image->mount_to[j]);
+	return(from_rest && to_rest && *from_rest && strcmp(from_rest, to_rest) == 0);
+}
+
+/**
+ * @return nonzero if a mount between i and j lands on j's target or above it
+ * (below i's), so what i shows at j's target isn't the same
+ */
+static int plan_obscured(image_config_t* image, const char* drop, size_t i, size_t j)
+{
+	size_t k;
+	for(k=i+1;k<j;k++)
+	{
+		if(!drop[k] && plan_under(image->mount_to[k], image->mount_to[j]))
+			return(1);
+	}
+	return(0);
+}
+
+/**
+ * @return nonzero if path has no symlinks in it, so the bind of a parent shows
+ * the same file at the same relative path
+ */
+static int plan_canonical(inception_plan_t* plan, const char* path)
+{
+	const char* c;
+	char* real = realpath(path, NULL);
+	int ret = real && strcmp(real, path) == 0;
+	free(real);
+	//realpath() lstat()s every component
+	for(c=path;*c;c++)
+		if(*c == '/' && c[1] && c[1] != '/')
+			plan->plan_stats++;
+	return(ret);
+}
+
+/**
+ * @return 1 if path is the root of a mount, 0 if not, -1 if we can't tell
+ */
+static int plan_mount_root(inception_plan_t* plan, const char* path)
+{
+#ifdef STATX_ATTR_MOUNT_ROOT
+	struct statx stx;
+	plan->plan_stats++;
+	if(statx(AT_FDCWD, path, 0, STATX_BASIC_STATS, &stx) ||
+		!(stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT))
+		return(-1);
+	return((stx.stx_attributes & STATX_ATTR_MOUNT_ROOT) != 0);
+#else
+	(void) plan;
+	(void) path;
+	return(-1);
+#endif
+}
+
+/**
+ * Read the mount points of our (the host's) namespace
+ * @return NULL terminated array or NULL, free with plan_free_mounts()
+ */
+static char** plan_host_mounts(inception_plan_t* plan)
+{
+	FILE* mountinfo = fopen("/proc/self/mountinfo", "re");
+	char** mounts = NULL;
+	char* line = NULL;
+	size_t cap = 0, n = 0, size = 0;
+	if(!mountinfo)
+		return(NULL);
+	while(getline(&line, &cap, mountinfo) != -1)
+	{
+		char point[4096];
+		char* in;
+		char* out;
+		//id parent major:minor root mount_point ...
+		plan->mountinfo_entries++;
+		if(sscanf(line, "%*s %*s %*s %*s %4095s", point) != 1)
+			continue;
+		//spaces and friends are octal escaped
+		for(in=point, out=point;*in;out++)
+		{
+			if(in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] && in[3])
+			{
+				*out = (char) (((in[1]-'0') << 6) | ((in[2]-'0') << 3) | (in[3]-'0'));
+				in += 4;
+			}
+			else
+			{
+				*out = *in++;
+			}
+		}
+		*out = '\0';
+		if(n + 2 > size)
+		{
+			char** grown;
+			size = size ? size*2 : 256;
+			grown = (char**) realloc(mounts, sizeof(char*)*size);
+			if(!grown)
+				break;
+			mounts = grown;
+		}
+		mounts[n] = strdup(point);
+		if(!mounts[n])
+			break;
+		mounts[++n] = NULL;
+	}
+	free(line);
+	fclose(mountinfo);
+	return(mounts);
+}
+
+static void plan_free_mounts(char** mounts)
+{
+	char** m;
+	for(m=mounts;m && *m;m++)
+		free(*m);
+	free(mounts);
+}
+
+/**
+ * Turn bind i into a recursive bind if its children in the list are binds of
+ * exactly the host mounts below its source
+ * @return number of child mounts that became redundant
+ */
+static size_t plan_merge(image_config_t* image, char* drop, size_t i, char*** host_mounts)
+{
+	size_t j, merged = 0;
+	char** m;
+	int children = 0;
+
+	if(strcasecmp(image->mount_type[i], "bind"))
+		return(0);
+	for(j=i+1;j<image->num_mounts;j++)
+	{
+		if(!drop[j] && plan_mirrors(image, i, j))
+			children++;
+	}
+	if(!children)
+		return(0);
+	if(!*host_mounts)
+		*host_mounts = plan_host_mounts(&image->plan);
+	if(!*host_mounts)
+		return(0);
+	//every host mount below the source has to be one of the children
+	for(m=*host_mounts;*m;m++)
+	{
+		const char* rest = plan_under(image->mount_from[i], *m);
+		if(!rest || !*rest)
+			continue;
+		for(j=i+1;j<image->num_mounts;j++)
+		{
+			if(!drop[j] && plan_mirrors(image, i, j) &&
+				strcmp(image->mount_from[j], *m) == 0 &&
+				!plan_obscured(image, drop, i, j))
+				break;
+		}
+		if(j == image->num_mounts)
+			return(0);
+	}
+	//and every child has to be one of them, of a type check_image() allows
+	for(j=i+1;j<image->num_mounts;j++)
+	{
+		struct stat st;
+		if(drop[j] || !plan_mirrors(image, i, j))
+			continue;
+		for(m=*host_mounts;*m && strcmp(*m, image->mount_from[j]);m++);
+		if(*m)
+			image->plan.plan_stats++;
+		if(!*m || stat(image->mount_from[j], &st) ||
+			!(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+			return(0);
+	}
+	for(j=i+1;j<image->num_mounts;j++)
+	{
+		if(!drop[j] && plan_mirrors(image, i, j))
+		{
+			drop[j] = 1;
+			merged++;
+		}
+	}
+	free(image->mount_type[i]);
+	asprintf(&(image->mount_type[i]), "rbind");
+	return(merged);
+}
+
+/**
+ * Stats check_image() makes to check the mounts: source and destination of
+ * binds, the destination of the rest
+ */
+static size_t plan_check_stats(const image_config_t* image)
+{
+	size_t i, stats = 0;
+	for(i=0;i<image->num_mounts;i++)
+		stats += mount_is_bind(image->mount_type[i]) ? 2 : 1;
+	return(stats);
+}
+
+int plan_mounts(image_config_t* image)
+{
+	inception_plan_t* plan = &image->plan;
+	char** host_mounts = NULL;
+	inception_span_t span;
+	size_t i, j, kept;
+	char* drop;
+
+	memset(plan, 0, sizeof(inception_plan_t));
+	plan->mounts_in = image->num_mounts;
+	//the check cache key stats every configured source either way
+	plan->stats_in = image->num_mounts + plan_check_stats(image);
+	if(!image->num_mounts)
+		return(0);
+	drop = (char*) calloc(image->num_mounts, 1);
+	if(!drop)
+		return(-1);
+	inception_span_begin(&span, "plan_mounts");
+	for(i=0;i<image->num_mounts;i++)
+	{
+		int changed = plan_normalize(image->mount_to[i]);
+		if(mount_is_bind(image->mount_type[i]))
+			changed |= plan_normalize(image->mount_from[i]);
+		if(changed)
+			plan->normalized++;
+	}
+	//hidden by a later mount on the same target or above it
+	for(i=0;i<image->num_mounts;i++)
+	{
+		for(j=i+1;j<image->num_mounts;j++)
+		{
+			if(plan_under(image->mount_to[j], image->mount_to[i]))
+			{
+				drop[i] = 1;
+				plan->shadowed++;
+				break;
+			}
+		}
+	}
+	//already shown by an earlier bind of its parent
+	for(j=0;j<image->num_mounts;j++)
+	{
+		for(i=0;!drop[j] && i<j;i++)
+		{
+			if(!drop[i] && plan_mirrors(image, i, j) &&
+				!plan_obscured(image, drop, i, j) &&
+				plan_canonical(plan, image->mount_from[j]) &&
+				plan_mount_root(plan, image->mount_from[j]) == 0)
+			{
+				drop[j] = 1;
+				plan->covered++;
+			}
+		}
+	}
+	for(i=0;i<image->num_mounts;i++)
+	{
+		if(!drop[i])
+			plan->merged += plan_merge(image, drop, i, &host_mounts);
+	}
+	plan_free_mounts(host_mounts);
+
+	for(i=0, kept=0;i<image->num_mounts;i++)
+	{
+		if(drop[i])
+		{
+			free(image->mount_from[i]);
+			free(image->mount_to[i]);
+			free(image->mount_type[i]);
+			free(image->mount_options[i]);
+			continue;
+		}
+		image->mount_from[kept] = image->mount_from[i];
+		image->mount_to[kept] = image->mount_to[i];
+		image->mount_type[kept] = image->mount_type[i];
+		image->mount_options[kept] = image->mount_options[i];
+		kept++;
+	}
+	image->num_mounts = kept;
+	free(drop);
+	plan->stats_out = plan->mounts_in + plan_check_stats(image);
+	inception_span_end(&span, image->name);
+	if(plan->shadowed || plan->covered || plan->merged)
+		stats_record("plan_dropped", NULL, plan->mounts_in - image->num_mounts);
+	return(0);
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Page cache prewarming
+ *
+ * Cold starts of big images are dominated by page faults that pull shared
+ * libraries and python modules off the parallel filesystem one page at a
+ * time. prewarm_image() takes a manifest of the files a job will touch and
+ * has a small pool of threads readahead() them (in manifest order, so the
+ * hottest files go first) until a memory budget is used up, e.g. from a job
+ * prolog so the first rank finds them in the page cache.
+ *
+ * Manifest lines are paths inside the image, optionally followed by tab
+ * separated fields that are ignored here (see record.c). Blank lines and
+ * lines starting with '#' are skipped.
+ * Paths are resolved inside the image root (or the layers, top down) as the
+ * image would see them, so absolute symlinks don't lead back to the host.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define PREWARM_MAX_WORKERS 64
+#define PREWARM_DEFAULT_WORKERS 16
+
+#ifndef RESOLVE_NO_MAGICLINKS
+#define RESOLVE_NO_MAGICLINKS 0x02
+#endif
+#ifndef RESOLVE_IN_ROOT
+#define RESOLVE_IN_ROOT 0x10
+#endif
+
+//private copy of the uapi struct, see mountfd.c
+struct prewarm_open_how
+{
+	uint64_t flags;
+	uint64_t mode;
+	uint64_t resolve;
+};
+
+struct prewarm_job
+{
+	pthread_mutex_t lock;
+	char** paths;
+	size_t num_paths;
+	size_t next;
+	int* root_fds; //top layer first
+	size_t num_roots;
+	uint64_t remaining; //budget left
+	int no_openat2;
+	inception_prewarm_t* result;
+};
+
+/**
+ * Open path (an in-image path) read only from the first root that has it
+ * @return fd or -1
+ */
+static int prewarm_open(struct prewarm_job* job, const char* path)
+{
+	size_t i;
+	int fd = -1;
+	while(*path == '/')
+		path++;
+	for(i=0;i<job->num_roots && fd < 0;i++)
+	{
+#ifdef SYS_openat2
+		if(!job->no_openat2)
+		{
+			struct prewarm_open_how how;
+			memset(&how, 0, sizeof(how));
+			how.flags = O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NONBLOCK;
+			how.resolve = RESOLVE_IN_ROOT|RESOLVE_NO_MAGICLINKS;
+			fd = syscall(SYS_openat2, job->root_fds[i], path, &how, sizeof(how));
+			if(fd >= 0 || errno != ENOSYS)
+				continue;
+			job->no_openat2 = 1;
+		}
+#endif
+		fd = openat(job->root_fds[i], path, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NONBLOCK);
+	}
+	return(fd);
+}
+
+static void* prewarm_worker(void* arg)
+{
+	struct prewarm_job* job = (struct prewarm_job*) arg;
+	inception_prewarm_t* result = job->result;
+	while(1)
+	{
+		struct stat st;
+		uint64_t len;
+		size_t i;
+		int fd;
+
+		pthread_mutex_lock(&job->lock);
+		if(job->next >= job->num_paths || job->remaining == 0)
+		{
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		fd = prewarm_open(job, job->paths[i]);
+		if(fd >= 0 && (fstat(fd, &st) || !S_ISREG(st.st_mode)))
+		{
+			close(fd);
+			fd = -1;
+		}
+		pthread_mutex_lock(&job->lock);
+		if(fd < 0)
+		{
+			result->missing++;
+			pthread_mutex_unlock(&job->lock);
+			continue;
+		}
+		len = (uint64_t) st.st_size;
+		if(len > job->remaining)
+		{
+			len = job->remaining;
+			result->truncated++;
+		}
+		job->remaining -= len;
+		result->files++;
+		result->bytes += len;
+		pthread_mutex_unlock(&job->lock);
+
+		//readahead() refuses some filesystems that still honour fadvise()
+		if(len && readahead(fd, 0, len))
+			posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+	return(NULL);
+}
+
+/**
+ * @return half of MemAvailable, the default budget
+ */
+static uint64_t prewarm_default_budget()
+{
+	FILE* meminfo = fopen("/proc/meminfo", "re");
+	char line[128];
+	unsigned long long kb = 0;
+	if(meminfo)
+	{
+		while(fgets(line, sizeof(line), meminfo))
+		{
+			if(sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+				break;
+		}
+		fclose(meminfo);
+	}
+	if(!kb)
+		kb = (unsigned long long) sysconf(_SC_AVPHYS_PAGES) * (sysconf(_SC_PAGESIZE) / 1024);
+	return((uint64_t) kb * 1024 / 2);
+}
+
+/**
+ * Read the manifest's paths
+ * @return 0 on success
+ */
+static int prewarm_read_manifest(FILE* manifest, struct prewarm_job* job)
+{
+	char* line = NULL;
+	size_t line_len = 0;
+	size_t alloced = 0;
+	ssize_t len;
+	while((len = getline(&line, &line_len, manifest)) != -1)
+	{
+		char* end = line + strcspn(line, "\t\n");
+		char* path;
+		*end = '\0';
+		if(!*line || *line == '#')
+			continue;
+		if(job->num_paths == alloced)
+		{
+			char** paths;
+			alloced = alloced ? alloced*2 : 256;
+			paths = (char**) realloc(job->paths, sizeof(char*)*alloced);
+			if(!paths)
+				break;
+			job->paths = paths;
+		}
+		path = strdup(line);
+		if(!path)
+			break;
+		job->paths[job->num_paths++] = path;
+	}
+	free(line);
+	return(ferror(manifest) || len != -1 ? -1 : 0);
+}
+
+int prewarm_image(image_config_t* image, FILE* manifest, inception_prewarm_t* prewarm)
+{
+	struct prewarm_job job;
+	pthread_t threads[PREWARM_MAX_WORKERS];
+	inception_span_t span;
+	struct timespec start, end;
+	size_t i;
+	int workers, started = 0, ret = 0;
+
+	memset(&job, 0, sizeof(job));
+	pthread_mutex_init(&job.lock, NULL);
+	job.result = prewarm;
+	prewarm->files = prewarm->missing = prewarm->truncated = 0;
+	prewarm->bytes = 0;
+	job.remaining = prewarm->budget ? prewarm->budget : prewarm_default_budget();
+	workers = prewarm->workers;
+	if(workers <= 0)
+	{
+		workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if(workers > PREWARM_DEFAULT_WORKERS)
+			workers = PREWARM_DEFAULT_WORKERS;
+	}
+	if(workers <= 0)
+		workers = 1;
+	if(workers > PREWARM_MAX_WORKERS)
+		workers = PREWARM_MAX_WORKERS;
+
+	if(prewarm_read_manifest(manifest, &job))
+	{
+		elog("Error reading prewarm manifest\n");
+		ret = -2;
+		goto out;
+	}
+	job.num_roots = image->num_layers ? image->num_layers : 1;
+	job.root_fds = (int*) malloc(sizeof(int)*job.num_roots);
+	if(!job.root_fds)
+	{
+		ret = -1;
+		goto out;
+	}
+	for(i=0;i<job.num_roots;i++)
+	{
+		const char* root = image->num_layers ?
+			image->layers[image->num_layers-1-i] : image->imgroot;
+		job.root_fds[i] = open(root, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if(job.root_fds[i] < 0)
+		{
+			elog("Unable to open image root %s: %s\n", root, strerror(errno));
+			job.num_roots = i;
+			ret = -4;
+			goto out;
+		}
+	}
+	if((size_t) workers > job.num_paths)
+		workers = job.num_paths ? job.num_paths : 1;
+
+	inception_span_begin(&span, "prewarm");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0;i<(size_t) workers;i++)
+	{
+		if(pthread_create(&threads[i], NULL, prewarm_worker, &job))
+			break;
+		started++;
+	}
+	//nothing started, do it ourselves
+	if(!started)
+		prewarm_worker(&job);
+	for(i=0;i<(size_t) started;i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	prewarm->workers = started ? started : 1;
+	prewarm->elapsed_ns = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000ull +
+		end.tv_nsec - start.tv_nsec;
+	stats_record("prewarm", image->name, inception_span_end(&span, image->name));
+	//paths we never got to because the budget ran out
+	prewarm->skipped = job.num_paths - job.next;
+out:
+	for(i=0;i<job.num_roots;i++)
+		close(job.root_fds[i]);
+	free(job.root_fds);
+	for(i=0;i<job.num_paths;i++)
+		free(job.paths[i]);
+	free(job.paths);
+	pthread_mutex_destroy(&job.lock);
+	return(ret);
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * File access recorder
+ *
+ * inception -r runs a command in the image and writes out which files of
+ * the image it opened, in the order they were first opened, as a manifest
+ * prewarm_image() (and whoever packs or stages the image) can use.
+ *
+ * The image root's mount in the new namespace gets a fanotify mount mark
+ * while we are still root, just before the chroot. Only opens through that
+ * mount are reported, so the bind mounted host paths (and every other
+ * namespace) stay out of the recording. The launching process then forks:
+ * the child runs the command as usual and the parent, chrooted and with
+ * the user's permissions like the child, reads the events until the child
+ * exits. Event paths come from /proc/self/fd (opened before the chroot) and
+ * read relative to our root, so they are already paths inside the image.
+ *
+ * Each line is "path<TAB>size<TAB>microseconds since the recording
+ * started", where the time is when we saw the first open, not the open
+ * itself.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/fanotify.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define RECORD_EVENT_BUF 65536
+#define RECORD_POLL_MS 100
+
+struct inception_recorder
+{
+	int fan_fd;
+	int proc_fd_dir; //our /proc/<pid>/fd
+	FILE* out;
+	uint64_t start_ns;
+	//paths already written, open addressed on an FNV-1a hash
+	char** seen;
+	size_t seen_size;
+	size_t seen_count;
+	size_t overflows;
+};
+
+static uint64_t record_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static uint64_t record_hash(const char* str)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for(; *str; str++)
+	{
+		hash ^= (unsigned char) *str;
+		hash *= 1099511628211ull;
+	}
+	return(hash);
+}
+
+/**
+ * Add path to the seen set
+ * @return 1 if it was new, 0 if seen before, -1 if out of memory
+ */
+static int record_first_touch(inception_recorder_t* rec, const char* path)
+{
+	size_t i, mask;
+	if((rec->seen_count + 1) * 2 > rec->seen_size)
+	{
+		size_t size = rec->seen_size ? rec->seen_size*2 : 1024;
+		char** seen = (char**) calloc(size, sizeof(char*));
+		if(!seen)
+			return(-1);
+		for(i=0;i<rec->seen_size;i++)
+		{
+			size_t j;
+			if(!rec->seen[i])
+				continue;
+			for(j=record_hash(rec->seen[i]) & (size-1);seen[j];j=(j+1) & (size-1));
+			seen[j] = rec->seen[i];
+		}
+		free(rec->seen);
+		rec->seen = seen;
+		rec->seen_size = size;
+	}
+	mask = rec->seen_size - 1;
+	for(i=record_hash(path) & mask;rec->seen[i];i=(i+1) & mask)
+	{
+		if(strcmp(rec->seen[i], path) == 0)
+			return(0);
+	}
+	rec->seen[i] = strdup(path);
+	if(!rec->seen[i])
+		return(-1);
+	rec->seen_count++;
+	return(1);
+}
+
+inception_recorder_t* recorder_open(const char* path)
+{
+	inception_recorder_t* rec;
+	uid_t old_fsuid;
+	gid_t old_fsgid;
+	int fd;
+
+	rec = (inception_recorder_t*) calloc(1, sizeof(inception_recorder_t));
+	if(!rec)
+		return(NULL);
+	rec->proc_fd_dir = -1;
+	rec->fan_fd = fanotify_init(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK,
+				O_RDONLY|O_LARGEFILE|O_CLOEXEC);
+	if(rec->fan_fd < 0)
+	{
+		elog("Unable to start recording file accesses: %s\n", strerror(errno));
+		free(rec);
+		return(NULL);
+	}
+	//we are usually still setuid root here, the file is the user's
+	old_fsgid = setfsgid(getgid());
+	old_fsuid = setfsuid(getuid());
+	fd = open(path, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0644);
+	setfsuid(old_fsuid);
+	setfsgid(old_fsgid);
+	rec->out = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if(!rec->out)
+	{
+		elog("Unable to open %s: %s\n", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		close(rec->fan_fd);
+		free(rec);
+		return(NULL);
+	}
+	rec->start_ns = record_now();
+	return(rec);
+}
+
+int recorder_mark(inception_recorder_t* rec, const char* imgroot)
+{
+	uint64_t mask = FAN_OPEN;
+	int ret;
+#ifdef FAN_OPEN_EXEC
+	mask |= FAN_OPEN_EXEC;
+#endif
+	ret = fanotify_mark(rec->fan_fd, FAN_MARK_ADD|FAN_MARK_MOUNT, mask, AT_FDCWD, imgroot);
+	//FAN_OPEN_EXEC needs 5.0
+	if(ret && errno == EINVAL && mask != FAN_OPEN)
+		ret = fanotify_mark(rec->fan_fd, FAN_MARK_ADD|FAN_MARK_MOUNT, FAN_OPEN,
+					AT_FDCWD, imgroot);
+	if(ret)
+	{
+		elog("Unable to watch %s: %s\n", imgroot, strerror(errno));
+		return(-1);
+	}
+	rec->proc_fd_dir = open("/proc/self/fd", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(rec->proc_fd_dir < 0)
+	{
+		elog("Unable to open /proc/self/fd: %s\n", strerror(errno));
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * Write down every new file in one buffer of events
+ */
+static void record_events(inception_recorder_t* rec, char* buf, ssize_t len)
+{
+	struct fanotify_event_metadata* event = (struct fanotify_event_metadata*) buf;
+	for(;FAN_EVENT_OK(event, len);event = FAN_EVENT_NEXT(event, len))
+	{
+		char fd_name[16];
+		char path[PATH_MAX];
+		struct stat st;
+		ssize_t path_len;
+
+		if(event->vers != FANOTIFY_METADATA_VERSION)
+			break;
+		if(event->mask & FAN_Q_OVERFLOW)
+			rec->overflows++;
+		if(event->fd < 0)
+			continue;
+		snprintf(fd_name, sizeof(fd_name), "%d", event->fd);
+		path_len = readlinkat(rec->proc_fd_dir, fd_name, path, sizeof(path)-1);
+		if(path_len > 0 && path[0] == '/' && fstat(event->fd, &st) == 0 &&
+			S_ISREG(st.st_mode))
+		{
+			path[path_len] = '\0';
+			//can't be represented in the manifest
+			if(!strpbrk(path, "\t\n") && record_first_touch(rec, path) == 1)
+				fprintf(rec->out, "%s\t%lld\t%llu\n", path, (long long) st.st_size,
+					(unsigned long long) (record_now() - rec->start_ns) / 1000);
+		}
+		close(event->fd);
+	}
+}
+
+/**
+ * Read whatever events are queued
+ */
+static void record_drain(inception_recorder_t* rec)
+{
+	//an array of the metadata keeps the buffer aligned for it
+	struct fanotify_event_metadata buf[RECORD_EVENT_BUF / sizeof(struct fanotify_event_metadata)];
+	ssize_t len;
+	while((len = read(rec->fan_fd, buf, sizeof(buf))) > 0)
+		record_events(rec, (char*) buf, len);
+}
+
+int recorder_run(inception_recorder_t* rec, image_config_t* image, pid_t child)
+{
+	struct pollfd fds[2];
+	inception_span_t span;
+	int nfds = 1, status = 0, pid_fd = -1;
+	pid_t ret;
+
+	inception_span_begin(&span, "record");
+	fprintf(rec->out, "# files of image %s in the order they were first opened\n",
+		image->name ? image->name : "");
+	fprintf(rec->out, "# path\tsize\tfirst open (us)\n");
+	fds[0].fd = rec->fan_fd;
+	fds[0].events = POLLIN;
+#ifdef SYS_pidfd_open
+	pid_fd = syscall(SYS_pidfd_open, child, 0);
+#endif
+	if(pid_fd >= 0)
+	{
+		fds[1].fd = pid_fd;
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+	while(1)
+	{
+		record_drain(rec);
+		ret = waitpid(child, &status, WNOHANG);
+		if(ret == child || (ret < 0 && errno != EINTR))
+			break;
+		//without a pidfd we only notice the exit when we look
+		poll(fds, nfds, pid_fd >= 0 ? -1 : RECORD_POLL_MS);
+	}
+	//opens that happened just before the exit
+	record_drain(rec);
+	if(rec->overflows)
+		fprintf(rec->out, "# the event queue overflowed %zu times, files are missing\n",
+			rec->overflows);
+	stats_record("record", image->name, inception_span_end(&span, image->name));
+	if(pid_fd >= 0)
+		close(pid_fd);
+	if(ret != child)
+		return(-1);
+	return(status);
+}
+
+void recorder_free(inception_recorder_t* rec)
+{
+	size_t i;
+	if(!rec)
+		return;
+	if(rec->out)
+		fclose(rec->out);
+	if(rec->fan_fd >= 0)
+		close(rec->fan_fd);
+	if(rec->proc_fd_dir >= 0)
+		close(rec->proc_fd_dir);
+	for(i=0;i<rec->seen_size;i++)
+		free(rec->seen[i]);
+	free(rec->seen);
+	free(rec);
+}
@@ -29,8 +29,10 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -44,6 +46,10 @@ SPANK_PLUGIN(inception, 1);
 
 char* image;
 
+//built once per node per step in slurmstepd, every task joins it
+static inception_ctx_t* step_ctx = NULL;
+static int step_ns_fd = -1;
+
 int validate_opts(int val, const char* optarg, int remote)
 {
 	//S_CTX_REMOTE is slurmstepd, so we pretend it's ok to leak memory
@@ -68,11 +74,32 @@ struct spank_option image_opt =
 	(spank_opt_cb_f) validate_opts
 };	
 
+static inline void silog(const char* format, va_list ap)
+{
+	//log_msg(6, format, ap);
+	//6 -> LOG_LEVEL_DEBUG (this isn't part of the public api)
+	char* tagged_fmt;
+	asprintf(&tagged_fmt, "slurm-inception: %s", format);
+	vsyslog(LOG_WARNING, tagged_fmt, ap);
+	free(tagged_fmt);
+}
+
 int slurm_spank_init(spank_t sp, int ac, char** av)
 {
 	spank_err_t err;
+	int i;
 	image = NULL;
 	err = spank_option_register(sp, &image_opt);
+	//plugstack.conf arguments: "trace" logs launch phase timings through
+	//silog, "trace=/path" appends trace events to /path
+	for(i=0;i<ac && spank_context() == S_CTX_REMOTE;i++)
+	{
+		set_inception_log(&silog);
+		if(strcmp(av[i], "trace") == 0)
+			inception_trace_log(1);
+		else if(strncmp(av[i], "trace=", 6) == 0)
+			inception_trace_open(av[i] + 6);
+	}
 	if(spank_context() == S_CTX_ALLOCATOR)
 	{
 		//sbatch/salloc
@@ -86,45 +113,127 @@ int slurm_spank_init(spank_t sp, int ac, char** av)
 //	return(0);
 //}
 
-static inline void silog(const char* format, va_list ap)
+static int spank_unset_var(void* sp, const char* name)
 {
-	//log_msg(6, format, ap);
-	//6 -> LOG_LEVEL_DEBUG (this isn't part of the public api)
-	char* tagged_fmt;
-	asprintf(&tagged_fmt, "slurm-inception: %s", format);
-	vsyslog(LOG_WARNING, tagged_fmt, ap);
-	free(tagged_fmt);
+	return(spank_unsetenv((spank_t) sp, name) == ESPANK_SUCCESS ? 0 : -1);
+}
+
+static int spank_set_var(void* sp, const char* entry)
+{
+	char* name = strndup(entry, strcspn(entry, "="));
+	int ret = -1;
+	if(name && spank_setenv((spank_t) sp, name, entry + strlen(name) + 1, 1) == ESPANK_SUCCESS)
+		ret = 0;
+	free(name);
+	return(ret);
+}
+
+int slurm_spank_init_post_opt(spank_t sp, int ac, char** av)
+{
+	//runs in slurmstepd as root once options are known and before any
+	//task is forked, so this is the one place per node per step we can
+	//parse the config and do the mounts
+	if(spank_context() != S_CTX_REMOTE || !image)
+		return(0);
+	set_inception_log(&silog);
+	slurm_debug("image is: \"%s\" from config \"%s\"\n", image, INCEPTION_CONFIG_PATH);
+	step_ctx = inception_create(INCEPTION_CONFIG_PATH);
+	int ret = step_ctx ? inception_load(step_ctx, image) : INCEPTION_ERR_NOMEM;
+	if(ret)
+	{
+		slurm_error("Error loading inception image %s: %s. Your job may fail",
+			image, inception_strerror(ret));
+		inception_free(step_ctx);
+		step_ctx = NULL;
+		free(image);
+		image = NULL;
+		return(-1);
+	}
+	free(image);
+	image = NULL;
+	image_config_t* step_image = inception_image(step_ctx);
+	slurm_debug("done parsing config");
+	//the job environment, before any task has a copy of it
+	char** job_env = NULL;
+	if(spank_get_item(sp, S_JOB_ENV, &job_env) == ESPANK_SUCCESS &&
+		apply_environ(step_image, job_env, &spank_unset_var, &spank_set_var, sp))
+		slurm_error("Unable to apply the image's environment rules");
+	//slurmstepd is threaded, so the mounts happen in a helper child
+	inception_span_t span;
+	inception_span_begin(&span, "prepare_namespace");
+	step_ns_fd = prepare_namespace(step_image);
+	inception_span_end(&span, step_image->name);
+	if(step_ns_fd < 0)
+		slurm_debug("unable to prepare step namespace, tasks will build their own");
+	return(0);
 }
 
 int slurm_spank_task_init_privileged(spank_t sp, int ac, char** av)
 {
-	image_config_t iimage;
-	memset(&iimage, 0, sizeof(image_config_t));
-	iimage.cwd = getcwd(NULL, MAXPATHLEN);
-	if(image)
+	char* cwd;
+	image_config_t* step_image;
+	int ret;
+	if(!step_ctx)
+		return(0);
+	step_image = inception_image(step_ctx);
+	cwd = getcwd(NULL, MAXPATHLEN);
+	if(step_ns_fd >= 0)
 	{
-		set_inception_log(&silog);
-		slurm_debug("image is: \"%s\" from config \"%s\"\n", image, INCEPTION_CONFIG_PATH);
-		if(parse_config(INCEPTION_CONFIG_PATH, image, &iimage) < 0)
+		if(enter_namespace(step_image, step_ns_fd))
 		{
-			slurm_error("Error loading inception image. Check the name. Your job may fail");
-			free(image);
+			slurm_error("Error joining inception namespace");
+			free(cwd);
 			return(-1);
 		}
-		free(image);
-		image = NULL;
-		slurm_debug("done parsing config");
-		setup_namespace(&iimage);
-		chdir(iimage.cwd);
 	}
-	free(iimage.cwd);
+	else if((ret = inception_launch(step_ctx)) != 0)
+	{
+		slurm_error("Error setting up inception namespace: %s", inception_strerror(ret));
+		free(cwd);
+		return(-1);
+	}
+	if(cwd)
+		chdir(cwd);
+	free(cwd);
+	if(step_image->mempolicy || step_image->num_cpu_map || step_image->thp)
+	{
+		int local_task;
+		uint32_t local_tasks = 0;
+		if(spank_get_item(sp, S_TASK_ID, &local_task) != ESPANK_SUCCESS)
+			local_task = -1;
+		spank_get_item(sp, S_JOB_LOCAL_TASK_COUNT, &local_tasks);
+		if(apply_placement(step_image, local_task, local_tasks))
+			slurm_info("inception image %s placement only partly applied",
+				step_image->name);
+	}
+	//let the task's loader use the image's flattened library directory
+	char ld_path[PATH_MAX*4];
+	if(spank_getenv(sp, "LD_LIBRARY_PATH", ld_path, sizeof(ld_path)) == ESPANK_SUCCESS)
+	{
+		char* cached = ld_cache_library_path(step_image, ld_path);
+		if(cached)
+			spank_setenv(sp, "LD_LIBRARY_PATH", cached, 1);
+		free(cached);
+	}
 	return(0);
 }
+
 int slurm_spank_exit(spank_t sp, int ac, char** av)
 {
 	if(image)
 	{
 		free(image);
+		image = NULL;
+	}
+	//tasks hold their own references, this just lets the namespace go
+	//once the last of them exits
+	if(step_ns_fd >= 0)
+	{
+		close(step_ns_fd);
+		step_ns_fd = -1;
 	}
+	//frees the image and lets its image file mounts go with the last task
+	inception_free(step_ctx);
+	step_ctx = NULL;
 	return(0);
 }
@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Node local image staging
+ *
+ * With INCEPTION_STAGE_DIR set (e.g. a directory on local NVMe) image files
+ * are copied there the first time a node uses them and loop mounted from the
+ * copy, so repeat jobs only stat the original on the parallel filesystem.
+ * Copies are named <key>.img after the original's dev/ino/size/mtime, so a
+ * rebuilt image is staged again and the old copy ages out.
+ *
+ * <key>.lock makes staging single flight: the first launch copies (to
+ * <key>.tmp, renamed into place when complete) while the others wait on the
+ * lock and then use its copy. The lock's mtime is also the copy's last use
+ * time. Before copying, the least recently used copies are removed until
+ * the new one fits in INCEPTION_STAGE_CAPACITY_MB (0: the filesystem minus
+ * a 5% reserve); copies that are being staged or are mounted are kept. An
+ * image that can't fit is used from its original location.
+ *
+ * An image with "sha256" is hashed while it is copied and is refused if the
+ * copy doesn't match. The digest of every hashed copy is kept in
+ * <key>.sha256 for reference. An image with "sha256" is never mounted
+ * unverified: when it isn't staged (no stage directory, no room, a failed
+ * copy) stage_verify() hashes the original instead.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/file.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#ifndef INCEPTION_STAGE_DIR
+#define INCEPTION_STAGE_DIR ""
+#endif
+#ifndef INCEPTION_STAGE_CAPACITY_MB
+#define INCEPTION_STAGE_CAPACITY_MB 0
+#endif
+
+#define STAGE_COPY_CHUNK (1024*1024)
+#define STAGE_RESERVE_PERCENT 5
+
+/*
+ * SHA-256 (FIPS 180-4)
+ */
+struct sha256
+{
+	uint32_t state[8];
+	uint64_t len;
+	unsigned char block[64];
+	size_t used;
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init(struct sha256* ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->len = 0;
+	ctx->used = 0;
+}
+
+static void sha256_block(struct sha256* ctx, const unsigned char* block)
+{
+	uint32_t w[64];
+	uint32_t s[8];
+	int i;
+	for(i=0;i<16;i++)
+		w[i] = (uint32_t) block[i*4] << 24 | (uint32_t) block[i*4+1] << 16 |
+			(uint32_t) block[i*4+2] << 8 | block[i*4+3];
+	for(i=16;i<64;i++)
+	{
+		uint32_t s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	memcpy(s, ctx->state, sizeof(s));
+	for(i=0;i<64;i++)
+	{
+		uint32_t t1 = s[7] + (ROR32(s[4], 6) ^ ROR32(s[4], 11) ^ ROR32(s[4], 25)) +
+			((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+		uint32_t t2 = (ROR32(s[0], 2) ^ ROR32(s[0], 13) ^ ROR32(s[0], 22)) +
+			((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, sizeof(uint32_t)*7);
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for(i=0;i<8;i++)
+		ctx->state[i] += s[i];
+}
+
+static void sha256_update(struct sha256* ctx, const unsigned char* data, size_t len)
+{
+	ctx->len += len;
+	while(len)
+	{
+		size_t n = 64 - ctx->used;
+		if(n > len)
+			n = len;
+		memcpy(ctx->block + ctx->used, data, n);
+		ctx->used += n;
+		data += n;
+		len -= n;
+		if(ctx->used == 64)
+		{
+			sha256_block(ctx, ctx->block);
+			ctx->used = 0;
+		}
+	}
+}
+
+/**
+ * Finish ctx into hex, which must have room for 65 chars
+ */
+static void sha256_hex(struct sha256* ctx, char* hex)
+{
+	unsigned char pad[72];
+	uint64_t bits = ctx->len * 8;
+	size_t pad_len = (ctx->used < 56 ? 56 : 120) - ctx->used;
+	int i;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for(i=0;i<8;i++)
+		pad[pad_len + i] = (unsigned char) (bits >> (56 - i*8));
+	sha256_update(ctx, pad, pad_len + 8);
+	for(i=0;i<8;i++)
+		snprintf(hex + i*8, 9, "%08x", ctx->state[i]);
+}
+
+/**
+ * Copy src into dst, hashing it if ctx is given
+ * @return 0 on success
+ */
+static int stage_copy(int src, int dst, off_t size, struct sha256* ctx)
+{
+	char* buf;
+	off_t copied = 0;
+	ssize_t len;
+	if(!ctx)
+	{
+		//lets the filesystems do it without bouncing through us
+		while(copied < size)
+		{
+			len = copy_file_range(src, NULL, dst, NULL, size - copied, 0);
+			if(len <= 0)
+				break;
+			copied += len;
+		}
+		if(copied == size)
+			return(0);
+		if(copied || (len < 0 && errno != EXDEV && errno != ENOSYS &&
+			errno != EINVAL && errno != EOPNOTSUPP))
+			return(-1);
+	}
+	buf = (char*) malloc(STAGE_COPY_CHUNK);
+	if(!buf)
+		return(-1);
+	while((len = pread(src, buf, STAGE_COPY_CHUNK, copied)) > 0)
+	{
+		ssize_t written = 0;
+		if(ctx)
+			sha256_update(ctx, (unsigned char*) buf, len);
+		while(written < len)
+		{
+			ssize_t n = write(dst, buf + written, len - written);
+			if(n <= 0)
+			{
+				free(buf);
+				return(-1);
+			}
+			written += n;
+		}
+		copied += len;
+	}
+	free(buf);
+	return(len == 0 && copied == size ? 0 : -1);
+}
+
+/**
+ * Remove the copy named key (the part before the suffix) if nobody is
+ * staging it. dir_fd is the stage directory.
+ * @return bytes freed or 0
+ */
+static off_t stage_evict(int dir_fd, const char* key)
+{
+	char name[64];
+	struct stat st;
+	off_t freed = 0;
+	int lock_fd;
+
+	snprintf(name, sizeof(name), "%s.lock", key);
+	lock_fd = openat(dir_fd, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+	if(lock_fd >= 0 && flock(lock_fd, LOCK_EX|LOCK_NB))
+	{
+		close(lock_fd);
+		return(0);
+	}
+	snprintf(name, sizeof(name), "%s.img", key);
+	if(fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+	{
+		//a mounted copy keeps its space until the mount goes anyway
+		if(imgfile_in_use(&st))
+		{
+			if(lock_fd >= 0)
+				close(lock_fd);
+			return(0);
+		}
+		freed = st.st_blocks * 512;
+		unlinkat(dir_fd, name, 0);
+	}
+	snprintf(name, sizeof(name), "%s.tmp", key);
+	if(fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && unlinkat(dir_fd, name, 0) == 0)
+		freed += st.st_blocks * 512;
+	snprintf(name, sizeof(name), "%s.sha256", key);
+	unlinkat(dir_fd, name, 0);
+	snprintf(name, sizeof(name), "%s.lock", key);
+	unlinkat(dir_fd, name, 0);
+	if(lock_fd >= 0)
+		close(lock_fd);
+	stats_record("stage_evict", NULL, 0);
+	return(freed);
+}
+
+struct stage_entry
+{
+	char key[17];
+	time_t last_use;
+};
+
+static int cmp_last_use(const void* a, const void* b)
+{
+	const struct stage_entry* x = (const struct stage_entry*) a;
+	const struct stage_entry* y = (const struct stage_entry*) b;
+	return((x->last_use > y->last_use) - (x->last_use < y->last_use));
+}
+
+/**
+ * Evict least recently used copies (other than keep) until need more bytes
+ * fit in the stage directory
+ * @return 0 if they fit
+ */
+static int stage_make_room(const char* dir, const char* keep, off_t need)
+{
+	struct stage_entry* entries = NULL;
+	struct statvfs vfs;
+	struct stat st;
+	struct dirent* ent;
+	DIR* d;
+	uint64_t capacity = (uint64_t) INCEPTION_STAGE_CAPACITY_MB * 1024 * 1024;
+	uint64_t used = 0, avail, reserve;
+	size_t num_entries = 0, alloced = 0, i;
+	int ret = -1;
+
+	if(statvfs(dir, &vfs))
+		return(-1);
+	avail = (uint64_t) vfs.f_bavail * vfs.f_frsize;
+	reserve = (uint64_t) vfs.f_blocks * vfs.f_frsize * STAGE_RESERVE_PERCENT / 100;
+	d = opendir(dir);
+	if(!d)
+		return(-1);
+	while((ent = readdir(d)))
+	{
+		char lock_name[32];
+		if(strlen(ent->d_name) != 20 || strcmp(ent->d_name + 16, ".img") ||
+			fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		used += st.st_blocks * 512;
+		if(strncmp(ent->d_name, keep, 16) == 0)
+			continue;
+		if(num_entries == alloced)
+		{
+			struct stage_entry* more;
+			alloced = alloced ? alloced*2 : 64;
+			more = (struct stage_entry*) realloc(entries, sizeof(*entries)*alloced);
+			if(!more)
+				goto out;
+			entries = more;
+		}
+		snprintf(entries[num_entries].key, sizeof(entries[num_entries].key), "%.16s",
+			ent->d_name);
+		//the lock's mtime is the last use
+		snprintf(lock_name, sizeof(lock_name), "%.16s.lock", ent->d_name);
+		if(fstatat(dirfd(d), lock_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			entries[num_entries].last_use = st.st_mtime;
+		else
+			entries[num_entries].last_use = 0;
+		num_entries++;
+	}
+	if(num_entries)
+		qsort(entries, num_entries, sizeof(*entries), cmp_last_use);
+	for(i=0;;i++)
+	{
+		if((!capacity || used + need <= capacity) && avail >= need + reserve)
+		{
+			ret = 0;
+			break;
+		}
+		if(i == num_entries)
+			break;
+		uint64_t freed = stage_evict(dirfd(d), entries[i].key);
+		used = freed < used ? used - freed : 0;
+		avail += freed;
+	}
+out:
+	closedir(d);
+	free(entries);
+	return(ret);
+}
+
+/**
+ * Make sure the stage directory exists and only root can put things in it
+ * @return 0 if usable
+ */
+static int stage_dir_ok(const char* dir)
+{
+	struct stat st;
+	if(mkdir(dir, 0755) && errno != EEXIST)
+		return(-1);
+	if(lstat(dir, &st) || !S_ISDIR(st.st_mode) ||
+		(st.st_uid != 0 && st.st_uid != geteuid()) ||
+		(st.st_mode & (S_IWGRP|S_IWOTH)))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @return nonzero if the digest recorded for a copy in sum_path is sha256
+ */
+static int stage_sum_matches(const char* sum_path, const char* sha256)
+{
+	char recorded[65];
+	FILE* sum = fopen(sum_path, "re");
+	int ret = 0;
+	if(!sum)
+		return(0);
+	if(fscanf(sum, "%64s", recorded) == 1)
+		ret = strcmp(recorded, sha256) == 0;
+	fclose(sum);
+	return(ret);
+}
+
+int stage_verify(const char* image_path, const char* sha256, int img_fd, off_t size)
+{
+	struct sha256 ctx;
+	inception_span_t span;
+	char digest[65];
+	char* buf;
+	off_t done = 0;
+	ssize_t len;
+
+	buf = (char*) malloc(STAGE_COPY_CHUNK);
+	if(!buf)
+		return(-1);
+	inception_span_begin(&span, "verify");
+	sha256_init(&ctx);
+	while(done < size && (len = pread(img_fd, buf, STAGE_COPY_CHUNK, done)) > 0)
+	{
+		sha256_update(&ctx, (unsigned char*) buf, len);
+		done += len;
+	}
+	free(buf);
+	stats_record("stage_verify", NULL, inception_span_end(&span, image_path));
+	if(done != size)
+	{
+		elog("Unable to verify %s: %s\n", image_path, strerror(errno));
+		return(-1);
+	}
+	sha256_hex(&ctx, digest);
+	if(strcmp(digest, sha256))
+	{
+		elog("Image file %s does not match its sha256 (got %s)\n", image_path, digest);
+		stats_record("stage_bad_sha256", NULL, 0);
+		return(-1);
+	}
+	return(0);
+}
+
+int stage_image(const char* image_path, const char* sha256, uint64_t key,
+		int* img_fd, struct stat* st)
+{
+	const char* dir = INCEPTION_STAGE_DIR;
+	char key_s[17];
+	char* img_path = NULL;
+	char* tmp_path = NULL;
+	char* lock_path = NULL;
+	char* sum_path = NULL;
+	char digest[65];
+	struct sha256 ctx;
+	struct stat staged;
+	inception_span_t span;
+	int lock_fd = -1, fd = -1, tmp_fd = -1, ret = 1;
+
+	if(!*dir)
+		return(1);
+	if(stage_dir_ok(dir))
+	{
+		elog("Unable to stage images in %s\n", dir);
+		return(1);
+	}
+	snprintf(key_s, sizeof(key_s), "%016llx", (unsigned long long) key);
+	if(asprintf(&img_path, "%s/%s.img", dir, key_s) == -1)
+		img_path = NULL;
+	if(asprintf(&tmp_path, "%s/%s.tmp", dir, key_s) == -1)
+		tmp_path = NULL;
+	if(asprintf(&lock_path, "%s/%s.lock", dir, key_s) == -1)
+		lock_path = NULL;
+	if(asprintf(&sum_path, "%s/%s.sha256", dir, key_s) == -1)
+		sum_path = NULL;
+	if(!img_path || !tmp_path || !lock_path || !sum_path)
+		goto out;
+
+	//whoever gets this first stages, everybody else waits for the copy
+	lock_fd = open(lock_path, O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0600);
+	if(lock_fd < 0 || flock(lock_fd, LOCK_EX))
+		goto out;
+	fd = open(img_path, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+	if(fd >= 0 && fstat(fd, &staged) == 0 && S_ISREG(staged.st_mode) &&
+		staged.st_size == st->st_size && (staged.st_uid == 0 || staged.st_uid == geteuid()) &&
+		(!sha256 || stage_sum_matches(sum_path, sha256)))
+	{
+		stats_record("stage_hit", NULL, 0);
+		goto staged;
+	}
+	if(fd >= 0)
+		close(fd);
+	fd = -1;
+
+	if(stage_make_room(dir, key_s, st->st_size))
+	{
+		stats_record("stage_no_room", NULL, 0);
+		goto out;
+	}
+	inception_span_begin(&span, "stage");
+	tmp_fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC|O_NOFOLLOW, 0644);
+	if(tmp_fd < 0)
+	{
+		inception_span_end(&span, image_path);
+		goto out;
+	}
+	if(sha256)
+		sha256_init(&ctx);
+	if(stage_copy(*img_fd, tmp_fd, st->st_size, sha256 ? &ctx : NULL) ||
+		fdatasync(tmp_fd))
+	{
+		elog("Unable to stage %s: %s\n", image_path, strerror(errno));
+		inception_span_end(&span, image_path);
+		unlink(tmp_path);
+		goto out;
+	}
+	if(sha256)
+	{
+		sha256_hex(&ctx, digest);
+		if(strcmp(digest, sha256))
+		{
+			elog("Image file %s does not match its sha256 (got %s)\n",
+				image_path, digest);
+			inception_span_end(&span, image_path);
+			stats_record("stage_bad_sha256", NULL, 0);
+			unlink(tmp_path);
+			ret = -1;
+			goto out;
+		}
+	}
+	close(tmp_fd);
+	tmp_fd = -1;
+	if(rename(tmp_path, img_path))
+	{
+		inception_span_end(&span, image_path);
+		unlink(tmp_path);
+		goto out;
+	}
+	if(sha256)
+	{
+		FILE* sum = fopen(sum_path, "we");
+		if(sum)
+		{
+			fprintf(sum, "%s  %s\n", digest, image_path);
+			fclose(sum);
+		}
+	}
+	stats_record("stage_copy", NULL, inception_span_end(&span, image_path));
+	fd = open(img_path, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+	if(fd < 0 || fstat(fd, &staged))
+		goto out;
+staged:
+	//last use, for eviction
+	futimens(lock_fd, NULL);
+	close(*img_fd);
+	*img_fd = fd;
+	*st = staged;
+	fd = -1;
+	ret = 0;
+out:
+	if(fd >= 0)
+		close(fd);
+	if(tmp_fd >= 0)
+		close(tmp_fd);
+	if(lock_fd >= 0)
+		close(lock_fd);
+	free(img_path);
+	free(tmp_path);
+	free(lock_path);
+	free(sum_path);
+	return(ret);
+}
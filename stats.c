@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Node wide launch statistics
+ *
+ * Every launch on the node (cli, pam_inception, slurm-inception) updates a
+ * small shared file under INCEPTION_RUN_DIR with relaxed atomics, no locks.
+ * Metrics are named slots in an open addressed table: finished trace spans
+ * land in a log2 latency histogram under the span name, launches are counted
+ * per image under "launch:<image>", and failures/cache outcomes are plain
+ * counters. inception-stat reads it back.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <jansson.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define STATS_MAGIC 0x54534e49 /* "INST" */
+#define STATS_VERSION 1
+#define STATS_SLOTS 512
+#define STATS_NAME_MAX 64
+#define STATS_BUCKETS 24
+
+#define SLOT_EMPTY 0
+#define SLOT_CLAIMED 1
+#define SLOT_READY 2
+
+struct stats_slot
+{
+	uint32_t state;
+	uint32_t pad;
+	char name[STATS_NAME_MAX];
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	//bucket 0 is <1us, bucket i is [2^(i-1), 2^i) us, the last is open ended
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_segment
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t pad;
+	uint64_t created;
+	struct stats_slot slots[STATS_SLOTS];
+};
+
+static struct stats_state {
+	int attempted;
+	struct stats_segment* seg;
+} stats = { 0, NULL };
+//threads launching at once (context API) race to map the segment
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* stats_path()
+{
+	char* path;
+	if(asprintf(&path, "%s/stats", INCEPTION_RUN_DIR) == -1)
+		return(NULL);
+	return(path);
+}
+
+static int stats_valid(const struct stats_segment* seg)
+{
+	return(seg->magic == STATS_MAGIC && seg->version == STATS_VERSION &&
+		seg->num_slots == STATS_SLOTS);
+}
+
+/**
+ * Map the segment read/write, creating it if we are the first launch
+ */
+static struct stats_segment* stats_create()
+{
+	struct stats_segment* seg;
+	struct stat st;
+	char* path;
+	int fd;
+
+	if(make_run_dir(NULL))
+		return(NULL);
+	path = stats_path();
+	if(!path)
+		return(NULL);
+	fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0644);
+	free(path);
+	if(fd < 0)
+		return(NULL);
+	if(fstat(fd, &st) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP|S_IWOTH)))
+	{
+		close(fd);
+		return(NULL);
+	}
+	if((size_t) st.st_size != sizeof(struct stats_segment))
+	{
+		//first launch since boot or an upgrade changed the layout
+		flock(fd, LOCK_EX);
+		if(fstat(fd, &st) == 0 && (size_t) st.st_size != sizeof(struct stats_segment))
+		{
+			if(ftruncate(fd, 0) || ftruncate(fd, sizeof(struct stats_segment)))
+			{
+				flock(fd, LOCK_UN);
+				close(fd);
+				return(NULL);
+			}
+		}
+		flock(fd, LOCK_UN);
+	}
+	seg = mmap(NULL, sizeof(struct stats_segment), PROT_READ|PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if(seg == MAP_FAILED)
+	{
+		close(fd);
+		return(NULL);
+	}
+	if(!stats_valid(seg))
+	{
+		flock(fd, LOCK_EX);
+		if(!stats_valid(seg))
+		{
+			memset(seg, 0, sizeof(struct stats_segment));
+			seg->num_slots = STATS_SLOTS;
+			seg->version = STATS_VERSION;
+			seg->created = time(NULL);
+			__atomic_store_n(&seg->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+		}
+		flock(fd, LOCK_UN);
+	}
+	close(fd);
+	return(seg);
+}
+
+void inception_stats_disable()
+{
+	pthread_mutex_lock(&stats_lock);
+	stats.seg = NULL;
+	__atomic_store_n(&stats.attempted, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+int stats_enabled()
+{
+#ifdef INCEPTION_STATS
+	if(!__atomic_load_n(&stats.attempted, __ATOMIC_ACQUIRE))
+	{
+		pthread_mutex_lock(&stats_lock);
+		if(!stats.attempted)
+		{
+			stats.seg = stats_create();
+			__atomic_store_n(&stats.attempted, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&stats_lock);
+	}
+	return(stats.seg != NULL);
+#else
+	return(0);
+#endif
+}
+
+static uint32_t stats_hash(const char* name)
+{
+	uint32_t hash = 2166136261u;
+	for(; *name; name++)
+	{
+		hash ^= (unsigned char) *name;
+		hash *= 16777619u;
+	}
+	return(hash);
+}
+
+/**
+ * Find or claim the slot for name
+ * @return slot or NULL if the table is full
+ */
+static struct stats_slot* stats_slot(struct stats_segment* seg, const char* name)
+{
+	uint32_t idx = stats_hash(name) % STATS_SLOTS;
+	uint32_t probe;
+	for(probe=0;probe<STATS_SLOTS;probe++, idx=(idx+1) % STATS_SLOTS)
+	{
+		struct stats_slot* slot = &seg->slots[idx];
+		uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		int spins = 0;
+		if(state == SLOT_EMPTY)
+		{
+			uint32_t expected = SLOT_EMPTY;
+			if(__atomic_compare_exchange_n(&slot->state, &expected, SLOT_CLAIMED,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				strncpy(slot->name, name, STATS_NAME_MAX - 1);
+				__atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+				return(slot);
+			}
+			state = expected;
+		}
+		//somebody else is naming this slot, it only takes a strncpy
+		while(state == SLOT_CLAIMED && spins++ < 1000000)
+			state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if(state == SLOT_READY && strncmp(slot->name, name, STATS_NAME_MAX - 1) == 0)
+			return(slot);
+	}
+	return(NULL);
+}
+
+void stats_record(const char* name, const char* detail, uint64_t dur_ns)
+{
+	char key[STATS_NAME_MAX];
+	struct stats_slot* slot;
+	uint64_t us = dur_ns / 1000;
+	uint64_t max;
+	int bucket = 0;
+
+	if(!stats_enabled())
+		return;
+	if(detail)
+	{
+		snprintf(key, sizeof(key), "%s:%s", name, detail);
+		name = key;
+	}
+	slot = stats_slot(stats.seg, name);
+	if(!slot)
+		return;
+	while(us && bucket < STATS_BUCKETS - 1)
+	{
+		us >>= 1;
+		bucket++;
+	}
+	__atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&slot->sum_ns, dur_ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&slot->buckets[bucket], 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&slot->max_ns, __ATOMIC_RELAXED);
+	while(dur_ns > max && !__atomic_compare_exchange_n(&slot->max_ns, &max, dur_ns,
+		0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Upper bound in microseconds of the bucket holding quantile q
+ */
+static uint64_t stats_quantile(const struct stats_slot* slot, uint64_t count, double q)
+{
+	uint64_t target = (uint64_t) (q * count + 0.5);
+	uint64_t seen = 0;
+	int i;
+	if(target == 0)
+		target = 1;
+	for(i=0;i<STATS_BUCKETS;i++)
+	{
+		seen += slot->buckets[i];
+		if(seen >= target)
+			return(i == 0 ? 1 : 1ull << i);
+	}
+	return(1ull << (STATS_BUCKETS - 1));
+}
+
+int inception_stats_print(FILE* out, int as_json)
+{
+	struct stats_segment* seg;
+	struct stat st;
+	json_t* doc = NULL;
+	json_t* metrics = NULL;
+	char* path = stats_path();
+	int fd, i, b;
+
+	if(!path)
+		return(-1);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd < 0)
+	{
+		elog("Unable to open %s: %s\n", path, strerror(errno));
+		free(path);
+		return(-1);
+	}
+	free(path);
+	if(fstat(fd, &st) || (size_t) st.st_size != sizeof(struct stats_segment))
+	{
+		elog("No launch statistics recorded yet\n");
+		close(fd);
+		return(-1);
+	}
+	seg = mmap(NULL, sizeof(struct stats_segment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(seg == MAP_FAILED)
+		return(-1);
+	if(!stats_valid(seg))
+	{
+		elog("Launch statistics have an unknown layout\n");
+		munmap(seg, sizeof(struct stats_segment));
+		return(-1);
+	}
+
+	if(as_json)
+	{
+		doc = json_object();
+		metrics = json_object();
+		json_object_set_new(doc, "since", json_integer(seg->created));
+	}
+	else
+	{
+		fprintf(out, "%-40s %10s %10s %10s %10s %10s\n",
+			"metric", "count", "mean_us", "p50_us", "p99_us", "max_us");
+	}
+	for(i=0;i<STATS_SLOTS;i++)
+	{
+		const struct stats_slot* slot = &seg->slots[i];
+		uint64_t count, sum;
+		if(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_READY)
+			continue;
+		count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+		sum = __atomic_load_n(&slot->sum_ns, __ATOMIC_RELAXED);
+		if(as_json)
+		{
+			json_t* m = json_object();
+			json_t* buckets = json_array();
+			json_object_set_new(m, "count", json_integer(count));
+			json_object_set_new(m, "sum_ns", json_integer(sum));
+			json_object_set_new(m, "max_ns", json_integer(slot->max_ns));
+			for(b=0;b<STATS_BUCKETS;b++)
+				json_array_append_new(buckets, json_integer(slot->buckets[b]));
+			json_object_set_new(m, "log2_us_buckets", buckets);
+			json_object_set_new(metrics, slot->name, m);
+		}
+		else
+		{
+			fprintf(out, "%-40s %10llu %10llu %10llu %10llu %10llu\n", slot->name,
+				(unsigned long long) count,
+				(unsigned long long) (count ? sum / count / 1000 : 0),
+				(unsigned long long) (count ? stats_quantile(slot, count, 0.50) : 0),
+				(unsigned long long) (count ? stats_quantile(slot, count, 0.99) : 0),
+				(unsigned long long) (slot->max_ns / 1000));
+		}
+	}
+	if(as_json)
+	{
+		json_object_set_new(doc, "metrics", metrics);
+		json_dumpf(doc, out, JSON_INDENT(2));
+		fprintf(out, "\n");
+		json_decref(doc);
+	}
+	munmap(seg, sizeof(struct stats_segment));
+	return(0);
+}
+
+int inception_stats_reset()
+{
+	char* path = stats_path();
+	int ret;
+	if(!path)
+		return(-1);
+	//the next launch recreates it, mappings already out there keep the
+	//old (now unlinked) copy until they exit
+	ret = unlink(path);
+	if(ret && errno != ENOENT)
+		elog("Unable to reset statistics: %s\n", strerror(errno));
+	free(path);
+	return(ret && errno != ENOENT ? -1 : 0);
+}
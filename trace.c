@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2018, University Corporation for Atmospheric Research
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Launch phase tracing
+ *
+ * Spans are only timed when tracing is on (inception_trace_open() or
+ * inception_trace_log()) or node statistics are being kept, otherwise
+ * begin/end cost a branch. Finished spans always feed the statistics.
+ * Events are written one per line in the Chrome trace event format (the
+ * closing ']' is optional there), so a trace file shared by every rank on a
+ * node loads straight into chrome://tracing or perfetto and is still easy to
+ * grep. Each event is a single O_APPEND write, so concurrent launches can
+ * share a file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include "inception.h"
+#include "inception_private.h"
+
+#define TRACE_LINE_MAX 1024
+
+static struct trace_state {
+	int enabled;
+	int fd;
+	int to_log;
+} trace = { 0, -1, 0 };
+
+static uint64_t trace_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return((uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec);
+}
+
+int inception_trace_open(const char* path)
+{
+	struct stat st;
+	uid_t old_fsuid;
+	gid_t old_fsgid;
+	int fd;
+
+	//we are usually still setuid root here, the file is the user's
+	old_fsgid = setfsgid(getgid());
+	old_fsuid = setfsuid(getuid());
+	fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0644);
+	setfsuid(old_fsuid);
+	setfsgid(old_fsgid);
+	if(fd < 0)
+	{
+		elog("Unable to open trace file %s: %s\n", path, strerror(errno));
+		return(-1);
+	}
+	flock(fd, LOCK_EX);
+	if(fstat(fd, &st) == 0 && st.st_size == 0)
+		write(fd, "[\n", 2);
+	flock(fd, LOCK_UN);
+	if(trace.fd >= 0)
+		close(trace.fd);
+	trace.fd = fd;
+	trace.enabled = 1;
+	return(0);
+}
+
+void inception_trace_log(int enable)
+{
+	trace.to_log = enable;
+	trace.enabled = trace.fd >= 0 || trace.to_log;
+}
+
+void trace_after_fork()
+{
+	//elog() may take locks another thread held at the fork, a trace file
+	//only takes a write()
+	trace.to_log = 0;
+	trace.enabled = trace.fd >= 0;
+}
+
+int inception_tracing()
+{
+	return(trace.enabled);
+}
+
+/**
+ * Append str to buf as the body of a json string
+ */
+static size_t json_escape(char* buf, size_t len, size_t off, const char* str)
+{
+	for(; str && *str && off + 7 < len; str++)
+	{
+		unsigned char c = (unsigned char) *str;
+		if(c == '"' || c == '\\')
+		{
+			buf[off++] = '\\';
+			buf[off++] = c;
+		}
+		else if(c < 0x20)
+			off += snprintf(buf + off, len - off, "\\u%04x", c);
+		else
+			buf[off++] = c;
+	}
+	return(off);
+}
+
+static void trace_emit(const char* name, char phase, uint64_t start, uint64_t dur,
+			const char* detail)
+{
+	char line[TRACE_LINE_MAX];
+	size_t off;
+	int saved_errno = errno;
+
+	if(trace.fd >= 0)
+	{
+		off = snprintf(line, sizeof(line),
+			"{\"name\":\"%s\",\"cat\":\"inception\",\"ph\":\"%c\",\"ts\":%llu.%03llu,",
+			name, phase,
+			(unsigned long long) (start / 1000), (unsigned long long) (start % 1000));
+		if(phase == 'X')
+			off += snprintf(line + off, sizeof(line) - off, "\"dur\":%llu.%03llu,",
+				(unsigned long long) (dur / 1000), (unsigned long long) (dur % 1000));
+		else
+			off += snprintf(line + off, sizeof(line) - off, "\"s\":\"t\",");
+		off += snprintf(line + off, sizeof(line) - off,
+			"\"pid\":%d,\"tid\":%ld,\"args\":{\"detail\":\"",
+			getpid(), (long) syscall(SYS_gettid));
+		off = json_escape(line, sizeof(line) - 6, off, detail);
+		memcpy(line + off, "\"}},\n", 5);
+		off += 5;
+		write(trace.fd, line, off);
+	}
+	if(trace.to_log)
+	{
+		elog("trace: %s %llu.%03llu ms %s\n", name,
+			(unsigned long long) (dur / 1000000),
+			(unsigned long long) (dur / 1000 % 1000),
+			detail ? detail : "");
+	}
+	errno = saved_errno;
+}
+
+void inception_span_begin(inception_span_t* span, const char* name)
+{
+	span->name = name;
+	span->start = (trace.enabled || stats_enabled()) ? trace_now() : 0;
+}
+
+uint64_t inception_span_end(inception_span_t* span, const char* detail)
+{
+	uint64_t dur;
+	if(!span->start)
+		return(0);
+	dur = trace_now() - span->start;
+	if(trace.enabled)
+		trace_emit(span->name, 'X', span->start, dur, detail);
+	stats_record(span->name, NULL, dur);
+	span->start = 0;
+	return(dur);
+}
+
+void inception_trace_instant(const char* name, const char* detail)
+{
+	if(!trace.enabled)
+		return;
+	trace_emit(name, 'i', trace_now(), 0, detail);
+}